@@ -8,7 +8,9 @@
 #define LOG_MODULE_NAME nordic_ble_client
 LOG_MODULE_REGISTER(LOG_MODULE_NAME, LOG_LEVEL_INF);
 
+// Written by the connection callbacks and read from the hostcomm thread, always taken with a reference under the lock
 static struct bt_conn *current_conn;
+static struct k_spinlock current_conn_lock;
 static struct bt_conn *auth_conn;
 
 ble_priv_data_t ble_priv_data;
@@ -22,6 +24,68 @@ static const struct bt_data sd[] = {
 	BT_DATA_BYTES(BT_DATA_UUID128_ALL, BT_UUID_NUS_VAL),
 };
 
+// Reference to the current connection, NULL if there is none. Must be given back with bt_conn_unref().
+static struct bt_conn *ble_get_conn(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&current_conn_lock);
+	struct bt_conn *conn = current_conn ? bt_conn_ref(current_conn) : NULL;
+	k_spin_unlock(&current_conn_lock, key);
+
+	return conn;
+}
+
+static void mtu_exchanged(struct bt_conn *conn, uint8_t err, struct bt_gatt_exchange_params *params)
+{
+	if (err) {
+		LOG_WRN("MTU exchange failed (err %u)", err);
+		return;
+	}
+
+	ble_priv_data.link.mtu = bt_gatt_get_mtu(conn);
+	LOG_INF("MTU %d", ble_priv_data.link.mtu);
+}
+
+// Ask the central for the fastest link, every request is answered later in one of the connection callbacks
+static void negotiate_work_handler(struct k_work *work)
+{
+	int err;
+	struct bt_conn *conn = ble_get_conn();
+
+	if (!conn) {
+		return;
+	}
+
+#if defined(CONFIG_BT_USER_DATA_LEN_UPDATE)
+	err = bt_conn_le_data_len_update(conn, BT_LE_DATA_LEN_PARAM_MAX);
+	if (err) {
+		LOG_WRN("Data length update failed (err %d)", err);
+	}
+#endif
+
+#if defined(CONFIG_BT_USER_PHY_UPDATE)
+	err = bt_conn_le_phy_update(conn, BT_CONN_LE_PHY_PARAM_2M);
+	if (err) {
+		LOG_WRN("PHY update failed (err %d)", err);
+	}
+#endif
+
+#if defined(CONFIG_BT_GATT_CLIENT)
+	ble_priv_data.mtu_exchange_params.func = mtu_exchanged;
+	err = bt_gatt_exchange_mtu(conn, &ble_priv_data.mtu_exchange_params);
+	if (err) {
+		LOG_WRN("MTU exchange failed (err %d)", err);
+	}
+#endif
+
+	err = bt_conn_le_param_update(conn, BT_LE_CONN_PARAM(BLE_CONN_INTERVAL_MIN, BLE_CONN_INTERVAL_MAX,
+							     BLE_CONN_LATENCY, BLE_CONN_TIMEOUT));
+	if (err) {
+		LOG_WRN("Connection parameter update failed (err %d)", err);
+	}
+
+	bt_conn_unref(conn);
+}
+
 void error(void)
 {
 	dk_set_leds_state(DK_ALL_LEDS_MSK, DK_NO_LEDS_MSK);
@@ -44,7 +108,27 @@ static void connected(struct bt_conn *conn, uint8_t err)
 	bt_addr_le_to_str(bt_conn_get_dst(conn), addr, sizeof(addr));
 	LOG_INF("Connected %s", log_strdup(addr));
 
-	current_conn = bt_conn_ref(conn);
+	struct bt_conn *ref = bt_conn_ref(conn);
+	k_spinlock_key_t key = k_spin_lock(&current_conn_lock);
+	current_conn = ref;
+	k_spin_unlock(&current_conn_lock, key);
+
+	// Every connection starts out with the defaults, the callbacks below fill in what gets negotiated
+	struct bt_conn_info info;
+	memset(&ble_priv_data.link, 0, sizeof(ble_link_info_t));
+	ble_priv_data.link.connected = true;
+	ble_priv_data.link.tx_phy = BT_GAP_LE_PHY_1M;
+	ble_priv_data.link.rx_phy = BT_GAP_LE_PHY_1M;
+	ble_priv_data.link.tx_max_len = BT_GAP_DATA_LEN_DEFAULT;
+	ble_priv_data.link.rx_max_len = BT_GAP_DATA_LEN_DEFAULT;
+	ble_priv_data.link.mtu = bt_gatt_get_mtu(conn);
+	if (!bt_conn_get_info(conn, &info)) {
+		ble_priv_data.link.interval = info.le.interval;
+		ble_priv_data.link.latency = info.le.latency;
+		ble_priv_data.link.timeout = info.le.timeout;
+	}
+
+	k_work_submit(&ble_priv_data.negotiate_work);
 
 	dk_set_led_on(CON_STATUS_LED);
 
@@ -65,20 +149,62 @@ static void disconnected(struct bt_conn *conn, uint8_t reason)
 		auth_conn = NULL;
 	}
 
-	if (current_conn) {
-		bt_conn_unref(current_conn);
-		current_conn = NULL;
+	k_spinlock_key_t key = k_spin_lock(&current_conn_lock);
+	struct bt_conn *old_conn = current_conn;
+	current_conn = NULL;
+	k_spin_unlock(&current_conn_lock, key);
+
+	// ble_send() may still hold its own reference, the connection goes away once it lets go
+	if (old_conn) {
+		bt_conn_unref(old_conn);
 		dk_set_led_off(CON_STATUS_LED);
 	}
 
 	// Reset our outgoing message counter when client disconnects
 	ble_priv_data.outgoing_msg_counter = 0;
+	ble_priv_data.link.connected = false;
+}
+
+static void le_param_updated(struct bt_conn *conn, uint16_t interval, uint16_t latency, uint16_t timeout)
+{
+	ble_priv_data.link.interval = interval;
+	ble_priv_data.link.latency = latency;
+	ble_priv_data.link.timeout = timeout;
+
+	LOG_INF("Connection interval %d us, latency %d, timeout %d ms", interval * 1250, latency, timeout * 10);
+}
+
+#if defined(CONFIG_BT_USER_PHY_UPDATE)
+static void le_phy_updated(struct bt_conn *conn, struct bt_conn_le_phy_info *param)
+{
+	ble_priv_data.link.tx_phy = param->tx_phy;
+	ble_priv_data.link.rx_phy = param->rx_phy;
+
+	LOG_INF("PHY tx %d rx %d", param->tx_phy, param->rx_phy);
+}
+#endif
+
+#if defined(CONFIG_BT_USER_DATA_LEN_UPDATE)
+static void le_data_len_updated(struct bt_conn *conn, struct bt_conn_le_data_len_info *info)
+{
+	ble_priv_data.link.tx_max_len = info->tx_max_len;
+	ble_priv_data.link.rx_max_len = info->rx_max_len;
+
+	LOG_INF("Data length tx %d rx %d", info->tx_max_len, info->rx_max_len);
 }
+#endif
 
 
 BT_CONN_CB_DEFINE(conn_callbacks) = {
 	.connected    = connected,
-	.disconnected = disconnected
+	.disconnected = disconnected,
+	.le_param_updated = le_param_updated,
+#if defined(CONFIG_BT_USER_PHY_UPDATE)
+	.le_phy_updated = le_phy_updated,
+#endif
+#if defined(CONFIG_BT_USER_DATA_LEN_UPDATE)
+	.le_data_len_updated = le_data_len_updated,
+#endif
 };
 
 
@@ -103,20 +229,66 @@ static struct bt_nus_cb nus_cb = {
 };
 
 
-// Send message using Nordic's BLE stack. Do not call this function directly. It bypasses any crc 
-// that we are building.
-void ble_send(uint8_t * data, uint32_t len)
+// Send message using Nordic's BLE stack, one notification per ATT MTU, each with its fragment byte (see ble.h). Do not
+// call this function directly. It bypasses any crc that we are building.
+int ble_send(uint8_t * data, uint32_t len)
 {
-	if (bt_nus_send(NULL, data, (uint16_t) len)) {
-		LOG_DBG("Failed to send data over BLE connection");
+	uint8_t fragment[BLE_FRAGMENT_HEADER_SIZE + BLE_FRAGMENT_MAX_DATA];
+
+	// The connection may go away while we send, our reference keeps it until we are done
+	struct bt_conn *conn = ble_get_conn();
+
+	if (!conn) {
+		return -ENOTCONN;
 	}
+
+	// The MTU can change at any time (the central may start an exchange itself), look it up for every message
+	uint16_t mtu = bt_gatt_get_mtu(conn);
+	uint32_t fragment_size = (mtu > BLE_ATT_NOTIFY_HEADER_SIZE + BLE_FRAGMENT_HEADER_SIZE) ?
+				 MIN(mtu - BLE_ATT_NOTIFY_HEADER_SIZE - BLE_FRAGMENT_HEADER_SIZE, BLE_FRAGMENT_MAX_DATA) : 0;
+	int err = (fragment_size == 0) ? -ENOTCONN : 0;
+
+	ble_priv_data.link.mtu = mtu;
+
+	uint32_t following = err ? 0 : (len + fragment_size - 1) / fragment_size - 1;
+	if (following > BLE_FRAGMENT_MAX_FOLLOWING) {
+		err = -EMSGSIZE;
+	}
+
+	// bt_nus_send() waits for a free buffer, so this is throttled to whatever the link can take
+	for (uint32_t offset = 0; offset < len && !err; offset += fragment_size, following--) {
+		uint16_t fragment_len = MIN(len - offset, fragment_size);
+
+		fragment[0] = following | (offset == 0 ? BLE_FRAGMENT_FIRST : 0);
+		memcpy(&fragment[BLE_FRAGMENT_HEADER_SIZE], data + offset, fragment_len);
+
+		err = bt_nus_send(conn, fragment, BLE_FRAGMENT_HEADER_SIZE + fragment_len);
+		if (!err) {
+			ble_priv_data.stats.notifications++;
+			ble_priv_data.stats.bytes += fragment_len;
+		}
+	}
+
+	bt_conn_unref(conn);
+
+	// The rest of a message is no use once a part is missing, the host sees the count break off and drops it
+	if (err) {
+		ble_priv_data.stats.failed++;
+		LOG_DBG("Failed to send data over BLE connection (err %d)", err);
+		return err;
+	}
+
+	ble_priv_data.stats.packets++;
+
+	return 0;
 }
 
 // Send bytes to currently connected client. 
-void ble_send_bytes(uint8_t * data, uint32_t len) {
+int ble_send_bytes(uint8_t * data, uint32_t len) {
 
 	if (len > BLE_MAX_DATA_SIZE) {
-		LOG_ERR("Send failed due to size too big. This function needs to be improved to handle big writes.");
+		LOG_ERR("Send of %d bytes failed, at most %d bytes at a time", len, BLE_MAX_DATA_SIZE);
+		return -EMSGSIZE;
 	}
 
 	//ble_data_t buf = {0}; // TODO: fix this to save stack space
@@ -133,7 +305,36 @@ void ble_send_bytes(uint8_t * data, uint32_t len) {
 	//memcpy(&(buf.data[1]), data, len);
 	//buf.len = len + 1; // +1 here because we allocated extra byte as counter
 
-	ble_send(data, len);
+	return ble_send(data, len);
+}
+
+void ble_get_link_info(ble_link_info_t * info)
+{
+	*info = ble_priv_data.link;
+}
+
+void ble_log_stats(void)
+{
+	ble_stats_t stats = ble_priv_data.stats;
+	ble_link_info_t link = ble_priv_data.link;
+	int64_t now = k_uptime_get();
+	int64_t elapsed_ms = now - ble_priv_data.last_log_time_ms;
+
+	uint32_t bytes = stats.bytes - ble_priv_data.last_log_stats.bytes;
+	uint32_t kbps = (elapsed_ms > 0) ? (uint32_t) ((int64_t) bytes * 8 / elapsed_ms) : 0;
+
+	if (link.connected) {
+		LOG_INF("BLE link: interval %d us, latency %d, PHY tx %d rx %d, data length tx %d rx %d, MTU %d",
+			link.interval * 1250, link.latency, link.tx_phy, link.rx_phy, link.tx_max_len, link.rx_max_len,
+			link.mtu);
+	}
+	LOG_INF("BLE: %d kbit/s, %d packets in %d notifications, %d failed", kbps,
+		stats.packets - ble_priv_data.last_log_stats.packets,
+		stats.notifications - ble_priv_data.last_log_stats.notifications,
+		stats.failed - ble_priv_data.last_log_stats.failed);
+
+	ble_priv_data.last_log_stats = stats;
+	ble_priv_data.last_log_time_ms = now;
 }
 
 void ble_init(ble_receive_data_handler_t ble_receive_data_callback)
@@ -147,6 +348,9 @@ void ble_init(ble_receive_data_handler_t ble_receive_data_callback)
 	if (ble_receive_data_callback)
 		ble_priv_data.receive_data_handler = ble_receive_data_callback;
 
+	k_work_init(&ble_priv_data.negotiate_work, negotiate_work_handler);
+	ble_priv_data.last_log_time_ms = k_uptime_get();
+
 	err = bt_enable(NULL);
 	if (err) {
 		error();
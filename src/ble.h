@@ -1,8 +1,11 @@
+#pragma once
+
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/uuid.h>
 #include <bluetooth/gatt.h>
 #include <bluetooth/hci.h>
 #include <bluetooth/services/nus.h>
+#include <kernel.h>
 
 #define STACKSIZE CONFIG_BT_NUS_THREAD_STACK_SIZE
 #define PRIORITY 7
@@ -12,20 +15,67 @@
 #define BLE_HEADER_SIZE  4
 #define BLE_MAX_TRANSFER_SIZE (BLE_MAX_DATA_SIZE + BLE_HEADER_SIZE)  // Allowing 4 bytes of header, and 1024 bytes of data in 1 single send operation
 
+#define BLE_ATT_NOTIFY_HEADER_SIZE 3  // Opcode and handle in front of every notification
+
+#define BLE_FRAGMENT_HEADER_SIZE 1     // Our own byte in front of every notification, see below
+#define BLE_FRAGMENT_FIRST 0x80        // Set in that byte on the first notification of a packet
+#define BLE_FRAGMENT_MAX_FOLLOWING 0x7F
+#define BLE_FRAGMENT_MAX_DATA (CONFIG_BT_L2CAP_TX_MTU - BLE_ATT_NOTIFY_HEADER_SIZE - BLE_FRAGMENT_HEADER_SIZE)
+
+/*
+On every connection the device asks for the fastest link the central will give: the longest data length (data
+length extension, up to 251 byte link layer packets), the 2M PHY, the largest ATT MTU and a connection interval
+between BLE_CONN_INTERVAL_MIN and BLE_CONN_INTERVAL_MAX. The central has the last word on all of them, whatever it
+settled on ends up in ble_link_info_t.
+
+Data is sent as NUS notifications of at most ATT MTU - 3 bytes. Longer data is cut into several notifications that
+go out back to back, in order, and the host joins them again. Every notification starts with one fragment byte:
+BLE_FRAGMENT_FIRST on the first notification of a packet, and in the low 7 bits the number of notifications of the
+packet still to come after this one. A packet is complete when that number reaches 0. If sending stops halfway
+through a packet, the host sees the next BLE_FRAGMENT_FIRST (or a count that does not go down by one) and drops the
+part it has. With the MTU negotiated a whole packet fits in one notification.
+*/
+
 typedef void (*ble_receive_data_handler_t) (uint8_t * data, size_t length);
 
-typedef struct ble_data_t {
-	uint8_t data[BLE_MAX_TRANSFER_SIZE];
-	uint16_t len;
-}ble_data_t;
+// Link parameters in use on the current connection
+typedef struct ble_link_info_t {
+	bool connected;
+	uint16_t interval;      // units of 1.25 ms
+	uint16_t latency;       // connection events
+	uint16_t timeout;       // units of 10 ms
+	uint8_t tx_phy;         // BT_GAP_LE_PHY_1M, BT_GAP_LE_PHY_2M, ...
+	uint8_t rx_phy;
+	uint16_t tx_max_len;    // link layer payload bytes
+	uint16_t rx_max_len;
+	uint16_t mtu;           // ATT MTU
+} ble_link_info_t;
+
+// Counters since boot, throughput comes from the difference between two logs
+typedef struct ble_stats_t {
+	uint32_t bytes;         // bytes of data handed to the stack
+	uint32_t packets;       // ble_send_bytes() calls that went out whole
+	uint32_t notifications;
+	uint32_t failed;        // ble_send_bytes() calls that did not go out whole, the host drops what arrived
+} ble_stats_t;
 
 typedef struct ble_priv_data_t {
 	ble_receive_data_handler_t receive_data_handler;
-	ble_data_t scrap_data_buf;
 	uint8_t outgoing_msg_counter;
 	uint8_t incoming_msg_counter; // not used for now
+
+	struct k_work negotiate_work;  // link parameter requests are sent from the system work queue
+	struct bt_gatt_exchange_params mtu_exchange_params;
+	ble_link_info_t link;
+	ble_stats_t stats;
+
+	// For throughput, stats and time of the last log
+	ble_stats_t last_log_stats;
+	int64_t last_log_time_ms;
 } ble_priv_data_t;
 
 void ble_init(ble_receive_data_handler_t ble_receive_data_callback);
-void ble_send(uint8_t * data, uint32_t len);
-void ble_send_bytes(uint8_t * data, uint32_t len);
+int ble_send(uint8_t * data, uint32_t len);
+int ble_send_bytes(uint8_t * data, uint32_t len);
+void ble_get_link_info(ble_link_info_t * info);
+void ble_log_stats(void);
@@ -9,10 +9,55 @@
 #define USER_BUTTON             DK_BTN1_MSK
 
 /* Configuration for Main Application */
-#define DEFAULT_SAMPLE_DELAY_US 1000  // This translates to 1000 samples per second = 1kS/sec
+#define DEFAULT_SAMPLE_PERIOD_US 1000  // Period of the hardware sample clock, one frame per period. 1000 = 1kS/sec per channel. Must be longer than a frame takes on the SPI bus (CONFIG_SPI_FREQ_HZ)
 
 /* Configuration for Hostcomm */
 #define HOSTCOMM_MAX_PACKET_PER_TRANSMISSION 64
+#define SAMPLE_POOL_NUM_BLOCKS 12  // Every sample block in the system, this is the whole static RAM used for sample data
+#define SAMPLE_RING_NUM_BLOCKS 16  // Sample block pointers between Intan and hostcomm, power of 2 >= SAMPLE_POOL_NUM_BLOCKS
+#define SAMPLE_RING_NUM_URGENT 4   // Blocks that go out ahead of the others (decoder output), power of 2
+#define HOSTCOMM_MAX_TRANSPORTS 2  // Transports (BLE, USB) every sample block is fanned out to
+#define HOSTCOMM_MAX_SPIKES_PER_TRANSMISSION 2  // Spikes per spike packet, a spike packet must fit a sample block
+#define HOSTCOMM_MAX_UNITS_PER_TRANSMISSION 30  // Sorted spikes per unit packet, a unit packet must fit a sample block
+#define HOSTCOMM_MAX_LFP_PER_TRANSMISSION 62  // Decimated samples per LFP packet, an LFP packet must fit a sample block
+
+/* Configuration for BLE */
+#define BLE_CONN_INTERVAL_MIN 6    // Connection interval asked for on connect, units of 1.25 ms. 6 = 7.5 ms
+#define BLE_CONN_INTERVAL_MAX 12   // 15 ms, some centrals (phones) do not go below this
+#define BLE_CONN_LATENCY 0         // Connection events the device may skip, it always has data so none
+#define BLE_CONN_TIMEOUT 400       // Supervision timeout, units of 10 ms
 
 /* Configuration for Intan */
-#define INTAN_BUFFER_SIZE 64
\ No newline at end of file
+#define INTAN_BUFFER_SIZE 64
+#define INTAN_FRAME_QUEUE_DEPTH 8  // Frames decoded in completion context waiting for the Intan thread
+#define INTAN_AUX_QUEUE_DEPTH 16   // Commands per priority waiting for an aux slot
+#define INTAN_DEFAULT_AUX_SLOTS 4  // Aux slots per frame (1-4), fewer slots give a higher sample rate at the same SPI word rate
+#define INTAN_AUX_STIM_DEADLINE_FRAMES 0          // Stimulation commands belong in the very next frame
+#define INTAN_AUX_HOST_DEADLINE_FRAMES 10
+#define INTAN_AUX_HOUSEKEEPING_DEADLINE_FRAMES 100
+#define INTAN_CHIP_ID_CHECK_INTERVAL_MS 20  // The chip ID is read this often to notice a chip that was reset
+#define INTAN_REGISTER_READ_QUEUE_DEPTH 8   // Register reads for the host waiting to be sent
+#define INTAN_TRIGGER_MAX_LATENCY_FRAMES 4  // Triggered stimulation that has not gone out after this many frames is counted as missed
+#define INTAN_SIMULATED_SIGNAL 0  // 1 = replace all CONVERT results with the synthetic signal of intan_sim.c
+#define INTAN_SIM_EVENT_PERIOD_FRAMES 1000  // Frames between two spikes of the simulated signal on one channel
+#define INTAN_SPIKE_SNIPPET_LEN 32   // Samples per spike waveform snippet
+#define INTAN_SPIKE_SNIPPET_PRE 8    // Samples of the snippet before the threshold crossing
+#define INTAN_SPIKE_THRESHOLD_Q8 1707  // Threshold in units of median(|x|), Q8. 4.5 sigma with sigma = median(|x|) / 0.6745
+#define INTAN_SPIKE_WARMUP_SAMPLES 1000  // Samples per channel for the noise estimate to settle before detection starts
+#define INTAN_SPIKE_FLUSH_FRAMES 100  // A spike waits at most this many frames for the rest of its packet
+#define INTAN_DC_FLUSH_FRAMES 100     // A DC tick waits at most this many frames for the rest of its packet
+#define INTAN_SORT_MAX_UNITS 4       // Spike sorter templates per channel
+#define INTAN_SORT_BENCHMARK 0       // 1 = time the spike sorter at startup and log how many channels it can keep up with
+#define INTAN_SORT_BENCHMARK_ITERATIONS 10000
+#define INTAN_SORT_BENCHMARK_SPIKE_RATE_HZ 100  // Firing rate per channel the benchmark result is given for
+#define INTAN_FILTER_NUM_STAGES 4    // Biquad sections per channel, e.g. notch + high-pass + low-pass
+#define INTAN_DECIM_MAX_TAPS 64      // Longest decimation low-pass FIR, even
+#define INTAN_REREF_SPARSE_MAX 4     // Montage rows with at most this many weights skip the dense dot product
+#define INTAN_FEATURE_MAX_BANDS 4    // Band power features per channel
+#define INTAN_FEATURE_MAX_HOPS 16    // Longest band power window, in hops
+#define INTAN_FEATURE_POWER_SHIFT 8  // Squared samples are scaled down by this before summing, so a hop fits 32 bits
+#define INTAN_DECODER_MAX_STATES 8   // Decoder state vector, the control outputs are the first ones of it, even
+#define INTAN_HISTORY_DEPTH 256      // Samples kept per channel for windowed processing, power of 2, 2 bytes each
+#define INTAN_CAL_SAVE_DELAY_MS 1000  // Calibration changes are stored once no other change came for this long
+#define INTAN_CAL_TIMEOUT_FACTOR 2   // Calibration is given up after this many times its expected duration
+#define INTAN_ACQUISITION_WATCHDOG_MS 100  // Acquisition is restarted if no frame finishes within this time
\ No newline at end of file
@@ -0,0 +1,25 @@
+/*
+This file contains the CPU cycle counter used by the CPU load statistics, see cpu_cycles.h.
+*/
+
+#include <kernel.h>
+
+#include "cpu_cycles.h"
+
+// Safe to call more than once
+void cpu_cycles_init(void) {
+    timing_init();
+    timing_start();
+}
+
+uint32_t cpu_cycles_per_sec(void) {
+    return (uint32_t) timing_freq_get();
+}
+
+uint32_t cpu_cycles_from_ns(uint32_t ns) {
+    return (uint32_t) (((uint64_t) ns * timing_freq_get()) / NSEC_PER_SEC);
+}
+
+uint32_t cpu_cycles_to_us(uint32_t cycles) {
+    return (uint32_t) (((uint64_t) cycles * USEC_PER_SEC) / timing_freq_get());
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdint.h>
+#include <timing/timing.h>
+
+/*
+CPU cycle counter for the CPU load statistics. k_cycle_get_32() counts the 32.768kHz RTC on the nRF53, about 30us per
+tick, which is longer than most of what we measure. The timing functions read the DWT cycle counter instead, one
+count per CPU clock. It is 32 bits and wraps after about 33s at 128MHz, so only differences of short intervals are
+meaningful.
+Requires CONFIG_TIMING_FUNCTIONS=y.
+*/
+
+void cpu_cycles_init(void);
+uint32_t cpu_cycles_per_sec(void);
+uint32_t cpu_cycles_from_ns(uint32_t ns);
+uint32_t cpu_cycles_to_us(uint32_t cycles);
+
+static inline uint32_t cpu_cycles_get(void) {
+    return (uint32_t) timing_counter_get();
+}
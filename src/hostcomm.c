@@ -11,7 +11,10 @@ The functions only need to understand and parse the message and do the correct a
 #include "ble.h"
 #include "config.h"
 #include "hostcomm.h"
+#include "hostcomm_crc.h"
 #include "intan_helper.h"
+#include "sample_pool.h"
+#include "sample_ring.h"
 #include "thread_config.h"
 
 
@@ -19,7 +22,6 @@ The functions only need to understand and parse the message and do the correct a
 LOG_MODULE_REGISTER(LOG_MODULE_NAME, LOG_LEVEL_DBG);
 
 hostcomm_priv_t hostcomm_priv;
-K_MSGQ_DEFINE(hostcomm_msgq, sizeof(hostcomm_msg_t), 16, 4);
 extern struct k_msgq intan_msgq;  
 
 // This function will be called when Host sends a message to Nordic.
@@ -31,11 +33,39 @@ void host_message_receive_handler(uint8_t * data, size_t length) {
 		return;
 	}
 
+	if (length > sizeof(((intan_msg_t *) 0)->data)) {
+		LOG_ERR("Host message of %d bytes too long", length);
+		return;
+	}
+
     switch (data[0])
     {
         case HOSTCOMM_HOST_MSG_INTAN_MSG_SET_STIM_EN_MASK:
         case HOSTCOMM_HOST_MSG_INTAN_MSG_SET_STIM_POS_MAG:
-        case HOSTCOMM_HOST_MSG_INTAN_MSG_SET_REC_MASK: {
+        case HOSTCOMM_HOST_MSG_INTAN_MSG_SET_REC_MASK:
+        case HOSTCOMM_HOST_MSG_INTAN_MSG_SET_RATE_CLASS:
+        case HOSTCOMM_HOST_MSG_INTAN_MSG_SET_AUX_SLOTS:
+        case HOSTCOMM_HOST_MSG_INTAN_MSG_SET_STIM_PROGRAM:
+        case HOSTCOMM_HOST_MSG_INTAN_MSG_START_STIM:
+        case HOSTCOMM_HOST_MSG_INTAN_MSG_STOP_STIM:
+        case HOSTCOMM_HOST_MSG_INTAN_MSG_SET_TRIGGER:
+        case HOSTCOMM_HOST_MSG_INTAN_MSG_SET_STREAM_MODE:
+        case HOSTCOMM_HOST_MSG_INTAN_MSG_SET_SORT_TEMPLATE:
+        case HOSTCOMM_HOST_MSG_INTAN_MSG_SET_SORT_UNIT:
+        case HOSTCOMM_HOST_MSG_INTAN_MSG_SET_CODEC:
+        case HOSTCOMM_HOST_MSG_INTAN_MSG_SET_FILTER_STAGE:
+        case HOSTCOMM_HOST_MSG_INTAN_MSG_SET_DECIM_TAPS:
+        case HOSTCOMM_HOST_MSG_INTAN_MSG_SET_DECIMATION:
+        case HOSTCOMM_HOST_MSG_INTAN_MSG_SET_REREF_WEIGHTS:
+        case HOSTCOMM_HOST_MSG_INTAN_MSG_SET_REREF_MODE:
+        case HOSTCOMM_HOST_MSG_INTAN_MSG_SET_FEATURE_BAND:
+        case HOSTCOMM_HOST_MSG_INTAN_MSG_SET_FEATURE_WINDOW:
+        case HOSTCOMM_HOST_MSG_INTAN_MSG_SET_DECODER_MATRIX:
+        case HOSTCOMM_HOST_MSG_INTAN_MSG_SET_DECODER:
+        case HOSTCOMM_HOST_MSG_INTAN_MSG_SET_CALIBRATION:
+        case HOSTCOMM_HOST_MSG_INTAN_MSG_START_CALIBRATION:
+        case HOSTCOMM_HOST_MSG_INTAN_MSG_SET_DC_STREAM:
+        case HOSTCOMM_HOST_MSG_INTAN_MSG_READ_REGISTER: {
             // Message intended for Intan, give it to Intan, this thread doesn't do anything.
             intan_msg_t intan_msg = {
                 .length = length,
@@ -55,47 +85,86 @@ void host_message_receive_handler(uint8_t * data, size_t length) {
 }
 
 
+// BLE copies the data into its own buffers while sending, so the block can be released right away
+static int hostcomm_ble_send_block(sample_block_t * block) {
+
+    int err = ble_send_bytes((uint8_t * ) &block->msg, sample_block_length(block));
+    sample_pool_unref(block);
+
+    return err;
+}
+
+int hostcomm_register_transport(const char * name, hostcomm_transport_send_t send) {
+
+    if (hostcomm_priv.num_transports >= HOSTCOMM_MAX_TRANSPORTS) {
+        LOG_ERR("No room for transport %s", name);
+        return -ENOMEM;
+    }
+
+    hostcomm_priv.transports[hostcomm_priv.num_transports].name = name;
+    hostcomm_priv.transports[hostcomm_priv.num_transports].send = send;
+    hostcomm_priv.num_transports++;
+
+    return 0;
+}
+
+// Hand the block to every transport, each one gets its own reference. Our own reference is dropped at the end.
+static void hostcomm_send_block(sample_block_t * block) {
+
+    for (int i = 0; i < hostcomm_priv.num_transports; i++) {
+        sample_pool_ref(block);
+
+        if (hostcomm_priv.transports[i].send(block)) {
+            LOG_DBG("Transport %s failed to send", hostcomm_priv.transports[i].name);
+        }
+    }
+
+    sample_pool_unref(block);
+}
+
 void hostcomm_thread_func(void * param1, void * param2, void * param3){
 
     // Start to initialize BLE
     ble_init(host_message_receive_handler);
+    hostcomm_register_transport("ble", hostcomm_ble_send_block);
 
     while(1) {
-        hostcomm_msg_t hostcomm_msg;
-        k_msgq_get(&hostcomm_msgq, &hostcomm_msg, K_FOREVER);
-        
-        //LOG_DBG("Received message, id %d ", hostcomm_msg.message_id);
-        if (hostcomm_msg.message_id == HOSTCOMM_INTERNAL_INTAN_SEND_TO_HOST_MSG_ID) {
-            /*
-            Messages to host has the following format:
-            byte 1 = crc
-            byte 2&3 = channel mask
-            byte 4&5 = channel X data
-            byte 6&7 = channel Y data 
-            and etc.
-
-            The values of X and Y is decided by bits set in the mask
-            */
-            outgoing_message_struct_t msg = {0};
-            msg.channel_mask = hostcomm_msg.optional_header;
-            msg.crc = hostcomm_priv.crc;
-            memcpy(msg.channel_data, hostcomm_msg.data_buf, hostcomm_msg.data_len);
-
-            ble_send_bytes((uint8_t * ) &msg, sizeof(msg.crc) + sizeof(msg.channel_mask) + hostcomm_msg.data_len);
-            if (hostcomm_priv.crc == 0xff) {
-                hostcomm_priv.crc = 0;
-            }
-            else {
-                hostcomm_priv.crc += 1;
-            }
-            
-        }
-        else {
-            LOG_WRN("Unknown message ID %d ", hostcomm_msg.message_id);
+        /*
+        Every message to the host is a hostcomm_packet_header_t (14 bytes) followed by the payload of its type:
+        samples:            per sample the tag (1 byte, channel and rate class, see HOSTCOMM_SAMPLE_TAG) and the
+                            AC data (2 bytes), in the order they were converted. Channels at a higher rate class
+                            show up more often.
+        spikes:             per spike the tag (1 byte), frame index (4 bytes), INTAN_SPIKE_SNIPPET_LEN signed 16 bit
+                            samples
+        sorted spikes:      per sorted spike the tag (1 byte), frame index (4 bytes), unit (1 byte)
+        compressed samples: number of samples (1 byte), bit stream (intan_codec.h)
+        LFP samples:        decimation (1 byte), then tag and data of every sample as in the sample packets
+        features:           number of bands (1 byte), number of records (1 byte), then per record the tag (1 byte)
+                            and the power of every band (2 bytes each, log2 Q8.8)
+        control:            latency in us (2 bytes), then the outputs (signed 16 bit each). Control packets skip the
+                            queue, they may overtake sample packets.
+        DC samples:         decimation (1 byte), number of ticks (1 byte), then per tick the 10 bit DC value of
+                            every channel in the mask, bit-packed (intan_dc.h)
+        register:           register (1 byte), error (signed 1 byte, 0 if the value is valid), value (2 bytes). Like
+                            control packets they skip the queue.
+        The sample block already holds the message in this layout, the producer has filled in first_index and the
+        channel mask, the rest of the header is filled in here.
+        */
+        sample_block_t * block = sample_ring_get(K_FOREVER);
+        if (block == NULL) {
+            continue;
         }
-        
-    }
 
+        hostcomm_packet_header_t * header = &block->msg.header;
+        header->version = HOSTCOMM_PACKET_VERSION;
+        header->type = block->type;
+        header->seq = hostcomm_priv.seq++;
+        header->count = block->sample_count;
+        header->crc = hostcomm_crc16((const uint8_t *) header + sizeof(header->crc),
+                                     sample_block_length(block) - sizeof(header->crc));
+
+        hostcomm_send_block(block);
+    }
 }
 
 K_THREAD_DEFINE(hostcomm_thread_id, HOSTCOMM_THREAD_STACK_SIZE, hostcomm_thread_func, NULL, NULL, NULL, HOSTCOMM_THREAD_PRIORITY, 0, 1500);
\ No newline at end of file
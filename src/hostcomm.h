@@ -6,6 +6,29 @@ typedef enum {
     HOSTCOMM_HOST_MSG_INTAN_MSG_SET_STIM_EN_MASK,
     HOSTCOMM_HOST_MSG_INTAN_MSG_SET_STIM_POS_MAG,
     HOSTCOMM_HOST_MSG_INTAN_MSG_SET_REC_MASK,
+    HOSTCOMM_HOST_MSG_INTAN_MSG_SET_RATE_CLASS,
+    HOSTCOMM_HOST_MSG_INTAN_MSG_SET_AUX_SLOTS,
+    HOSTCOMM_HOST_MSG_INTAN_MSG_SET_STIM_PROGRAM,
+    HOSTCOMM_HOST_MSG_INTAN_MSG_START_STIM,
+    HOSTCOMM_HOST_MSG_INTAN_MSG_STOP_STIM,
+    HOSTCOMM_HOST_MSG_INTAN_MSG_SET_TRIGGER,
+    HOSTCOMM_HOST_MSG_INTAN_MSG_SET_STREAM_MODE,
+    HOSTCOMM_HOST_MSG_INTAN_MSG_SET_SORT_TEMPLATE,
+    HOSTCOMM_HOST_MSG_INTAN_MSG_SET_SORT_UNIT,
+    HOSTCOMM_HOST_MSG_INTAN_MSG_SET_CODEC,
+    HOSTCOMM_HOST_MSG_INTAN_MSG_SET_FILTER_STAGE,
+    HOSTCOMM_HOST_MSG_INTAN_MSG_SET_DECIM_TAPS,
+    HOSTCOMM_HOST_MSG_INTAN_MSG_SET_DECIMATION,
+    HOSTCOMM_HOST_MSG_INTAN_MSG_SET_REREF_WEIGHTS,
+    HOSTCOMM_HOST_MSG_INTAN_MSG_SET_REREF_MODE,
+    HOSTCOMM_HOST_MSG_INTAN_MSG_SET_FEATURE_BAND,
+    HOSTCOMM_HOST_MSG_INTAN_MSG_SET_FEATURE_WINDOW,
+    HOSTCOMM_HOST_MSG_INTAN_MSG_SET_DECODER_MATRIX,
+    HOSTCOMM_HOST_MSG_INTAN_MSG_SET_DECODER,
+    HOSTCOMM_HOST_MSG_INTAN_MSG_SET_CALIBRATION,
+    HOSTCOMM_HOST_MSG_INTAN_MSG_START_CALIBRATION,
+    HOSTCOMM_HOST_MSG_INTAN_MSG_SET_DC_STREAM,
+    HOSTCOMM_HOST_MSG_INTAN_MSG_READ_REGISTER,
 } hostcomm_external_msg_id_t;
 
 #define HOST_CODE_SET_RATE      1
@@ -16,24 +39,145 @@ typedef enum {
 #define HOST_MESSAGE_CHANNEL_MASK_LOWER 1
 #define HOST_MESSAGE_CRC                2
 
+// Every sample carries its channel (bits 0-3) and rate class (bits 4-5), channels may come at different rates
+#define HOSTCOMM_SAMPLE_TAG(channel, rate_class)  ((channel) | ((rate_class) << 4))
+#define HOSTCOMM_SAMPLE_TAG_CHANNEL(tag)          ((tag) & 0xF)
+
+typedef struct __attribute__ ((__packed__)) {
+    uint8_t tag;
+    uint16_t ac_data; //always sending AC
+} hostcomm_sample_t;
+
+// Layout of hostcomm_packet_header_t, goes up with every change of it or of a payload
+#define HOSTCOMM_PACKET_VERSION  2
+
+// What follows the header. The meaning of first_index, channel_mask and count depends on it.
 typedef enum {
-    HOSTCOMM_INTERNAL_INTAN_SEND_TO_HOST_MSG_ID = 1,
-} hostcomm_internal_msg_id_t;
+    HOSTCOMM_PAYLOAD_SAMPLES = 0,         // first_index: sample index, count: samples
+    HOSTCOMM_PAYLOAD_SPIKES,              // first_index: frame of the first spike, count: spikes
+    HOSTCOMM_PAYLOAD_UNITS,               // first_index: frame of the first sorted spike, count: sorted spikes
+    HOSTCOMM_PAYLOAD_COMPRESSED_SAMPLES,  // a sample packet coded with intan_codec.h, first_index: sample index, count: bytes
+    HOSTCOMM_PAYLOAD_LFP_SAMPLES,         // decimated samples (intan_decim.h), first_index: LFP sample index, count: samples
+    HOSTCOMM_PAYLOAD_FEATURES,            // band powers (intan_feature.h), first_index: frame of the first record, count: bytes
+    HOSTCOMM_PAYLOAD_CONTROL,             // decoder output (intan_decoder.h), first_index: frame of the update, count: outputs
+    HOSTCOMM_PAYLOAD_DC_SAMPLES,          // DC amplifier values (intan_dc.h), first_index: frame of the first tick, count: bytes
+    HOSTCOMM_PAYLOAD_REGISTER,            // register read for the host, first_index: frame the answer came in, count: 1
+} hostcomm_payload_type_t;
+
+/*
+Every packet to the host starts with this header, little endian like everything else.
+
+seq counts the packets hostcomm sends, a gap is a packet lost between the device and the host. Samples that never made
+it into a packet (sample pool or ring full) show up as a gap in first_index instead: the sample index counts every raw
+sample acquisition produced, so the next packet of a stream starts at first_index plus the samples of the previous
+one unless samples were lost in between.
+crc is CRC-16/CCITT-FALSE (polynomial 0x1021, initial value 0xFFFF) over everything after it, the rest of the header
+and the payload.
+*/
+typedef struct __attribute__ ((__packed__)) {
+    uint16_t crc;
+    uint8_t version;                              // HOSTCOMM_PACKET_VERSION
+    uint8_t type;                                 // hostcomm_payload_type_t
+    uint16_t seq;
+    uint32_t first_index;
+    uint16_t channel_mask;                        // channels the payload can hold, 0 where that does not apply
+    uint16_t count;
+} hostcomm_packet_header_t;
 
 typedef struct __attribute__ ((__packed__)) {
-    uint8_t crc;
-    uint16_t channel_mask;
-    uint16_t channel_data[HOSTCOMM_MAX_PACKET_PER_TRANSMISSION]; //always sending AC
+    hostcomm_packet_header_t header;              // HOSTCOMM_PAYLOAD_SAMPLES
+    hostcomm_sample_t channel_data[HOSTCOMM_MAX_PACKET_PER_TRANSMISSION];
 } outgoing_message_struct_t;
 
+#define HOSTCOMM_UNIT_UNSORTED  0xFF  // spike that matched none of the templates of its channel
+
+// One detected spike: the frame its threshold crossing was sampled in and a waveform snippet around it
+typedef struct __attribute__ ((__packed__)) {
+    uint8_t tag;                                  // channel and rate class, see HOSTCOMM_SAMPLE_TAG
+    uint32_t frame_index;
+    int16_t snippet[INTAN_SPIKE_SNIPPET_LEN];     // AC samples relative to mid scale, INTAN_SPIKE_SNIPPET_PRE before the crossing
+} hostcomm_spike_t;
+
+typedef struct __attribute__ ((__packed__)) {
+    hostcomm_packet_header_t header;              // HOSTCOMM_PAYLOAD_SPIKES
+    hostcomm_spike_t spikes[HOSTCOMM_MAX_SPIKES_PER_TRANSMISSION];
+} hostcomm_spike_message_t;
+
+// A spike of a channel with templates, classified on the device
+typedef struct __attribute__ ((__packed__)) {
+    uint8_t tag;                                  // channel and rate class, see HOSTCOMM_SAMPLE_TAG
+    uint32_t frame_index;
+    uint8_t unit;                                 // template it matched, HOSTCOMM_UNIT_UNSORTED if none
+} hostcomm_unit_event_t;
+
+typedef struct __attribute__ ((__packed__)) {
+    hostcomm_packet_header_t header;              // HOSTCOMM_PAYLOAD_UNITS
+    hostcomm_unit_event_t events[HOSTCOMM_MAX_UNITS_PER_TRANSMISSION];
+} hostcomm_unit_message_t;
+
+// Sample packet in compressed form, data holds the bit stream described in intan_codec.h
+typedef struct __attribute__ ((__packed__)) {
+    hostcomm_packet_header_t header;              // HOSTCOMM_PAYLOAD_COMPRESSED_SAMPLES
+    uint8_t num_samples;
+    uint8_t data[HOSTCOMM_MAX_PACKET_PER_TRANSMISSION * sizeof(hostcomm_sample_t) - 1];
+} hostcomm_compressed_message_t;
+
+// Decimated (LFP) samples of every recorded channel, batched separately from the raw samples
+typedef struct __attribute__ ((__packed__)) {
+    hostcomm_packet_header_t header;              // HOSTCOMM_PAYLOAD_LFP_SAMPLES
+    uint8_t decimation;                           // raw samples of a channel per LFP sample
+    hostcomm_sample_t samples[HOSTCOMM_MAX_LFP_PER_TRANSMISSION];
+} hostcomm_lfp_message_t;
+
+// Band power records. A record is the tag of the channel followed by num_bands uint16 powers (log2, Q8.8), the first
+// one ended its window in frame first_index and the others in the same or a later frame.
+typedef struct __attribute__ ((__packed__)) {
+    hostcomm_packet_header_t header;              // HOSTCOMM_PAYLOAD_FEATURES
+    uint8_t num_bands;
+    uint8_t num_records;
+    uint8_t data[HOSTCOMM_MAX_PACKET_PER_TRANSMISSION * sizeof(hostcomm_sample_t) - 2];
+} hostcomm_feature_message_t;
+
+// Output of the on-device decoder after one update
+typedef struct __attribute__ ((__packed__)) {
+    hostcomm_packet_header_t header;              // HOSTCOMM_PAYLOAD_CONTROL
+    uint16_t latency_us;                          // from the end of frame first_index until the packet was queued
+    int16_t outputs[INTAN_DECODER_MAX_STATES];
+} hostcomm_control_message_t;
+
+// DC amplifier values, INTAN_DC_BITS each for every channel in channel_mask (in channel order) per tick
+typedef struct __attribute__ ((__packed__)) {
+    hostcomm_packet_header_t header;              // HOSTCOMM_PAYLOAD_DC_SAMPLES
+    uint8_t decimation;                           // frames from one tick to the next
+    uint8_t num_ticks;
+    uint8_t data[HOSTCOMM_MAX_PACKET_PER_TRANSMISSION * sizeof(hostcomm_sample_t) - 2];
+} hostcomm_dc_message_t;
+
+// Answer to a READ_REGISTER message from the host
+typedef struct __attribute__ ((__packed__)) {
+    hostcomm_packet_header_t header;              // HOSTCOMM_PAYLOAD_REGISTER
+    uint8_t reg;
+    int8_t err;                                   // 0, or -ECANCELED if acquisition stopped before the answer came
+    uint16_t value;
+} hostcomm_register_message_t;
+
+struct sample_block_t;
+
+// A transport takes over one reference of the block and must sample_pool_unref() it once it is done sending,
+// which may be later from its own TX completion.
+typedef int (*hostcomm_transport_send_t)(struct sample_block_t * block);
 
 typedef struct {
-    hostcomm_internal_msg_id_t message_id;
-    uint16_t optional_header; 
-    uint16_t data_len;
-    uint16_t data_buf[HOSTCOMM_MAX_PACKET_PER_TRANSMISSION];
-} hostcomm_msg_t;
+    const char * name;
+    hostcomm_transport_send_t send;
+} hostcomm_transport_t;
 
 typedef struct {
-    uint8_t crc;
+    uint16_t seq;
+
+    // Every sample block is fanned out to all registered transports
+    hostcomm_transport_t transports[HOSTCOMM_MAX_TRANSPORTS];
+    uint8_t num_transports;
 } hostcomm_priv_t;
+
+int hostcomm_register_transport(const char * name, hostcomm_transport_send_t send);
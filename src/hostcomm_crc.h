@@ -0,0 +1,8 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HOSTCOMM_CRC16_INIT  0xFFFF
+
+uint16_t hostcomm_crc16(const uint8_t * data, size_t length);
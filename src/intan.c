@@ -52,28 +52,84 @@ holders when no auxiliary actions are required.
 
 #include <stdint.h>
 #include "config.h"
+#include "ble.h"
+#include "cpu_cycles.h"
 #include "spi.h"
 #include "hostcomm.h"
+#include "sample_clock.h"
+#include "sample_pool.h"
+#include "sample_ring.h"
 #include "intan.h"
 #include "intan_helper.h"
+#include "intan_aux.h"
+#include "intan_codec.h"
+#include "intan_decim.h"
+#include "intan_feature.h"
+#include "intan_decoder.h"
+#include "intan_history.h"
+#include "intan_cal.h"
+#include "intan_dc.h"
+#include "intan_filter.h"
+#include "intan_regs.h"
+#include "intan_reref.h"
+#include "intan_stim.h"
+#include "intan_trigger.h"
+#include "intan_sim.h"
+#include "intan_sort.h"
+#include "intan_spike.h"
 #include "thread_config.h"
 #include <kernel.h>
 #include <logging/log.h>
 #include <zephyr.h>
 #include <soc.h>
+#include <sys/byteorder.h>
 
 
 #define LOG_MODULE_NAME       intan_c
 LOG_MODULE_REGISTER(LOG_MODULE_NAME, LOG_LEVEL_INF);
 
-extern struct k_msgq hostcomm_msgq; 
-
 intan_priv_t intan_priv;
 K_MSGQ_DEFINE(intan_msgq, sizeof(intan_msg_t), 16, 4);
+K_MSGQ_DEFINE(intan_frame_msgq, sizeof(intan_frame_t), INTAN_FRAME_QUEUE_DEPTH, 4);
+K_MSGQ_DEFINE(intan_register_msgq, sizeof(intan_register_read_t), INTAN_REGISTER_READ_QUEUE_DEPTH, 4);
+
+// Frame period of the current sequence, every command in the frame takes one word period
+static uint32_t intan_frame_period_ns(void) {
+    return intan_priv.word_period_ns * intan_priv.sequence.num_commands;
+}
+
+/*
+A word period shorter than a word takes on the wire would start the next frame while the last one is still running.
+Frame period and frame time both scale with the number of commands, so checking one word is enough for any sequence.
+*/
+static bool intan_word_period_valid(uint32_t word_period_ns) {
+    return word_period_ns >= spi_frame_time_ns(INTAN_SPI_WORD_SIZE, 1);
+}
 
+/*
+Set the per-channel sample rate in samples per second when all channels are recorded. This fixes the SPI word rate,
+with fewer channels in the recording mask the frames get shorter and the per-channel rate goes up accordingly.
+*/
 int intan_headstage_set_rate(uint32_t rate) {
-    // TODO: Take in parameters from host and apply them here.
-    return 0;
+
+    if (rate == 0 || rate > NSEC_PER_SEC / INTAN_FRAME_NUM_COMMANDS) {
+        return -EINVAL;
+    }
+
+    uint32_t word_period_ns = NSEC_PER_SEC / (rate * INTAN_FRAME_NUM_COMMANDS);
+    if (!intan_word_period_valid(word_period_ns)) {
+        LOG_ERR("Rate %d too high, a frame takes %d ns on the SPI bus", rate,
+                spi_frame_time_ns(INTAN_SPI_WORD_SIZE, INTAN_FRAME_NUM_COMMANDS));
+        return -EINVAL;
+    }
+
+    intan_priv.word_period_ns = word_period_ns;
+
+    if (!intan_priv.initialized) {
+        return 0;
+    }
+
+    return sample_clock_start(intan_frame_period_ns());
 }
 
 // enable stimulation for all channels
@@ -104,42 +160,210 @@ void intan_stim_polarity_set(uint16_t mask) {
 }
 
 
-// batch send to host, will send every thing that is present in the Fifo queue
+// Replace the samples of a full block by their compressed form, unless that does not make it smaller
+static void intan_compress_block(sample_block_t * block) {
+
+    uint8_t coded[sizeof(block->compressed_msg.data)];
+    size_t raw_length = sample_block_length(block);
+    int coded_length = intan_codec_encode(block->msg.channel_data, block->sample_count, coded, sizeof(coded));
+
+    intan_priv.codec_stats.blocks++;
+    intan_priv.codec_stats.raw_bytes += raw_length;
+
+    // Compressed and raw packets share the pool block, fill it in only after coding. The header stays as it is.
+    if (coded_length > 0 && offsetof(hostcomm_compressed_message_t, data) + coded_length < raw_length) {
+        uint8_t num_samples = block->sample_count;
+
+        block->type = SAMPLE_BLOCK_COMPRESSED;
+        block->compressed_msg.num_samples = num_samples;
+        memcpy(block->compressed_msg.data, coded, coded_length);
+        block->sample_count = coded_length;
+    }
+    else {
+        intan_priv.codec_stats.uncompressed++;
+    }
+
+    intan_priv.codec_stats.coded_bytes += sample_block_length(block);
+}
+
+// batch send to host, hands the block currently being filled (and our reference to it) over to hostcomm
 void intan_batch_send_to_host(void) {
-    hostcomm_msg_t msg = {
-        .message_id = HOSTCOMM_INTERNAL_INTAN_SEND_TO_HOST_MSG_ID,
-        .optional_header = intan_priv.current_channel_mask,
-        .data_len = intan_priv.current_batch_count * 2
-    };
 
-    // * 2 because each channel data is 2 bytes, TODO: this needs to be updated when channel masks change
-    memcpy(msg.data_buf, intan_priv.channel_data_buffer, intan_priv.current_batch_count * 2);
+    sample_block_t * block = intan_priv.current_block;
+
+    if (block == NULL) {
+        return;
+    }
+
+    intan_priv.current_block = NULL;
+
+    if (block->sample_count == 0) {
+        sample_pool_unref(block);
+        return;
+    }
+
+    uint16_t num_samples = block->sample_count;
+
+    if (intan_priv.codec == INTAN_CODEC_DELTA_RICE) {
+        intan_compress_block(block);
+    }
+
+    if (!sample_ring_put(block)) {
+        sample_ring_drop(num_samples);
+        sample_pool_unref(block);
+    }
+}
+
+// How well the sample blocks compress, statistics restart after every log
+static void intan_log_codec_stats(void) {
+
+    intan_codec_stats_t stats = intan_priv.codec_stats;
+    memset(&intan_priv.codec_stats, 0, sizeof(intan_codec_stats_t));
+
+    if (stats.blocks == 0) {
+        return;
+    }
+
+    LOG_INF("Codec: %d blocks, %d bytes raw, %d bytes sent (%d%%), %d blocks uncompressed", stats.blocks,
+            stats.raw_bytes, stats.coded_bytes, (stats.coded_bytes * 100) / stats.raw_bytes, stats.uncompressed);
+}
+
+
+// Samples are written straight into a pool block, the block is the message that goes to the host
+void intan_add_channel_data_to_batch_buffer(uint8_t tag, uint16_t data) {
+
+    // Every sample gets an index, also the ones that are lost, so the host sees exactly where samples are missing
+    uint32_t sample_index = intan_priv.sample_index++;
+
+    if (intan_priv.current_block == NULL) {
+        intan_priv.current_block = sample_pool_alloc();
+
+        if (intan_priv.current_block == NULL) {
+            // hostcomm is behind and all blocks are in use, this sample is lost
+            sample_ring_drop(1);
+            return;
+        }
+
+        // The mask is fixed for the whole block, a mask change always starts a new block
+        intan_priv.current_block->msg.header.channel_mask = intan_priv.current_channel_mask & intan_priv.raw_channel_mask;
+        intan_priv.current_block->msg.header.first_index = sample_index;
+    }
 
-    k_msgq_put(&hostcomm_msgq, &msg, K_NO_WAIT);
+    if (intan_priv.current_block->sample_count < INTAN_BUFFER_SIZE) {
+        hostcomm_sample_t * sample = &intan_priv.current_block->msg.channel_data[intan_priv.current_block->sample_count];
+        sample->tag = tag;
+        sample->ac_data = data;
+        intan_priv.current_block->sample_count += 1;
+    }
+    else {
+        LOG_ERR("Out of space in channel data buffer, current batch count %d", intan_priv.current_block->sample_count);
+        sample_ring_drop(1);
+    }
 
-    // Reset our internal counter
-    intan_priv.current_batch_count = 0;
 }
 
+// Keep track of n, n-1 and n-2 commands so when the data comes back, we know what the data is responding to.
+// Returns the n-2 command, which is the one the response clocked in together with this command belongs to.
+// tag and read (if any) come out as n_minus_two_tag and n_minus_two_read together with their command.
+static uint32_t intan_pipeline_push(uint32_t command, uint8_t tag, const intan_read_request_t * read) {
+    intan_priv.n_minus_two_command = intan_priv.n_minus_one_command;
+    intan_priv.n_minus_one_command = intan_priv.nth_command;
+    intan_priv.nth_command = command;
 
-void intan_add_channel_data_to_batch_buffer(uint16_t data) {
+    intan_priv.n_minus_two_tag = intan_priv.n_minus_one_tag;
+    intan_priv.n_minus_one_tag = intan_priv.nth_tag;
+    intan_priv.nth_tag = tag;
 
-    if (intan_priv.current_batch_count < INTAN_BUFFER_SIZE) {
-        intan_priv.channel_data_buffer[intan_priv.current_batch_count] = data;
-        intan_priv.current_batch_count += 1;
+    intan_priv.n_minus_two_read = intan_priv.n_minus_one_read;
+    intan_priv.n_minus_one_read = intan_priv.nth_read;
+    if (read) {
+        intan_priv.nth_read = *read;
     }
     else {
-        LOG_ERR("Out of space in channel data buffer, current batch count %d", intan_priv.current_batch_count);
+        intan_priv.nth_read.cb = NULL;
+    }
+
+    return intan_priv.n_minus_two_command;
+}
+
+// Process the response to a previously sent command. CONVERT results are also stored into frame, if one is given.
+static void intan_process_response(uint32_t command, uint32_t resp, intan_frame_t * frame) {
+
+    // ignore the response if the command was 0 (aka not valid)
+    if (!command) {
+        return;
+    }
+
+    switch (INTAN_RWC_COMMAND_HEADER_MASK & command) {
+        case INTAN_CONVERT_HEADER: {
+
+            unsigned channel_num = (command >> INTAN_CONVERT_CHANNEL_OFFSET) & INTAN_CONVERT_CHANNEL_MASK;
+            intan_convert_channel_data_t * data = (intan_convert_channel_data_t*) &resp;
+
+#if INTAN_SIMULATED_SIGNAL
+            // intan_priv.frame_index has already moved on to the next frame when a frame is decoded
+            data->ac_amp_data = intan_sim_sample(channel_num, frame ? frame->frame_index : intan_priv.frame_index);
+#endif
+
+            data->ac_amp_data = intan_cal_apply(channel_num, data->ac_amp_data);
+
+            intan_priv.channel_data[channel_num] = *data;
+
+            // The tag came out of the pipeline together with this command, it was looked up when the frame was built.
+            // It also covers a CONVERT of the previous frame (single aux slot), even across a sequence change.
+            if (frame && intan_priv.n_minus_two_tag != INTAN_SEQUENCE_NO_SAMPLE) {
+                frame->samples[frame->num_samples] = *data;
+                frame->tags[frame->num_samples] = intan_priv.n_minus_two_tag;
+                frame->history_pos[frame->num_samples] = intan_history_put(channel_num,
+                        (int32_t) data->ac_amp_data - INTAN_AC_MID_SCALE, frame->frame_index);
+                frame->num_samples++;
+
+                intan_trigger_sample(channel_num, data->ac_amp_data, frame->frame_index);
+            }
+
+            break;
+
+        }
+        case INTAN_READ_HEADER: {
+            LOG_DBG ("Read command 0x%x, Return Value 0x%x ", command, resp);
+            intan_regs_read_response(command, resp);
+
+            // The request came out of the pipeline together with this command
+            if (intan_priv.n_minus_two_read.cb) {
+                intan_priv.n_minus_two_read.cb(0, intan_priv.n_minus_two_read.reg, resp & 0xFFFF,
+                                               intan_priv.n_minus_two_read.ctx);
+                intan_priv.n_minus_two_read.cb = NULL;
+            }
+            break;
+        }
+        case INTAN_WRITE_HEADER: {
+
+            bool ok = intan_check_write_response(command, resp);
+            intan_regs_write_response(command, ok);
+
+            if (!ok) {
+
+                // A write has failed. Show warning. Maybe harmless depending on the register that we were writing to
+                LOG_WRN ("Write command 0x%x failed, register has value 0x%x ", command, resp);
+
+            }
+            break;
+        }
+        default:
+            break;
     }
-    
 }
 
 // send command data and also process the current data that is in rx_buf. 
 void intan_send_and_receive(uint32_t command) {
 
+    // The register already holds this value
+    if (!intan_regs_write_needed(command)) {
+        return;
+    }
+
     // Send command first
     int err = intan_send (command);
-    uint32_t resp = 0;
 
     if (err) {
         // TODO: add error handling
@@ -147,117 +371,422 @@ void intan_send_and_receive(uint32_t command) {
         return;
     }
 
+    // So the rx_buf contains the response to our n-2 command that was sent before
+    intan_process_response(intan_pipeline_push(command, INTAN_SEQUENCE_NO_SAMPLE, NULL),
+                           intan_decode_response(intan_priv.rx_buf), NULL);
+}
+
+// Walk all responses of the last frame in one pass, word i answers the command sent 2 words earlier
+static void intan_decode_frame(size_t num_commands, intan_frame_t * frame) {
+
+    for (size_t i = 0; i < num_commands; i++) {
+        intan_read_request_t * read = NULL;
+
+        if (i >= intan_priv.sequence.num_converts) {
+            read = &intan_priv.frame_reads[i - intan_priv.sequence.num_converts];
+        }
+
+        uint32_t command = intan_pipeline_push(intan_priv.frame_commands[i], intan_priv.frame_tags[i], read);
+
+        // The pipeline owns the read from now on, cancelling must not see it a second time
+        if (read) {
+            read->cb = NULL;
+        }
+
+        intan_process_response(command, intan_decode_response(&intan_priv.frame_rx_buf[i * INTAN_SPI_WORD_SIZE]), frame);
+    }
+}
+
+// Encode the CONVERT part of one frame of the superframe. With a single rate class this only happens once.
+static void intan_load_sequence_frame(uint8_t frame) {
 
-    // Keep track of n, n-1 and n-2 commands so when the data comes back, we know what the data is responding to
-    intan_priv.n_minus_two_command = intan_priv.n_minus_one_command;
-    intan_priv.n_minus_one_command = intan_priv.nth_command;
-    intan_priv.nth_command = command;
+    intan_priv.sequence_frame = frame;
 
-    // So the rx_buf contains the response to our n-2 command that was sent before
-    // ignore the response if n-2 command was 0 (aka not valid)
-    if (intan_priv.n_minus_two_command) {
-
-        // Intan transmission gives most significant byte first.
-        resp = (uint32_t) (intan_priv.rx_buf[0]<<24 | intan_priv.rx_buf[1] <<16 | intan_priv.rx_buf[2] << 8 | intan_priv.rx_buf[3]);
-        
-        switch (INTAN_RWC_COMMAND_HEADER_MASK & intan_priv.n_minus_two_command) {   
-            case INTAN_CONVERT_HEADER: {
-                
-                unsigned channel_num = (intan_priv.n_minus_two_command >> INTAN_CONVERT_CHANNEL_OFFSET) & INTAN_CONVERT_CHANNEL_MASK;
-                intan_convert_channel_data_t * data = (intan_convert_channel_data_t*) &resp;
-                intan_priv.channel_data[channel_num] = *data;
-
-                // Save this data for batch sending to host if this channel is in the channel mask
-                if (channel_num & intan_priv.current_channel_mask) {
-                    intan_add_channel_data_to_batch_buffer(data->ac_amp_data);
-                }
-                
-                break;
+    for (int i = 0; i < intan_priv.sequence.num_converts; i++) {
+        uint8_t channel = intan_priv.sequence.slot_channel[frame][i];
 
-            }
-            case INTAN_READ_HEADER: {
-                // TODO: add special handling
-                LOG_DBG ("Read command 0x%x, Return Value 0x%x ", intan_priv.n_minus_two_command, resp);
-                break;
-            }
-            case INTAN_WRITE_HEADER: {
+        if (channel == INTAN_SEQUENCE_NO_SAMPLE) {
+            //dummy command, keeps the frame length and so the sample spacing constant
+            intan_set_frame_command(i, INTAN_READ(RO_REG_CHIP_ID, 0, 0));
+            intan_priv.frame_tags[i] = INTAN_SEQUENCE_NO_SAMPLE;
+        }
+        else {
+            intan_set_frame_command(i, INTAN_CONVERT(channel, 0, 0, 1, 0));
+            intan_priv.frame_tags[i] = HOSTCOMM_SAMPLE_TAG(channel, intan_priv.sequence.channel_class[channel]);
+        }
+    }
+}
 
-                if (!intan_check_write_response(intan_priv.n_minus_two_command, resp)) {
+// Make seq the sequence of the following frames, starting at the beginning of its superframe
+static void intan_apply_sequence(const intan_sequence_t * seq) {
 
-                    // A write has failed. Show warning. Maybe harmless depending on the register that we were writing to
-                    LOG_WRN ("Write command 0x%x failed, register has value 0x%x ", intan_priv.n_minus_two_command, resp);
-                    
-                }
-                break;
-            }
-            default:
-                break;
+    intan_priv.sequence = *seq;
+    intan_load_sequence_frame(0);
+}
+
+// Compile the sequence for a new recording mask or rate classes, completion context picks it up before arming the next frame
+static int intan_update_sequence(uint16_t channel_mask) {
+
+    // Completion context may interrupt us, so it must not see a half compiled sequence
+    bool was_pending = atomic_clear(&intan_priv.sequence_pending);
+
+    int err = intan_sequence_compile(channel_mask, &intan_priv.rate_config, intan_priv.num_aux_slots,
+                                     &intan_priv.pending_sequence);
+    if (err) {
+        if (was_pending) {
+            atomic_set(&intan_priv.sequence_pending, 1);
+        }
+        return err;
+    }
+
+    LOG_INF("Frame sequence: %d frames of %d converts + %d aux, frame period %d ns",
+            intan_priv.pending_sequence.num_frames, intan_priv.pending_sequence.num_converts,
+            intan_priv.pending_sequence.num_aux,
+            intan_priv.word_period_ns * intan_priv.pending_sequence.num_commands);
+
+    if (intan_priv.acquisition_running) {
+        atomic_set(&intan_priv.sequence_pending, 1);
+    }
+    else {
+        intan_apply_sequence(&intan_priv.pending_sequence);
+
+        if (sample_clock_is_running()) {
+            sample_clock_set_period(intan_frame_period_ns());
         }
-     
     }
+
+    return 0;
 }
 
-// continuously sample all 16 channels
-void intan_continuous_sample(void) {
-    
-    for (int i=0; i < NUM_CHANNELS; i++) {
-        // TODO: only sample if the channel is enabled in channel mask.
-        intan_send_and_receive(INTAN_CONVERT(i, 0, 0, 1, 0));
+// Put the channels in channel_mask into rate_class, sampled once every div frames, and rebuild the sequence
+static int intan_set_rate_class(uint16_t channel_mask, uint8_t rate_class, uint8_t div) {
+
+    intan_rate_config_t old_config = intan_priv.rate_config;
+
+    if (rate_class >= INTAN_NUM_RATE_CLASSES || div == 0) {
+        return -EINVAL;
+    }
+
+    intan_priv.rate_config.class_div[rate_class] = div;
+    for (int channel = 0; channel < NUM_CHANNELS; channel++) {
+        if (channel_mask & (1 << channel)) {
+            intan_priv.rate_config.channel_class[channel] = rate_class;
+        }
+    }
+
+    int err = intan_update_sequence(intan_priv.pending_sequence.channel_mask);
+    if (err) {
+        intan_priv.rate_config = old_config;
+    }
+
+    return err;
+}
+
+// Number of aux slots per frame (1-4). Fewer slots leave less room for commands but make every frame shorter.
+int intan_set_num_aux_slots(uint8_t num_aux_slots) {
+
+    uint8_t old_num_aux_slots = intan_priv.num_aux_slots;
+
+    if (num_aux_slots == 0 || num_aux_slots > INTAN_NUM_AUX_COMMANDS) {
+        return -EINVAL;
+    }
+
+    intan_priv.num_aux_slots = num_aux_slots;
+
+    int err = intan_update_sequence(intan_priv.pending_sequence.channel_mask);
+    if (err) {
+        intan_priv.num_aux_slots = old_num_aux_slots;
+    }
+
+    return err;
+}
+
+// Queue a command for the aux slots, it goes out in one of the next deadline_frames frames if its priority allows
+int intan_queue_aux_command(uint32_t command, intan_aux_prio_t prio, uint32_t deadline_frames) {
+
+    // The register already holds this value, keep the slot free for scrubbing
+    if (!intan_regs_write_needed(command)) {
+        return 0;
+    }
+
+    return intan_aux_submit(prio, command, intan_priv.frame_index, deadline_frames, NULL);
+}
+
+/*
+Read a register without stopping acquisition. The READ is queued as housekeeping for the aux slots, cb is called from
+completion context with the value when the response arrives two words later. Returns -ENOMEM if too many commands are
+waiting.
+*/
+int intan_read_register_async(uint8_t reg, intan_read_cb_t cb, void * ctx) {
+
+    intan_read_request_t read = {
+        .reg = reg,
+        .cb = cb,
+        .ctx = ctx,
+    };
+
+    if (cb == NULL) {
+        return -EINVAL;
+    }
+
+    return intan_aux_submit(INTAN_AUX_PRIO_HOUSEKEEPING, INTAN_READ(reg, 0, 0), intan_priv.frame_index,
+                            INTAN_AUX_HOUSEKEEPING_DEADLINE_FRAMES, &read);
+}
+
+// Completion context: a register the host asked for, it goes out from the Intan thread
+static void intan_host_read_done(int err, uint8_t reg, uint16_t value, void * ctx) {
+
+    intan_register_read_t read = {
+        .frame_index = intan_priv.frame_index,
+        .reg = reg,
+        .err = err,
+        .value = value,
+    };
+
+    if (k_msgq_put(&intan_register_msgq, &read, K_NO_WAIT) != 0) {
+        LOG_WRN("Register %d read for the host lost", reg);
     }
+}
 
-    // Shove in 4 additional commands.
-    for (int i=0; i < 4; i++) {
-        if (intan_priv.host_commands[i]) {
-            intan_send_and_receive(intan_priv.host_commands[i]);
+// Send the register reads of the host, they skip the queue like decoder outputs
+static void intan_send_register_reads(void) {
+
+    intan_register_read_t read;
+
+    while (k_msgq_get(&intan_register_msgq, &read, K_NO_WAIT) == 0) {
+        sample_block_t * block = sample_pool_alloc();
+
+        if (block == NULL) {
+            LOG_WRN("No sample block for register %d", read.reg);
+            continue;
+        }
+
+        block->type = SAMPLE_BLOCK_REGISTER;
+        block->sample_count = 1;
+        block->register_msg.header.first_index = read.frame_index;
+        block->register_msg.header.channel_mask = 0;
+        block->register_msg.reg = read.reg;
+        block->register_msg.err = read.err;
+        block->register_msg.value = read.value;
+
+        if (!sample_ring_put_urgent(block)) {
+            LOG_WRN("Register %d read for the host lost", read.reg);
+            sample_pool_unref(block);
+        }
+    }
+}
+
+// Reads that were sent but never answered because acquisition stopped
+static void intan_cancel_reads_in_flight(void) {
+
+    intan_read_request_t * in_flight[] = {
+        &intan_priv.nth_read, &intan_priv.n_minus_one_read, &intan_priv.n_minus_two_read,
+    };
+
+    // Slots past num_aux are not filled by intan_fill_aux_slots(), whatever they hold is not in flight
+    for (int i = 0; i < intan_priv.sequence.num_aux; i++) {
+        if (intan_priv.frame_reads[i].cb) {
+            intan_priv.frame_reads[i].cb(-ECANCELED, intan_priv.frame_reads[i].reg, 0, intan_priv.frame_reads[i].ctx);
+            intan_priv.frame_reads[i].cb = NULL;
+        }
+    }
+
+    for (int i = 0; i < ARRAY_SIZE(in_flight); i++) {
+        if (in_flight[i]->cb) {
+            in_flight[i]->cb(-ECANCELED, in_flight[i]->reg, 0, in_flight[i]->ctx);
+            in_flight[i]->cb = NULL;
+        }
+    }
+}
+
+// Shove in the additional commands. Called from completion context right before the next frame is armed.
+// The stimulation sequencer gets the first slots of the frame. Registers the chip lost go back next, then the aux
+// scheduler decides what goes next. Slots that are still empty check registers in the background.
+static void intan_fill_aux_slots(void) {
+
+    uint32_t stim_commands[INTAN_NUM_AUX_COMMANDS];
+    uint8_t num_stim = intan_stim_tick(intan_priv.frame_index, stim_commands, intan_priv.sequence.num_aux);
+
+    intan_trigger_frame_armed(intan_priv.frame_index, intan_stim_on_mask());
+
+    for (int i = 0; i < intan_priv.sequence.num_aux; i++) {
+        size_t slot = intan_priv.sequence.num_converts + i;
+        intan_aux_cmd_t cmd;
+
+        intan_priv.frame_tags[slot] = INTAN_SEQUENCE_NO_SAMPLE;
+
+        uint32_t command;
+
+        if (i < num_stim) {
+            intan_set_frame_command(slot, stim_commands[i]);
+            intan_priv.frame_reads[i].cb = NULL;
+        }
+        else if (intan_regs_restore_command(&command)) {
+            intan_set_frame_command(slot, command);
+            intan_priv.frame_reads[i].cb = NULL;
+        }
+        else if (intan_aux_pop(intan_priv.frame_index, &cmd)) {
+            intan_set_frame_command(slot, cmd.command);
+            intan_priv.frame_reads[i] = cmd.read;
         }
         else {
-            //dummy command
-            intan_send_and_receive(INTAN_READ(RO_REG_CHIP_ID, 0, 0));
+            // Nothing to send, check a register instead of a dummy command
+            intan_set_frame_command(slot, intan_regs_idle_command());
+            intan_priv.frame_reads[i].cb = NULL;
         }
     }
 }
 
+static void intan_frame_done_handler(int err, void * user_data);
+
+static int intan_arm_next_frame(void) {
+
+    // Switch to a new sequence only between frames, the frame that just finished has already been decoded
+    if (atomic_cas(&intan_priv.sequence_pending, 1, 0)) {
+        intan_apply_sequence(&intan_priv.pending_sequence);
+        sample_clock_set_period(intan_frame_period_ns());
+    }
+    else if (intan_priv.sequence.num_frames > 1) {
+        intan_load_sequence_frame((intan_priv.sequence_frame + 1) % intan_priv.sequence.num_frames);
+    }
 
-void intan_step_up_stim(void) {
+    intan_fill_aux_slots();
 
-    static uint16_t counter = 0;
-    int64_t curr_time = k_uptime_get();
+    return intan_send_spi_frame_async(intan_priv.sequence.num_commands, intan_frame_done_handler, NULL);
+}
 
-    // we've done stim toggles before
-    if (intan_priv.last_stim_toggle_time_ms != 0) {
-        if (curr_time - intan_priv.last_stim_toggle_time_ms < 1000) {
-            // Toggle once every 1000 ms, so if time elapsed < 1000, do nothing
-            return;
+/*
+Completion context of the acquisition engine, runs in the SPI frame interrupt once per frame.
+Advances the command pipeline over the finished frame, hands the samples to the Intan thread and arms the next frame
+before the next sample clock tick. Everything else (batching, host messages, stimulation) is left to the thread.
+*/
+static void intan_frame_done_handler(int err, void * user_data) {
+
+    uint32_t start_cycles = cpu_cycles_get();
+    intan_frame_t frame = {
+        .frame_index = intan_priv.frame_index++,
+        .done_cycles = start_cycles,
+        .channel_mask = intan_priv.sequence.channel_mask,
+    };
+
+    sample_clock_frame_done();
+    intan_decode_frame(intan_priv.sequence.num_commands, &frame);
+    intan_history_commit(frame.frame_index);
+    intan_cal_frame_done();
+
+    if (k_msgq_put(&intan_frame_msgq, &frame, K_NO_WAIT) != 0) {
+        intan_priv.dropped_frames++;
+    }
+
+    if (intan_priv.acquisition_running && intan_arm_next_frame()) {
+        intan_priv.acquisition_running = false;
+    }
+
+    intan_priv.cpu_stats.isr_cycles += cpu_cycles_get() - start_cycles;
+}
+
+// Start continuously sampling the channels in the recording mask, paced by the sample clock and driven from completion context
+int intan_acquisition_start(void) {
+
+    int err;
+
+    if (intan_priv.acquisition_running) {
+        return 0;
+    }
+
+    if (!sample_clock_is_running()) {
+        err = sample_clock_start(intan_frame_period_ns());
+        if (err) {
+            return err;
+        }
+    }
+
+    intan_priv.acquisition_running = true;
+
+    err = intan_arm_next_frame();
+    if (err) {
+        intan_priv.acquisition_running = false;
+    }
+
+    return err;
+}
+
+void intan_acquisition_stop(void) {
+
+    intan_priv.acquisition_running = false;
+    spi_frame_abort();
+    intan_cancel_reads_in_flight();
+    intan_cal_cancel();
+
+    // The responses to the commands in the pipeline are lost with the aborted frame
+    intan_priv.nth_command = 0;
+    intan_priv.n_minus_one_command = 0;
+    intan_priv.n_minus_two_command = 0;
+}
+
+// Data of a finished frame, runs in the Intan thread. The frame only holds samples of recorded channels.
+static void intan_process_frame(intan_frame_t * frame) {
+
+    // First frame with a new recording mask, we must drain currently buffered data
+    if (frame->channel_mask != intan_priv.current_channel_mask) {
+        intan_batch_send_to_host();
+        intan_priv.current_channel_mask = frame->channel_mask;
+    }
+
+    // Re-referencing comes first, everything downstream works on the re-referenced signal
+    intan_reref_process_frame(frame);
+    intan_filter_process_frame(frame);
+
+    if (intan_priv.stream_mode == INTAN_STREAM_SAMPLES || intan_priv.stream_mode == INTAN_STREAM_BOTH ||
+        intan_priv.stream_mode == INTAN_STREAM_SAMPLES_DC) {
+        for (int i = 0; i < frame->num_samples; i++) {
+            if (intan_priv.raw_channel_mask & (1 << HOSTCOMM_SAMPLE_TAG_CHANNEL(frame->tags[i]))) {
+                intan_add_channel_data_to_batch_buffer(frame->tags[i], frame->samples[i].ac_amp_data);
+            }
         }
     }
 
-    // If we get here, then time elapsed > 1000ms AND we have done stim before
-    // OR it is our first stim 
-    if (counter == 0) {
-        // Negative stimulation
-        intan_priv.host_commands[0] = INTAN_WRITE(REG_STIM_POLARITY_TRGD, 0x0, 1, 0);
-        // Turn on stimulation for all channels
-        intan_priv.host_commands[1] = INTAN_WRITE(REG_STIM_ON_TRGD, 0xffff, 1, 0);
+    intan_decim_process_frame(frame);
+
+    if (intan_priv.stream_mode == INTAN_STREAM_SAMPLES_DC) {
+        intan_dc_process_frame(frame);
     }
-    else if (counter == 1) {
-         // Positive stimulation
-        intan_priv.host_commands[0] = INTAN_WRITE(REG_STIM_POLARITY_TRGD, 0xffff, 1, 0);
-        // Turn on stimulation for all channels
-        intan_priv.host_commands[1] = INTAN_WRITE(REG_STIM_ON_TRGD, 0xffff, 1, 0);
+
+    if (intan_priv.stream_mode == INTAN_STREAM_SPIKES || intan_priv.stream_mode == INTAN_STREAM_BOTH) {
+        intan_spike_process_frame(frame);
     }
-    else if (counter == 2) {
-        // Turn off stimulation for all channels
-        intan_priv.host_commands[1] = INTAN_WRITE(REG_STIM_ON_TRGD, 0x0, 1, 0);
-        counter = 0;
+
+    // The decoder needs the features even when they do not go to the host
+    if (intan_priv.stream_mode == INTAN_STREAM_FEATURES || intan_decoder_enabled()) {
+        if (intan_feature_process_frame(frame, intan_priv.stream_mode == INTAN_STREAM_FEATURES)) {
+            intan_decoder_update(intan_feature_latest(), frame);
+        }
     }
 
-    // Give 128 magnitude to channel 0 and 1
-    intan_priv.host_commands[2] = INTAN_WRITE(REG_POS_STIM_CURRENT_MAG_TRGD_BASE, (0x8000 | 128), 1, 0);
-    intan_priv.host_commands[3] = INTAN_WRITE((REG_POS_STIM_CURRENT_MAG_TRGD_BASE+1), (0x8000 | 128), 1, 0);
+    intan_priv.cpu_stats.frames++;
+}
+
+// Average CPU cycles spent per frame in completion context and in the thread, and the resulting CPU load
+void intan_log_cpu_stats(void) {
+
+    intan_cpu_stats_t stats;
+    unsigned key = irq_lock();
+    stats = intan_priv.cpu_stats;
+    memset(&intan_priv.cpu_stats, 0, sizeof(intan_cpu_stats_t));
+    irq_unlock(key);
+
+    if (stats.frames == 0) {
+        return;
+    }
 
-    counter+=1;
-    intan_priv.last_stim_toggle_time_ms = k_uptime_get();
+    uint32_t frame_cycles = MAX(cpu_cycles_from_ns(intan_frame_period_ns()), 1);
+    uint32_t isr_per_frame = stats.isr_cycles / stats.frames;
+    uint32_t thread_per_frame = stats.thread_cycles / stats.frames;
 
+    LOG_INF("Acquisition CPU per frame: completion %d cycles (%d us), thread %d cycles (%d us), load %d permille, "
+            "%d frames dropped", isr_per_frame, cpu_cycles_to_us(isr_per_frame), thread_per_frame,
+            cpu_cycles_to_us(thread_per_frame),
+            (uint32_t) (((uint64_t) isr_per_frame + thread_per_frame) * 1000 / frame_cycles), intan_priv.dropped_frames);
 }
 
 
@@ -267,11 +796,39 @@ int intan_headstage_init(void) {
         spi_init();
     }
 
+    // Before anything is measured, the sort benchmark below included
+    cpu_cycles_init();
+
     // Always zero out our internal buffers during init.
     memset(&intan_priv, 0, sizeof(intan_priv_t));
-
-    intan_priv.sample_delay_us = DEFAULT_SAMPLE_DELAY_US;
+    intan_regs_init();
+    intan_aux_init();
+    intan_stim_init();
+    intan_trigger_init();
+    intan_spike_init();
+    intan_sort_init();
+    intan_filter_init();
+    intan_decim_init();
+    intan_reref_init();
+    intan_history_init();
+    intan_cal_init();
+    intan_dc_init();
+    intan_feature_init();
+    intan_decoder_init();
+
+#if INTAN_SORT_BENCHMARK
+    intan_sort_benchmark();
+#endif
+
+    intan_priv.word_period_ns = (DEFAULT_SAMPLE_PERIOD_US * NSEC_PER_USEC) / INTAN_FRAME_NUM_COMMANDS;
+    if (!intan_word_period_valid(intan_priv.word_period_ns)) {
+        LOG_ERR("Sample period %d us is shorter than a frame on the SPI bus, using %d ns", DEFAULT_SAMPLE_PERIOD_US,
+                spi_frame_time_ns(INTAN_SPI_WORD_SIZE, INTAN_FRAME_NUM_COMMANDS));
+        intan_priv.word_period_ns = spi_frame_time_ns(INTAN_SPI_WORD_SIZE, 1);
+    }
     intan_priv.current_channel_mask = 0;
+    intan_priv.raw_channel_mask = 0xFFFF;
+    intan_priv.num_aux_slots = INTAN_DEFAULT_AUX_SLOTS;
 
     /*
     All the following commands are strictly follow Pg44 of Intan Datasheet
@@ -337,6 +894,14 @@ int intan_headstage_init(void) {
 
     intan_send_and_receive(INTAN_READ(RO_REG_CHIP_ID, 0, 1));
 
+    intan_rate_config_init(&intan_priv.rate_config);
+    intan_update_sequence(intan_priv.current_channel_mask);
+
+    // From here on every frame is started by the hardware sample clock
+    if (sample_clock_init() || sample_clock_start(intan_frame_period_ns())) {
+        LOG_ERR("Sample clock failed to start, frames will not be paced");
+    }
+
     intan_priv.initialized = true;
 
     return 0;
@@ -344,14 +909,95 @@ int intan_headstage_init(void) {
 }
 
 
-void intan_process_host_message(void) {
-    // Clear all host commands
-    for (int i = 0; i < 4; i++) {
-        intan_priv.host_commands[i] = 0;
+// Queue a command from the host, host configuration only takes aux slots that stimulation does not need
+static void intan_queue_host_command(uint32_t command) {
+
+    if (intan_queue_aux_command(command, INTAN_AUX_PRIO_HOST, INTAN_AUX_HOST_DEADLINE_FRAMES)) {
+        LOG_WRN("Aux queue full, host command 0x%x lost", command);
     }
+}
+
+/*
+Byte offsets of the fields of the host messages, byte 0 is the message ID. Fields are little endian, aka least
+significant byte first, except for the magnitude of SET_STIM_POS_MAG.
+*/
+#define HOST_MESSAGE_STIM_EN_MASK                 1   // uint16_t
+#define HOST_MESSAGE_STIM_POS_MAG_CHANNEL         1   // uint16_t
+#define HOST_MESSAGE_STIM_POS_MAG_MAGNITUDE       3   // uint16_t, big endian
+#define HOST_MESSAGE_REC_MASK                     1   // uint16_t
+#define HOST_MESSAGE_RATE_CLASS_MASK              1   // uint16_t
+#define HOST_MESSAGE_RATE_CLASS_CLASS             3
+#define HOST_MESSAGE_RATE_CLASS_DIV               4
+#define HOST_MESSAGE_AUX_SLOTS                    1
+#define HOST_MESSAGE_STIM_PROGRAM_CHANNEL         1
+#define HOST_MESSAGE_STIM_PROGRAM_AMPLITUDE       2
+#define HOST_MESSAGE_STIM_PROGRAM_FLAGS           3   // bit 0: anodic first
+#define HOST_MESSAGE_STIM_PROGRAM_FIRST_PHASE     4   // uint16_t, frames
+#define HOST_MESSAGE_STIM_PROGRAM_INTERPHASE      6   // uint16_t, frames
+#define HOST_MESSAGE_STIM_PROGRAM_SECOND_PHASE    8   // uint16_t, frames
+#define HOST_MESSAGE_STIM_PROGRAM_RECOVERY        10  // uint16_t, frames
+#define HOST_MESSAGE_STIM_PROGRAM_PERIOD          12  // uint16_t, frames
+#define HOST_MESSAGE_STIM_PROGRAM_NUM_PULSES      14  // uint16_t
+#define HOST_MESSAGE_START_STIM_MASK              1   // uint16_t
+#define HOST_MESSAGE_START_STIM_DELAY             3   // uint16_t, frames
+#define HOST_MESSAGE_STOP_STIM_MASK               1   // uint16_t
+#define HOST_MESSAGE_TRIGGER_CHANNEL              1
+#define HOST_MESSAGE_TRIGGER_THRESHOLD            2   // int16_t
+#define HOST_MESSAGE_TRIGGER_FLAGS                4   // bit 0: falling
+#define HOST_MESSAGE_TRIGGER_REFRACTORY           5   // uint16_t, frames
+#define HOST_MESSAGE_TRIGGER_STIM_MASK            7   // uint16_t
+#define HOST_MESSAGE_STREAM_MODE                  1
+#define HOST_MESSAGE_SORT_TEMPLATE_CHANNEL        1
+#define HOST_MESSAGE_SORT_TEMPLATE_UNIT           2
+#define HOST_MESSAGE_SORT_TEMPLATE_OFFSET         3
+#define HOST_MESSAGE_SORT_TEMPLATE_COUNT          4
+#define HOST_MESSAGE_SORT_TEMPLATE_SAMPLES        5   // int16_t[count]
+#define HOST_MESSAGE_SORT_UNIT_CHANNEL            1
+#define HOST_MESSAGE_SORT_UNIT_UNIT               2
+#define HOST_MESSAGE_SORT_UNIT_FLAGS              3   // bit 0: enable
+#define HOST_MESSAGE_SORT_UNIT_MAX_DISTANCE       4   // uint32_t
+#define HOST_MESSAGE_CODEC                        1
+#define HOST_MESSAGE_FILTER_STAGE_MASK            1   // uint16_t
+#define HOST_MESSAGE_FILTER_STAGE_STAGE           3
+#define HOST_MESSAGE_FILTER_STAGE_FLAGS           4   // bit 0: enable
+#define HOST_MESSAGE_FILTER_STAGE_COEFFS          5   // int16_t b0, b1, b2, a1, a2
+#define HOST_MESSAGE_DECIM_TAPS_OFFSET            1
+#define HOST_MESSAGE_DECIM_TAPS_COUNT             2
+#define HOST_MESSAGE_DECIM_TAPS_TAPS              3   // int16_t[count]
+#define HOST_MESSAGE_DECIMATION_FACTOR            1
+#define HOST_MESSAGE_DECIMATION_NUM_TAPS          2
+#define HOST_MESSAGE_DECIMATION_RAW_MASK          3   // uint16_t
+#define HOST_MESSAGE_REREF_WEIGHTS_ROW            1
+#define HOST_MESSAGE_REREF_WEIGHTS_FIRST_COL      2
+#define HOST_MESSAGE_REREF_WEIGHTS_COUNT          3
+#define HOST_MESSAGE_REREF_WEIGHTS_WEIGHTS        4   // int16_t[count]
+#define HOST_MESSAGE_REREF_MODE_MODE              1
+#define HOST_MESSAGE_REREF_MODE_REF_MASK          2   // uint16_t
+#define HOST_MESSAGE_FEATURE_BAND_BAND            1
+#define HOST_MESSAGE_FEATURE_BAND_FLAGS           2   // bit 0: enable
+#define HOST_MESSAGE_FEATURE_BAND_COEFFS          3   // int16_t b0, b1, b2, a1, a2
+#define HOST_MESSAGE_FEATURE_WINDOW_HOP_SAMPLES   1   // uint16_t
+#define HOST_MESSAGE_FEATURE_WINDOW_HOPS          3
+#define HOST_MESSAGE_DECODER_MATRIX_MATRIX        1
+#define HOST_MESSAGE_DECODER_MATRIX_ROW           2
+#define HOST_MESSAGE_DECODER_MATRIX_FIRST_COL     3
+#define HOST_MESSAGE_DECODER_MATRIX_COUNT         4
+#define HOST_MESSAGE_DECODER_MATRIX_VALUES        5   // int16_t[count]
+#define HOST_MESSAGE_DECODER_MODE                 1
+#define HOST_MESSAGE_DECODER_NUM_STATES           2
+#define HOST_MESSAGE_DECODER_NUM_OUTPUTS          3
+#define HOST_MESSAGE_CALIBRATION_CHANNEL          1
+#define HOST_MESSAGE_CALIBRATION_OFFSET           2   // int16_t
+#define HOST_MESSAGE_CALIBRATION_GAIN             4   // int16_t
+#define HOST_MESSAGE_START_CALIBRATION_FRAMES     1   // uint16_t
+#define HOST_MESSAGE_READ_REGISTER                1
+#define HOST_MESSAGE_DC_STREAM_MASK               1   // uint16_t
+#define HOST_MESSAGE_DC_STREAM_DECIMATION         3
 
-    // Intan can only process up to 4 messages at a time. TODO: don't hardcode the 4 here
-    for (int i = 0; i < 4; i++) {
+void intan_process_host_message(void) {
+
+    // Commands wait in the aux scheduler for as many frames as it takes, so every waiting message is handled
+    while (1) {
         // Read from message queue to see if there is something waiting for us to process
         intan_msg_t msg;
         if (k_msgq_get(&intan_msgq, &msg, K_NO_WAIT) != 0) {
@@ -362,28 +1008,361 @@ void intan_process_host_message(void) {
         switch (msg.data[0])
         {
             case HOSTCOMM_HOST_MSG_INTAN_MSG_SET_STIM_EN_MASK: {
-                // Message from host is little endian, aka least significant byte first.
-                uint16_t mask = msg.data[2] << 8 | msg.data[1]; // TODO: clean up hard coded indices
+                uint16_t mask = sys_get_le16(&msg.data[HOST_MESSAGE_STIM_EN_MASK]);
                 LOG_DBG("Setting stimulation enable mask to 0x%x", mask);
-                intan_priv.host_commands[i] = INTAN_WRITE(REG_STIM_ON_TRGD, mask, 1, 0);
+                intan_queue_host_command(INTAN_WRITE(REG_STIM_ON_TRGD, mask, 1, 0));
                 break;
             }
             case HOSTCOMM_HOST_MSG_INTAN_MSG_SET_STIM_POS_MAG: {
-                // Message from host is little endian, aka least significant byte first.
-                uint16_t channel = msg.data[2] << 8 | msg.data[1]; // TODO: clean up hard coded indices
-                uint16_t mag = msg.data[3] << 8 | msg.data[4]; // TODO: clean up hard coded indices
+                uint16_t channel = sys_get_le16(&msg.data[HOST_MESSAGE_STIM_POS_MAG_CHANNEL]);
+                uint16_t mag = sys_get_be16(&msg.data[HOST_MESSAGE_STIM_POS_MAG_MAGNITUDE]);
                 LOG_DBG("Setting stimulation magnitude to %d for channel %d", mag, channel);
 
-                intan_priv.host_commands[i] = INTAN_WRITE((REG_POS_STIM_CURRENT_MAG_TRGD_BASE + channel), (0x8000 | mag), 1, 0); // TODO: remove hardcoded
+                intan_queue_host_command(INTAN_WRITE((REG_POS_STIM_CURRENT_MAG_TRGD_BASE + channel), (0x8000 | mag), 1, 0)); // TODO: remove hardcoded
                 break;
             }
             case HOSTCOMM_HOST_MSG_INTAN_MSG_SET_REC_MASK: {
-                uint16_t mask = msg.data[2] << 8 | msg.data[1]; // TODO: clean up hard coded indices
+                uint16_t mask = sys_get_le16(&msg.data[HOST_MESSAGE_REC_MASK]);
                 LOG_INF("Setting recording channel mask to 0x%x", mask);
-                intan_priv.current_channel_mask = mask;
 
-                // After changing the mask, we must drain currently buffered data
+                // Buffered data is drained once the first frame with the new mask comes in
+                if (intan_update_sequence(mask)) {
+                    LOG_WRN("Recording channel mask 0x%x does not fit the rate classes", mask);
+                }
+                break;
+            }
+            case HOSTCOMM_HOST_MSG_INTAN_MSG_SET_RATE_CLASS: {
+                uint16_t mask = sys_get_le16(&msg.data[HOST_MESSAGE_RATE_CLASS_MASK]);
+                uint8_t rate_class = msg.data[HOST_MESSAGE_RATE_CLASS_CLASS];
+                uint8_t div = msg.data[HOST_MESSAGE_RATE_CLASS_DIV];
+                LOG_INF("Setting channels 0x%x to rate class %d, every %d frames", mask, rate_class, div);
+
+                if (intan_set_rate_class(mask, rate_class, div)) {
+                    LOG_WRN("Rate class rejected, superframe would exceed %d frames", INTAN_SEQUENCE_MAX_FRAMES);
+                }
+                break;
+            }
+            case HOSTCOMM_HOST_MSG_INTAN_MSG_SET_STIM_PROGRAM: {
+                // All times in frames
+                uint8_t channel = msg.data[HOST_MESSAGE_STIM_PROGRAM_CHANNEL];
+                intan_stim_program_t program = {
+                    .amplitude = msg.data[HOST_MESSAGE_STIM_PROGRAM_AMPLITUDE],
+                    .anodic_first = msg.data[HOST_MESSAGE_STIM_PROGRAM_FLAGS] & 0x1,
+                    .first_phase_ticks = sys_get_le16(&msg.data[HOST_MESSAGE_STIM_PROGRAM_FIRST_PHASE]),
+                    .interphase_ticks = sys_get_le16(&msg.data[HOST_MESSAGE_STIM_PROGRAM_INTERPHASE]),
+                    .second_phase_ticks = sys_get_le16(&msg.data[HOST_MESSAGE_STIM_PROGRAM_SECOND_PHASE]),
+                    .recovery_ticks = sys_get_le16(&msg.data[HOST_MESSAGE_STIM_PROGRAM_RECOVERY]),
+                    .period_ticks = sys_get_le16(&msg.data[HOST_MESSAGE_STIM_PROGRAM_PERIOD]),
+                    .num_pulses = sys_get_le16(&msg.data[HOST_MESSAGE_STIM_PROGRAM_NUM_PULSES]),
+                };
+                LOG_INF("Setting stimulation program of channel %d", channel);
+
+                if (intan_stim_set_program(channel, &program)) {
+                    LOG_WRN("Invalid stimulation program for channel %d", channel);
+                }
+                break;
+            }
+            case HOSTCOMM_HOST_MSG_INTAN_MSG_START_STIM: {
+                uint16_t mask = sys_get_le16(&msg.data[HOST_MESSAGE_START_STIM_MASK]);
+                uint16_t delay_frames = sys_get_le16(&msg.data[HOST_MESSAGE_START_STIM_DELAY]);
+                LOG_INF("Starting stimulation on channels 0x%x in %d frames", mask, delay_frames);
+
+                intan_stim_start(mask, intan_priv.frame_index + delay_frames);
+                break;
+            }
+            case HOSTCOMM_HOST_MSG_INTAN_MSG_STOP_STIM: {
+                uint16_t mask = sys_get_le16(&msg.data[HOST_MESSAGE_STOP_STIM_MASK]);
+                LOG_INF("Stopping stimulation on channels 0x%x", mask);
+
+                intan_stim_stop(mask);
+                break;
+            }
+            case HOSTCOMM_HOST_MSG_INTAN_MSG_SET_TRIGGER: {
+                uint8_t channel = msg.data[HOST_MESSAGE_TRIGGER_CHANNEL];
+                intan_trigger_config_t config = {
+                    .threshold = (int16_t) sys_get_le16(&msg.data[HOST_MESSAGE_TRIGGER_THRESHOLD]),
+                    .falling = msg.data[HOST_MESSAGE_TRIGGER_FLAGS] & 0x1,
+                    .refractory_frames = sys_get_le16(&msg.data[HOST_MESSAGE_TRIGGER_REFRACTORY]),
+                    .stim_mask = sys_get_le16(&msg.data[HOST_MESSAGE_TRIGGER_STIM_MASK]),
+                };
+                LOG_INF("Setting trigger of channel %d: threshold %d, stimulation on channels 0x%x", channel,
+                        config.threshold, config.stim_mask);
+
+                if (intan_trigger_configure(channel, &config)) {
+                    LOG_WRN("Invalid trigger channel %d", channel);
+                }
+                break;
+            }
+            case HOSTCOMM_HOST_MSG_INTAN_MSG_SET_STREAM_MODE: {
+                uint8_t stream_mode = msg.data[HOST_MESSAGE_STREAM_MODE];
+                LOG_INF("Setting stream mode to %d", stream_mode);
+
+                if (stream_mode > INTAN_STREAM_SAMPLES_DC) {
+                    LOG_WRN("Invalid stream mode %d", stream_mode);
+                    break;
+                }
+
+                // Whatever is buffered goes out before the mode changes
+                intan_batch_send_to_host();
+                intan_spike_flush();
+                intan_dc_flush();
+                intan_priv.stream_mode = stream_mode;
+                break;
+            }
+            case HOSTCOMM_HOST_MSG_INTAN_MSG_SET_SORT_TEMPLATE: {
+                // Templates are too long for one message, each message carries count samples starting at offset,
+                // at most (sizeof(msg.data) - HOST_MESSAGE_SORT_TEMPLATE_SAMPLES) / 2 = 13.
+                uint8_t channel = msg.data[HOST_MESSAGE_SORT_TEMPLATE_CHANNEL];
+                uint8_t unit = msg.data[HOST_MESSAGE_SORT_TEMPLATE_UNIT];
+                uint8_t offset = msg.data[HOST_MESSAGE_SORT_TEMPLATE_OFFSET];
+                uint8_t count = msg.data[HOST_MESSAGE_SORT_TEMPLATE_COUNT];
+                int16_t samples[INTAN_SPIKE_SNIPPET_LEN];
+                size_t end = HOST_MESSAGE_SORT_TEMPLATE_SAMPLES + count * sizeof(int16_t);
+
+                if (count > ARRAY_SIZE(samples) || end > msg.length || end > sizeof(msg.data)) {
+                    LOG_WRN("Invalid template message for channel %d", channel);
+                    break;
+                }
+
+                for (int i = 0; i < count; i++) {
+                    samples[i] = (int16_t) sys_get_le16(&msg.data[HOST_MESSAGE_SORT_TEMPLATE_SAMPLES + i * 2]);
+                }
+
+                if (intan_sort_set_template(channel, unit, offset, samples, count)) {
+                    LOG_WRN("Invalid template for channel %d unit %d", channel, unit);
+                }
+                break;
+            }
+            case HOSTCOMM_HOST_MSG_INTAN_MSG_SET_SORT_UNIT: {
+                uint8_t channel = msg.data[HOST_MESSAGE_SORT_UNIT_CHANNEL];
+                uint8_t unit = msg.data[HOST_MESSAGE_SORT_UNIT_UNIT];
+                bool enable = msg.data[HOST_MESSAGE_SORT_UNIT_FLAGS] & 0x1;
+                uint32_t max_distance = sys_get_le32(&msg.data[HOST_MESSAGE_SORT_UNIT_MAX_DISTANCE]);
+                LOG_INF("%s unit %d of channel %d, max distance %u", enable ? "Enabling" : "Disabling", unit, channel,
+                        max_distance);
+
+                if (intan_sort_set_unit(channel, unit, enable, max_distance)) {
+                    LOG_WRN("Invalid unit %d of channel %d", unit, channel);
+                }
+                break;
+            }
+            case HOSTCOMM_HOST_MSG_INTAN_MSG_SET_CODEC: {
+                uint8_t codec = msg.data[HOST_MESSAGE_CODEC];
+                LOG_INF("Setting sample codec to %d", codec);
+
+                if (codec > INTAN_CODEC_DELTA_RICE) {
+                    LOG_WRN("Invalid sample codec %d", codec);
+                    break;
+                }
+
+                // Every block is coded on its own, the switch can happen at any block
+                intan_priv.codec = codec;
+                break;
+            }
+            case HOSTCOMM_HOST_MSG_INTAN_MSG_SET_FILTER_STAGE: {
+                // Coefficients are Q2.14
+                uint16_t mask = sys_get_le16(&msg.data[HOST_MESSAGE_FILTER_STAGE_MASK]);
+                uint8_t stage = msg.data[HOST_MESSAGE_FILTER_STAGE_STAGE];
+                bool enable = msg.data[HOST_MESSAGE_FILTER_STAGE_FLAGS] & 0x1;
+                const uint8_t * c = &msg.data[HOST_MESSAGE_FILTER_STAGE_COEFFS];
+                intan_filter_coeffs_t coeffs = {
+                    .b0 = (int16_t) sys_get_le16(&c[0]),
+                    .b1 = (int16_t) sys_get_le16(&c[2]),
+                    .b2 = (int16_t) sys_get_le16(&c[4]),
+                    .a1 = (int16_t) sys_get_le16(&c[6]),
+                    .a2 = (int16_t) sys_get_le16(&c[8]),
+                };
+                LOG_INF("%s filter stage %d on channels 0x%x", enable ? "Setting" : "Clearing", stage, mask);
+
+                if (intan_filter_set_stage(mask, stage, enable, &coeffs)) {
+                    LOG_WRN("Invalid filter stage %d", stage);
+                }
+                break;
+            }
+            case HOSTCOMM_HOST_MSG_INTAN_MSG_SET_DECIM_TAPS: {
+                // The filter is too long for one message, each message carries count taps starting at offset.
+                // Taps are Q15.
+                uint8_t offset = msg.data[HOST_MESSAGE_DECIM_TAPS_OFFSET];
+                uint8_t count = msg.data[HOST_MESSAGE_DECIM_TAPS_COUNT];
+                int16_t taps[INTAN_DECIM_MAX_TAPS];
+                size_t end = HOST_MESSAGE_DECIM_TAPS_TAPS + count * sizeof(int16_t);
+
+                if (count > ARRAY_SIZE(taps) || end > msg.length) {
+                    LOG_WRN("Invalid decimation filter message");
+                    break;
+                }
+
+                for (int i = 0; i < count; i++) {
+                    taps[i] = (int16_t) sys_get_le16(&msg.data[HOST_MESSAGE_DECIM_TAPS_TAPS + i * 2]);
+                }
+
+                if (intan_decim_set_taps(offset, taps, count)) {
+                    LOG_WRN("Invalid decimation filter taps %d-%d", offset, offset + count - 1);
+                }
+                break;
+            }
+            case HOSTCOMM_HOST_MSG_INTAN_MSG_SET_DECIMATION: {
+                uint8_t factor = msg.data[HOST_MESSAGE_DECIMATION_FACTOR];
+                uint8_t num_taps = msg.data[HOST_MESSAGE_DECIMATION_NUM_TAPS];
+                uint16_t raw_mask = sys_get_le16(&msg.data[HOST_MESSAGE_DECIMATION_RAW_MASK]);
+                LOG_INF("Setting LFP decimation to %d with %d taps, raw samples of channels 0x%x", factor, num_taps,
+                        raw_mask);
+
+                if (intan_decim_configure(factor, num_taps)) {
+                    LOG_WRN("Invalid decimation filter");
+                    break;
+                }
+
+                // The mask is fixed for the whole block, a mask change always starts a new block
                 intan_batch_send_to_host();
+                intan_priv.raw_channel_mask = raw_mask;
+                break;
+            }
+            case HOSTCOMM_HOST_MSG_INTAN_MSG_SET_REREF_WEIGHTS: {
+                // A montage row does not fit one message, each message carries count weights starting at first_col.
+                // Weights are Q2.14.
+                uint8_t row = msg.data[HOST_MESSAGE_REREF_WEIGHTS_ROW];
+                uint8_t first_col = msg.data[HOST_MESSAGE_REREF_WEIGHTS_FIRST_COL];
+                uint8_t count = msg.data[HOST_MESSAGE_REREF_WEIGHTS_COUNT];
+                int16_t weights[NUM_CHANNELS];
+                size_t end = HOST_MESSAGE_REREF_WEIGHTS_WEIGHTS + count * sizeof(int16_t);
+
+                if (count > ARRAY_SIZE(weights) || end > msg.length) {
+                    LOG_WRN("Invalid montage message for row %d", row);
+                    break;
+                }
+
+                for (int i = 0; i < count; i++) {
+                    weights[i] = (int16_t) sys_get_le16(&msg.data[HOST_MESSAGE_REREF_WEIGHTS_WEIGHTS + i * 2]);
+                }
+
+                if (intan_reref_set_weights(row, first_col, weights, count)) {
+                    LOG_WRN("Invalid montage weights for row %d", row);
+                }
+                break;
+            }
+            case HOSTCOMM_HOST_MSG_INTAN_MSG_SET_REREF_MODE: {
+                uint8_t mode = msg.data[HOST_MESSAGE_REREF_MODE_MODE];
+                uint16_t ref_mask = sys_get_le16(&msg.data[HOST_MESSAGE_REREF_MODE_REF_MASK]);
+                LOG_INF("Setting re-referencing mode %d, reference channels 0x%x", mode, ref_mask);
+
+                if (intan_reref_set_mode(mode, ref_mask)) {
+                    LOG_WRN("Invalid re-referencing mode %d", mode);
+                }
+                break;
+            }
+            case HOSTCOMM_HOST_MSG_INTAN_MSG_SET_FEATURE_BAND: {
+                // b0, b1, b2, a1, a2 in Q2.14
+                uint8_t band = msg.data[HOST_MESSAGE_FEATURE_BAND_BAND];
+                bool enable = msg.data[HOST_MESSAGE_FEATURE_BAND_FLAGS] & 0x1;
+                int16_t coeffs[5];
+
+                for (int i = 0; i < ARRAY_SIZE(coeffs); i++) {
+                    coeffs[i] = (int16_t) sys_get_le16(&msg.data[HOST_MESSAGE_FEATURE_BAND_COEFFS + i * 2]);
+                }
+                LOG_INF("%s feature band %d", enable ? "Setting" : "Clearing", band);
+
+                if (intan_feature_set_band(band, enable, coeffs)) {
+                    LOG_WRN("Invalid feature band %d", band);
+                }
+                break;
+            }
+            case HOSTCOMM_HOST_MSG_INTAN_MSG_SET_FEATURE_WINDOW: {
+                uint16_t hop_samples = sys_get_le16(&msg.data[HOST_MESSAGE_FEATURE_WINDOW_HOP_SAMPLES]);
+                uint8_t hops_per_window = msg.data[HOST_MESSAGE_FEATURE_WINDOW_HOPS];
+                LOG_INF("Setting feature window to %d hops of %d samples", hops_per_window, hop_samples);
+
+                if (intan_feature_set_window(hop_samples, hops_per_window)) {
+                    LOG_WRN("Invalid feature window");
+                }
+                break;
+            }
+            case HOSTCOMM_HOST_MSG_INTAN_MSG_SET_DECODER_MATRIX: {
+                // A matrix does not fit one message, each message carries count values of a row starting at first_col.
+                // Values are Q2.14 (bias: state units).
+                uint8_t matrix = msg.data[HOST_MESSAGE_DECODER_MATRIX_MATRIX];
+                uint8_t row = msg.data[HOST_MESSAGE_DECODER_MATRIX_ROW];
+                uint8_t first_col = msg.data[HOST_MESSAGE_DECODER_MATRIX_FIRST_COL];
+                uint8_t count = msg.data[HOST_MESSAGE_DECODER_MATRIX_COUNT];
+                int16_t values[(sizeof(msg.data) - HOST_MESSAGE_DECODER_MATRIX_VALUES) / 2];
+                size_t end = HOST_MESSAGE_DECODER_MATRIX_VALUES + count * sizeof(int16_t);
+
+                if (count > ARRAY_SIZE(values) || end > msg.length) {
+                    LOG_WRN("Invalid decoder matrix message");
+                    break;
+                }
+
+                for (int i = 0; i < count; i++) {
+                    values[i] = (int16_t) sys_get_le16(&msg.data[HOST_MESSAGE_DECODER_MATRIX_VALUES + i * 2]);
+                }
+
+                if (intan_decoder_set_matrix(matrix, row, first_col, values, count)) {
+                    LOG_WRN("Invalid decoder matrix %d row %d columns %d-%d", matrix, row, first_col,
+                            first_col + count - 1);
+                }
+                break;
+            }
+            case HOSTCOMM_HOST_MSG_INTAN_MSG_SET_DECODER: {
+                uint8_t mode = msg.data[HOST_MESSAGE_DECODER_MODE];
+                uint8_t num_states = msg.data[HOST_MESSAGE_DECODER_NUM_STATES];
+                uint8_t num_outputs = msg.data[HOST_MESSAGE_DECODER_NUM_OUTPUTS];
+                LOG_INF("Setting decoder mode %d, %d states, %d outputs", mode, num_states, num_outputs);
+
+                if (intan_decoder_configure(mode, num_states, num_outputs)) {
+                    LOG_WRN("Invalid decoder configuration");
+                }
+                break;
+            }
+            case HOSTCOMM_HOST_MSG_INTAN_MSG_SET_CALIBRATION: {
+                // Gain is Q2.14
+                uint8_t channel = msg.data[HOST_MESSAGE_CALIBRATION_CHANNEL];
+                int16_t offset = (int16_t) sys_get_le16(&msg.data[HOST_MESSAGE_CALIBRATION_OFFSET]);
+                int16_t gain = (int16_t) sys_get_le16(&msg.data[HOST_MESSAGE_CALIBRATION_GAIN]);
+                LOG_INF("Setting calibration of channel %d: offset %d, gain %d", channel, offset, gain);
+
+                if (intan_cal_set(channel, offset, gain)) {
+                    LOG_WRN("Invalid calibration channel %d", channel);
+                }
+                break;
+            }
+            case HOSTCOMM_HOST_MSG_INTAN_MSG_START_CALIBRATION: {
+                uint16_t num_frames = sys_get_le16(&msg.data[HOST_MESSAGE_START_CALIBRATION_FRAMES]);
+                LOG_INF("Calibrating offsets over %d frames", num_frames);
+
+                if (!intan_priv.acquisition_running) {
+                    LOG_WRN("Calibration needs acquisition running");
+                }
+                else if (intan_cal_start(num_frames, intan_frame_period_ns())) {
+                    LOG_WRN("Calibration not started");
+                }
+                break;
+            }
+            case HOSTCOMM_HOST_MSG_INTAN_MSG_READ_REGISTER: {
+                uint8_t reg = msg.data[HOST_MESSAGE_READ_REGISTER];
+                LOG_INF("Reading register %d for the host", reg);
+
+                if (intan_read_register_async(reg, intan_host_read_done, NULL)) {
+                    LOG_WRN("Aux queue full, register %d not read", reg);
+                }
+                break;
+            }
+            case HOSTCOMM_HOST_MSG_INTAN_MSG_SET_DC_STREAM: {
+                uint16_t mask = sys_get_le16(&msg.data[HOST_MESSAGE_DC_STREAM_MASK]);
+                uint8_t decimation = msg.data[HOST_MESSAGE_DC_STREAM_DECIMATION];
+                LOG_INF("Setting DC stream to channels 0x%x, every %d frames", mask, decimation);
+
+                if (intan_dc_configure(mask, decimation)) {
+                    LOG_WRN("Invalid DC decimation %d", decimation);
+                }
+                break;
+            }
+            case HOSTCOMM_HOST_MSG_INTAN_MSG_SET_AUX_SLOTS: {
+                uint8_t num_aux_slots = msg.data[HOST_MESSAGE_AUX_SLOTS];
+                LOG_INF("Setting %d aux slots per frame", num_aux_slots);
+
+                if (intan_set_num_aux_slots(num_aux_slots)) {
+                    LOG_WRN("Aux slots must be 1 to %d", INTAN_NUM_AUX_COMMANDS);
+                }
                 break;
             }
             default:
@@ -404,17 +1383,64 @@ void intan_thread_func(void * param1, void * param2, void * param3) {
             continue;
         }
 
-        // Process host message first before sampling/recording
+        if (!intan_priv.acquisition_running && intan_acquisition_start()) {
+            LOG_ERR("Failed to start acquisition");
+            k_sleep(K_MSEC(INTAN_ACQUISITION_WATCHDOG_MS));
+            continue;
+        }
+
+        // Frames are sampled and decoded in completion context, this thread only sleeps until one is ready
+        intan_frame_t frame;
+        if (k_msgq_get(&intan_frame_msgq, &frame, K_MSEC(INTAN_ACQUISITION_WATCHDOG_MS)) != 0) {
+            LOG_ERR("No frame for %d ms, restarting acquisition", INTAN_ACQUISITION_WATCHDOG_MS);
+            intan_acquisition_stop();
+            continue;
+        }
+
+        uint32_t start_cycles = cpu_cycles_get();
+
+        // Process host message first so its commands make it into the next frame
         intan_process_host_message();
-        intan_continuous_sample();
-        intan_step_up_stim();
+        intan_process_frame(&frame);
+        intan_trigger_process_events();
+        intan_cal_process();
+        intan_send_register_reads();
+
+        // A chip that was reset is noticed by its chip ID, intan_regs.h takes it from there
+        if (k_uptime_get() - intan_priv.last_chip_id_check_ms >= INTAN_CHIP_ID_CHECK_INTERVAL_MS) {
+            if (intan_read_register_async(RO_REG_CHIP_ID, intan_regs_chip_id_read, NULL)) {
+                LOG_WRN("Aux queue full, chip ID not checked");
+            }
+            intan_priv.last_chip_id_check_ms = k_uptime_get();
+        }
 
         // TODO: fix this minus 16 logic, basically we are sending early in case the next iteration of sample runs over
-        if (intan_priv.current_batch_count >= (INTAN_BUFFER_SIZE - NUM_CHANNELS)) {
+        if (intan_priv.current_block && intan_priv.current_block->sample_count >= (INTAN_BUFFER_SIZE - INTAN_FRAME_MAX_SAMPLES)) {
             intan_batch_send_to_host();
         }
 
-        k_sleep(K_USEC(intan_priv.sample_delay_us));
+        intan_priv.cpu_stats.thread_cycles += cpu_cycles_get() - start_cycles;
+
+        if (k_uptime_get() - intan_priv.last_stats_log_time_ms >= SAMPLE_CLOCK_STATS_LOG_INTERVAL_MS) {
+            sample_clock_log_stats();
+            intan_log_cpu_stats();
+            sample_ring_log_stats();
+            ble_log_stats();
+            intan_regs_log_stats();
+            intan_aux_log_stats(intan_frame_period_ns());
+            intan_stim_log_stats();
+            intan_trigger_log_stats();
+            intan_spike_log_stats();
+            intan_sort_log_stats();
+            intan_log_codec_stats();
+            intan_filter_log_stats();
+            intan_decim_log_stats();
+            intan_reref_log_stats(intan_frame_period_ns());
+            intan_feature_log_stats();
+            intan_decoder_log_stats(intan_frame_period_ns());
+            intan_dc_log_stats();
+            intan_priv.last_stats_log_time_ms = k_uptime_get();
+        }
     }
 
 }
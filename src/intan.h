@@ -1,6 +1,7 @@
 #pragma once
 #include <stdio.h>
 #include <stdint.h>
+#include "intan_aux.h"
 
 /*
 This head file is for Intan RHS2116.
@@ -132,7 +133,10 @@ typedef struct __attribute__ ((__packed__)) {
 
 
 int intan_headstage_init(void);
-void intan_continuous_sample(void);
+int intan_acquisition_start(void);
+void intan_acquisition_stop(void);
+int intan_set_num_aux_slots(uint8_t num_aux_slots);
+int intan_queue_aux_command(uint32_t command, intan_aux_prio_t prio, uint32_t deadline_frames);
+void intan_log_cpu_stats(void);
 void intan_dump_channel_data(void);
 void intan_send_and_receive(uint32_t command);
-void intan_step_up_stim(void);
\ No newline at end of file
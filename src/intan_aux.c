@@ -0,0 +1,133 @@
+/*
+This file contains the aux slot command scheduler.
+
+intan_aux_submit() is called from the Intan thread, intan_aux_pop() from completion context while it fills the aux
+slots of the next frame. The queues are small, so a linear search for the earliest deadline is cheaper than keeping
+them sorted.
+*/
+
+#include <kernel.h>
+#include <logging/log.h>
+
+#include "intan_aux.h"
+
+#define LOG_MODULE_NAME       intan_aux_c
+LOG_MODULE_REGISTER(LOG_MODULE_NAME, LOG_LEVEL_INF);
+
+intan_aux_priv_t intan_aux_priv;
+
+static const char * const intan_aux_prio_names[INTAN_AUX_NUM_PRIOS] = {
+    "stim",
+    "host",
+    "housekeeping",
+};
+
+void intan_aux_init(void) {
+    memset(&intan_aux_priv, 0, sizeof(intan_aux_priv_t));
+}
+
+// Queue command to go out within deadline_frames frames of now_frame. read is the request behind a READ, or NULL.
+int intan_aux_submit(intan_aux_prio_t prio, uint32_t command, uint32_t now_frame, uint32_t deadline_frames,
+                     const intan_read_request_t * read) {
+
+    int err = 0;
+
+    if (prio >= INTAN_AUX_NUM_PRIOS) {
+        return -EINVAL;
+    }
+
+    k_spinlock_key_t key = k_spin_lock(&intan_aux_priv.lock);
+
+    if (intan_aux_priv.count[prio] >= INTAN_AUX_QUEUE_DEPTH) {
+        intan_aux_priv.stats[prio].rejected++;
+        err = -ENOMEM;
+    }
+    else {
+        intan_aux_cmd_t * cmd = &intan_aux_priv.queue[prio][intan_aux_priv.count[prio]++];
+
+        cmd->command = command;
+        cmd->queued_frame = now_frame;
+        cmd->deadline = now_frame + deadline_frames;
+        cmd->order = intan_aux_priv.next_order++;
+
+        if (read) {
+            cmd->read = *read;
+        }
+        else {
+            cmd->read.cb = NULL;
+        }
+    }
+
+    k_spin_unlock(&intan_aux_priv.lock, key);
+
+    return err;
+}
+
+// Take the most urgent command to send in frame, false if nothing is waiting
+bool intan_aux_pop(uint32_t frame, intan_aux_cmd_t * cmd) {
+
+    bool found = false;
+    k_spinlock_key_t key = k_spin_lock(&intan_aux_priv.lock);
+
+    for (int prio = 0; prio < INTAN_AUX_NUM_PRIOS && !found; prio++) {
+
+        intan_aux_cmd_t * queue = intan_aux_priv.queue[prio];
+        int best = -1;
+
+        for (int i = 0; i < intan_aux_priv.count[prio]; i++) {
+            // Differences instead of plain compares, frame indices and order wrap around
+            if (best < 0 || (int32_t) (queue[i].deadline - queue[best].deadline) < 0 ||
+                (queue[i].deadline == queue[best].deadline && (int32_t) (queue[i].order - queue[best].order) < 0)) {
+                best = i;
+            }
+        }
+
+        if (best < 0) {
+            continue;
+        }
+
+        *cmd = queue[best];
+        queue[best] = queue[--intan_aux_priv.count[prio]];
+        found = true;
+
+        intan_aux_stats_t * stats = &intan_aux_priv.stats[prio];
+        uint32_t latency = frame - cmd->queued_frame;
+
+        stats->sent++;
+        stats->latency_sum += latency;
+        if (latency > stats->latency_max) {
+            stats->latency_max = latency;
+        }
+        if ((int32_t) (frame - cmd->deadline) > 0) {
+            stats->late++;
+        }
+    }
+
+    k_spin_unlock(&intan_aux_priv.lock, key);
+
+    return found;
+}
+
+// Queueing latency per priority, statistics restart after every log
+void intan_aux_log_stats(uint32_t frame_period_ns) {
+
+    intan_aux_stats_t stats[INTAN_AUX_NUM_PRIOS];
+
+    k_spinlock_key_t key = k_spin_lock(&intan_aux_priv.lock);
+    memcpy(stats, intan_aux_priv.stats, sizeof(stats));
+    memset(intan_aux_priv.stats, 0, sizeof(intan_aux_priv.stats));
+    k_spin_unlock(&intan_aux_priv.lock, key);
+
+    for (int prio = 0; prio < INTAN_AUX_NUM_PRIOS; prio++) {
+        if (stats[prio].sent == 0 && stats[prio].rejected == 0) {
+            continue;
+        }
+
+        uint32_t avg_frames = stats[prio].sent ? stats[prio].latency_sum / stats[prio].sent : 0;
+
+        LOG_INF("Aux %s: %d sent, %d late, %d rejected, latency avg %d us, max %d us", intan_aux_prio_names[prio],
+                stats[prio].sent, stats[prio].late, stats[prio].rejected,
+                (uint32_t) (((uint64_t) avg_frames * frame_period_ns) / NSEC_PER_USEC),
+                (uint32_t) (((uint64_t) stats[prio].latency_max * frame_period_ns) / NSEC_PER_USEC));
+    }
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <kernel.h>
+#include "config.h"
+#include "intan_helper.h"
+
+/*
+Queue of commands waiting for an aux slot, spanning as many frames as needed.
+
+Every frame, completion context takes commands for its aux slots by priority and, within a priority, earliest
+deadline first (commands with the same deadline keep their order). Stimulation timing is served before anything else,
+so it always gets the slots it needs, and host configuration and housekeeping fill what is left.
+Deadlines and latencies are counted in frames.
+*/
+
+typedef enum intan_aux_prio_t {
+    INTAN_AUX_PRIO_STIM = 0,       // stimulation timing
+    INTAN_AUX_PRIO_HOST,           // configuration from the host
+    INTAN_AUX_PRIO_HOUSEKEEPING,   // register reads and anything else that can wait
+    INTAN_AUX_NUM_PRIOS,
+} intan_aux_prio_t;
+
+typedef struct intan_aux_cmd_t {
+    uint32_t command;
+    uint32_t queued_frame;
+    uint32_t deadline;       // frame index it should go out in at the latest
+    uint32_t order;          // submission order, keeps commands with the same deadline in order
+    intan_read_request_t read;
+} intan_aux_cmd_t;
+
+typedef struct intan_aux_stats_t {
+    uint32_t sent;
+    uint32_t late;           // sent after their deadline
+    uint32_t rejected;       // queue was full
+    uint32_t latency_sum;    // frames between queueing and sending
+    uint32_t latency_max;
+} intan_aux_stats_t;
+
+typedef struct intan_aux_priv_t {
+    struct k_spinlock lock;
+
+    intan_aux_cmd_t queue[INTAN_AUX_NUM_PRIOS][INTAN_AUX_QUEUE_DEPTH]; // unordered, searched on every pop
+    uint8_t count[INTAN_AUX_NUM_PRIOS];
+    uint32_t next_order;
+
+    intan_aux_stats_t stats[INTAN_AUX_NUM_PRIOS];
+} intan_aux_priv_t;
+
+void intan_aux_init(void);
+int intan_aux_submit(intan_aux_prio_t prio, uint32_t command, uint32_t now_frame, uint32_t deadline_frames,
+                     const intan_read_request_t * read);
+bool intan_aux_pop(uint32_t frame, intan_aux_cmd_t * cmd);
+void intan_aux_log_stats(uint32_t frame_period_ns);
@@ -0,0 +1,243 @@
+/*
+This file contains the gain/offset calibration. The table is changed from the Intan thread (and from settings loading),
+always under the lock, completion context only reads it.
+*/
+
+#include <kernel.h>
+#include <logging/log.h>
+#include <settings/settings.h>
+
+#include "intan_cal.h"
+
+#define LOG_MODULE_NAME       intan_cal_c
+LOG_MODULE_REGISTER(LOG_MODULE_NAME, LOG_LEVEL_INF);
+
+#define INTAN_CAL_SETTINGS_KEY  "intan_cal/table"
+
+intan_cal_priv_t intan_cal_priv;
+
+static bool intan_cal_table_is_identity(const intan_cal_table_t * table) {
+
+    for (int channel = 0; channel < NUM_CHANNELS; channel++) {
+        if (table->offset[channel] != 0 || table->gain[channel] != INTAN_CAL_GAIN_ONE) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Must be called with the lock held
+static void intan_cal_table_changed(void) {
+    intan_cal_priv.identity = intan_cal_table_is_identity(&intan_cal_priv.table);
+}
+
+static void intan_cal_save_work(struct k_work * work) {
+
+    intan_cal_table_t table;
+
+    if (!IS_ENABLED(CONFIG_SETTINGS)) {
+        return;
+    }
+
+    k_spinlock_key_t key = k_spin_lock(&intan_cal_priv.lock);
+    table = intan_cal_priv.table;
+    k_spin_unlock(&intan_cal_priv.lock, key);
+
+    int err = settings_save_one(INTAN_CAL_SETTINGS_KEY, &table, sizeof(table));
+    if (err) {
+        LOG_ERR("Failed to store calibration table (err %d)", err);
+    }
+}
+
+#if defined(CONFIG_SETTINGS)
+// Settings subsystem found a stored table
+static int intan_cal_settings_set(const char * name, size_t len, settings_read_cb read_cb, void * cb_arg) {
+
+    const char * next;
+    intan_cal_table_t table;
+
+    if (!settings_name_steq(name, "table", &next) || next) {
+        return -ENOENT;
+    }
+
+    if (len != sizeof(table)) {
+        LOG_WRN("Ignoring stored calibration table of %d bytes", len);
+        return 0;
+    }
+
+    ssize_t rc = read_cb(cb_arg, &table, sizeof(table));
+    if (rc < 0) {
+        return rc;
+    }
+
+    if (table.version != INTAN_CAL_TABLE_VERSION) {
+        LOG_WRN("Ignoring stored calibration table version %d", table.version);
+        return 0;
+    }
+
+    k_spinlock_key_t key = k_spin_lock(&intan_cal_priv.lock);
+    intan_cal_priv.table = table;
+    intan_cal_table_changed();
+    k_spin_unlock(&intan_cal_priv.lock, key);
+
+    LOG_INF("Restored calibration table");
+
+    return 0;
+}
+
+SETTINGS_STATIC_HANDLER_DEFINE(intan_cal, "intan_cal", NULL, intan_cal_settings_set, NULL, NULL);
+#endif
+
+void intan_cal_init(void) {
+
+    memset(&intan_cal_priv, 0, sizeof(intan_cal_priv_t));
+
+    intan_cal_priv.table.version = INTAN_CAL_TABLE_VERSION;
+    for (int channel = 0; channel < NUM_CHANNELS; channel++) {
+        intan_cal_priv.table.gain[channel] = INTAN_CAL_GAIN_ONE;
+    }
+    intan_cal_priv.identity = true;
+
+    k_work_init_delayable(&intan_cal_priv.save_work, intan_cal_save_work);
+
+    // The stored table may not have been loaded yet (BLE loads all settings later) or was wiped by the memset above
+    if (IS_ENABLED(CONFIG_SETTINGS)) {
+        int err = settings_subsys_init();
+        if (!err) {
+            err = settings_load_subtree("intan_cal");
+        }
+        if (err) {
+            LOG_ERR("Failed to load calibration table (err %d)", err);
+        }
+    }
+}
+
+// Set the calibration of channel, gain in Q2.14. Stored once the changes stop for INTAN_CAL_SAVE_DELAY_MS.
+int intan_cal_set(uint8_t channel, int16_t offset, int16_t gain) {
+
+    if (channel >= NUM_CHANNELS) {
+        return -EINVAL;
+    }
+
+    k_spinlock_key_t key = k_spin_lock(&intan_cal_priv.lock);
+    intan_cal_priv.table.offset[channel] = offset;
+    intan_cal_priv.table.gain[channel] = gain;
+    intan_cal_table_changed();
+    k_spin_unlock(&intan_cal_priv.lock, key);
+
+    k_work_reschedule(&intan_cal_priv.save_work, K_MSEC(INTAN_CAL_SAVE_DELAY_MS));
+
+    return 0;
+}
+
+// Average every channel over the next num_frames frames, the means become the offsets. The inputs must be at baseline.
+// Acquisition must be running, with frames of frame_period_ns.
+int intan_cal_start(uint32_t num_frames, uint32_t frame_period_ns) {
+
+    if (num_frames == 0) {
+        return -EINVAL;
+    }
+
+    if (intan_cal_priv.calibrating) {
+        return -EBUSY;
+    }
+
+    k_spinlock_key_t key = k_spin_lock(&intan_cal_priv.lock);
+    memset(intan_cal_priv.sum, 0, sizeof(intan_cal_priv.sum));
+    memset(intan_cal_priv.count, 0, sizeof(intan_cal_priv.count));
+    intan_cal_priv.calibrating = true;
+    intan_cal_priv.frames_left = num_frames;
+    intan_cal_priv.deadline_ms = k_uptime_get() + INTAN_ACQUISITION_WATCHDOG_MS +
+                                 ((uint64_t) num_frames * frame_period_ns * INTAN_CAL_TIMEOUT_FACTOR) / NSEC_PER_MSEC;
+    k_spin_unlock(&intan_cal_priv.lock, key);
+
+    return 0;
+}
+
+// Give up the calibration routine, the offsets stay as they were
+void intan_cal_cancel(void) {
+
+    if (!intan_cal_priv.calibrating) {
+        return;
+    }
+
+    k_spinlock_key_t key = k_spin_lock(&intan_cal_priv.lock);
+    intan_cal_priv.frames_left = 0;
+    intan_cal_priv.calibrating = false;
+    k_spin_unlock(&intan_cal_priv.lock, key);
+
+    LOG_WRN("Calibration cancelled");
+}
+
+// Intan thread: finish the calibration routine once its frames are in
+void intan_cal_process(void) {
+
+    if (!intan_cal_priv.calibrating) {
+        return;
+    }
+
+    if (intan_cal_priv.frames_left) {
+        if (k_uptime_get() > intan_cal_priv.deadline_ms) {
+            LOG_WRN("Calibration frames did not come in time, %d left", intan_cal_priv.frames_left);
+            intan_cal_cancel();
+        }
+        return;
+    }
+
+    int16_t min_offset = INT16_MAX;
+    int16_t max_offset = INT16_MIN;
+
+    k_spinlock_key_t key = k_spin_lock(&intan_cal_priv.lock);
+
+    for (int channel = 0; channel < NUM_CHANNELS; channel++) {
+        // Channels that were not recorded keep their offset
+        if (intan_cal_priv.count[channel] == 0) {
+            continue;
+        }
+
+        int64_t sum = intan_cal_priv.sum[channel];
+        int64_t count = intan_cal_priv.count[channel];
+        int16_t offset = (sum >= 0) ? (sum + count / 2) / count : (sum - count / 2) / count;
+
+        intan_cal_priv.table.offset[channel] = offset;
+        min_offset = MIN(min_offset, offset);
+        max_offset = MAX(max_offset, offset);
+    }
+
+    intan_cal_table_changed();
+    intan_cal_priv.calibrating = false;
+
+    k_spin_unlock(&intan_cal_priv.lock, key);
+
+    LOG_INF("Calibration done, offsets %d to %d", min_offset, max_offset);
+
+    k_work_reschedule(&intan_cal_priv.save_work, K_MSEC(INTAN_CAL_SAVE_DELAY_MS));
+}
+
+// Completion context: corrected AC sample of channel
+uint16_t intan_cal_apply(uint8_t channel, uint16_t raw) {
+
+    int32_t x = (int32_t) raw - INTAN_AC_MID_SCALE;
+
+    if (intan_cal_priv.frames_left) {
+        intan_cal_priv.sum[channel] += x;
+        intan_cal_priv.count[channel]++;
+    }
+
+    if (intan_cal_priv.identity) {
+        return raw;
+    }
+
+    int32_t d = CLAMP(x - intan_cal_priv.table.offset[channel], INT16_MIN, INT16_MAX);
+    int32_t y = (d * intan_cal_priv.table.gain[channel] + (1 << 13)) >> 14;
+
+    return CLAMP(y, INT16_MIN, INT16_MAX) + INTAN_AC_MID_SCALE;
+}
+
+// Completion context: end of an acquisition frame
+void intan_cal_frame_done(void) {
+
+    if (intan_cal_priv.frames_left) {
+        intan_cal_priv.frames_left--;
+    }
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <kernel.h>
+#include "config.h"
+#include "intan_helper.h"
+
+/*
+Per-channel gain and offset calibration, applied in completion context to every CONVERT result right after it is
+decoded, so everything downstream (trigger, history, filters, codec, host) sees corrected samples:
+
+    corrected = ((raw - mid scale - offset) * gain) >> 14 + mid scale
+
+Offsets are in ADC counts, gains are Q2.14. Offsets come from the calibration routine, which averages every channel
+over a number of frames while the inputs sit at baseline. Gains and offsets can also be set by the host. The table is
+stored with the settings subsystem INTAN_CAL_SAVE_DELAY_MS after the last change, so a host setting all channels in a
+row costs one flash write, and restored when the Intan headstage is initialized.
+
+The calibration routine is cancelled when acquisition stops, and given up if its frames take more than
+INTAN_CAL_TIMEOUT_FACTOR times as long as they should.
+*/
+
+#define INTAN_CAL_GAIN_ONE  (1 << 14)
+
+// Layout stored with the settings subsystem, INTAN_CAL_TABLE_VERSION goes up when it changes
+#define INTAN_CAL_TABLE_VERSION  1
+
+typedef struct intan_cal_table_t {
+    uint8_t version;
+    int16_t offset[NUM_CHANNELS];
+    int16_t gain[NUM_CHANNELS];
+} intan_cal_table_t;
+
+typedef struct intan_cal_priv_t {
+    struct k_spinlock lock;
+
+    intan_cal_table_t table;
+    bool identity;                     // table changes nothing, completion context skips it
+
+    // Calibration routine, the sums are filled in completion context
+    volatile uint32_t frames_left;     // 0 = not calibrating
+    bool calibrating;
+    int64_t deadline_ms;               // k_uptime_get() by which the frames must be in
+    int64_t sum[NUM_CHANNELS];         // raw samples relative to mid scale
+    uint32_t count[NUM_CHANNELS];
+
+    struct k_work_delayable save_work; // flash writes go to the system work queue, not the Intan thread
+} intan_cal_priv_t;
+
+void intan_cal_init(void);
+int intan_cal_set(uint8_t channel, int16_t offset, int16_t gain);
+int intan_cal_start(uint32_t num_frames, uint32_t frame_period_ns);
+void intan_cal_cancel(void);
+void intan_cal_process(void);
+uint16_t intan_cal_apply(uint8_t channel, uint16_t raw);
+void intan_cal_frame_done(void);
@@ -0,0 +1,151 @@
+/*
+This file contains the lossless sample block encoder. It runs in the Intan thread whenever a block is complete.
+*/
+
+#include <errno.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/util.h>
+
+#include "intan_codec.h"
+
+typedef struct intan_codec_writer_t {
+    uint8_t * out;
+    size_t out_size;
+    size_t bit_pos;
+    bool overflow;
+} intan_codec_writer_t;
+
+static void intan_codec_put_bits(intan_codec_writer_t * w, uint32_t value, uint8_t num_bits) {
+
+    for (int i = num_bits - 1; i >= 0; i--) {
+        size_t byte = w->bit_pos >> 3;
+
+        if (byte >= w->out_size) {
+            w->overflow = true;
+            return;
+        }
+        if ((w->bit_pos & 7) == 0) {
+            w->out[byte] = 0;
+        }
+
+        w->out[byte] |= ((value >> i) & 1) << (7 - (w->bit_pos & 7));
+        w->bit_pos++;
+    }
+}
+
+static uint32_t intan_codec_zigzag(int32_t e) {
+    return ((uint32_t) e << 1) ^ (uint32_t) (e >> 31);
+}
+
+static uint8_t intan_codec_rice_k(uint32_t a, uint32_t n) {
+
+    uint8_t k = 0;
+
+    while ((n << k) < a && k < INTAN_CODEC_MAX_K) {
+        k++;
+    }
+    return k;
+}
+
+static void intan_codec_put_rice(intan_codec_writer_t * w, uint32_t m, uint8_t k) {
+
+    uint32_t q = m >> k;
+
+    if (q >= INTAN_CODEC_ESCAPE) {
+        intan_codec_put_bits(w, BIT_MASK(INTAN_CODEC_ESCAPE), INTAN_CODEC_ESCAPE);
+        intan_codec_put_bits(w, m, INTAN_CODEC_ESCAPE_BITS);
+        return;
+    }
+
+    // unary q, at most INTAN_CODEC_ESCAPE - 1 ones, then the zero
+    intan_codec_put_bits(w, BIT_MASK(q) << 1, q + 1);
+    intan_codec_put_bits(w, m & BIT_MASK(k), k);
+}
+
+// Residual of sample i of a group with the given predictor order
+static int32_t intan_codec_residual(const int32_t * x, int i, uint8_t order) {
+
+    if (order == 0 || i < 2) {
+        return x[i] - x[i - 1];
+    }
+    return x[i] - (2 * x[i - 1] - x[i - 2]);
+}
+
+static void intan_codec_encode_group(intan_codec_writer_t * w, uint8_t tag, const int32_t * x, uint8_t count) {
+
+    uint32_t sum[2] = {0, 0};
+
+    for (int i = 1; i < count; i++) {
+        sum[0] += intan_codec_zigzag(intan_codec_residual(x, i, 0));
+        sum[1] += intan_codec_zigzag(intan_codec_residual(x, i, 1));
+    }
+
+    uint8_t order = sum[1] < sum[0];
+    uint8_t k = (count > 1) ? intan_codec_rice_k(sum[order], count - 1) : 0;
+
+    intan_codec_put_bits(w, tag, 8);
+    intan_codec_put_bits(w, count, 7);
+    intan_codec_put_bits(w, order, 1);
+    intan_codec_put_bits(w, k, 5);
+    intan_codec_put_bits(w, x[0], 16);
+
+    uint32_t a = 1 << k;
+    uint32_t n = 1;
+
+    for (int i = 1; i < count; i++) {
+        uint32_t m = intan_codec_zigzag(intan_codec_residual(x, i, order));
+
+        intan_codec_put_rice(w, m, intan_codec_rice_k(a, n));
+
+        a += m;
+        n++;
+        if (n == INTAN_CODEC_RESET) {
+            a >>= 1;
+            n >>= 1;
+        }
+    }
+}
+
+/*
+Encode num_samples samples (at most 127 of one tag) into out. Returns the number of bytes written or -ENOSPC if they
+do not fit out_size, in which case the block is better sent as it is.
+*/
+int intan_codec_encode(const hostcomm_sample_t * samples, uint16_t num_samples, uint8_t * out, size_t out_size) {
+
+    intan_codec_writer_t w = {
+        .out = out,
+        .out_size = out_size,
+    };
+    uint32_t done[8] = {0}; // samples already coded, one bit each
+    int32_t x[BIT_MASK(7)];
+
+    if (num_samples > sizeof(done) * 8) {
+        return -EINVAL;
+    }
+
+    for (int first = 0; first < num_samples; first++) {
+
+        if (done[first / 32] & BIT(first % 32)) {
+            continue;
+        }
+
+        uint8_t tag = samples[first].tag;
+        uint8_t count = 0;
+
+        for (int i = first; i < num_samples && count < ARRAY_SIZE(x); i++) {
+            if (samples[i].tag == tag && !(done[i / 32] & BIT(i % 32))) {
+                x[count++] = samples[i].ac_data;
+                done[i / 32] |= BIT(i % 32);
+            }
+        }
+
+        intan_codec_encode_group(&w, tag, x, count);
+
+        if (w.overflow) {
+            return -ENOSPC;
+        }
+    }
+
+    return (w.bit_pos + 7) / 8;
+}
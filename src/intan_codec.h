@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "hostcomm.h"
+
+/*
+Lossless codec for sample blocks. Every block is coded on its own, so a lost packet never affects the next one.
+
+The samples of a block are regrouped by tag, in the order the tags first show up. Every group is predicted from its
+own previous samples, with a first (x[n-1]) or second order (2 x[n-1] - x[n-2]) predictor, whichever leaves the
+smaller residuals for that group. Residuals are zigzag mapped to unsigned and Rice coded. The Rice parameter adapts
+as in LOCO-I: k is the smallest value with N << k >= A, where A sums the mapped residuals and N counts them, both
+halved every INTAN_CODEC_RESET samples.
+
+Bit stream, most significant bit first, per group:
+    tag            8 bits
+    count          7 bits, samples in the group
+    order          1 bit, 0 = first order, 1 = second order
+    k              5 bits, Rice parameter to start with (A = 1 << k, N = 1)
+    first sample   16 bits, as is
+    count - 1 residuals, the second sample always with the first order predictor
+A residual is q = m >> k in unary (q ones and a zero) followed by the k low bits of m. If q would reach
+INTAN_CODEC_ESCAPE, INTAN_CODEC_ESCAPE ones are followed by m in INTAN_CODEC_ESCAPE_BITS bits instead.
+The last byte is padded with zeros. tools/intan_codec.py is the reference decoder.
+*/
+
+#define INTAN_CODEC_RESET        32
+#define INTAN_CODEC_ESCAPE       24
+#define INTAN_CODEC_ESCAPE_BITS  20
+#define INTAN_CODEC_MAX_K        18
+
+typedef enum intan_codec_t {
+    INTAN_CODEC_NONE = 0,
+    INTAN_CODEC_DELTA_RICE,
+} intan_codec_t;
+
+int intan_codec_encode(const hostcomm_sample_t * samples, uint16_t num_samples, uint8_t * out, size_t out_size);
@@ -0,0 +1,154 @@
+/*
+This file contains the DC amplifier stream. Configuration and packing both run in the Intan thread.
+*/
+
+#include <kernel.h>
+#include <logging/log.h>
+
+#include "intan_dc.h"
+#include "sample_pool.h"
+#include "sample_ring.h"
+
+#define LOG_MODULE_NAME       intan_dc_c
+LOG_MODULE_REGISTER(LOG_MODULE_NAME, LOG_LEVEL_INF);
+
+intan_dc_priv_t intan_dc_priv;
+
+void intan_dc_init(void) {
+
+    if (intan_dc_priv.current_block) {
+        sample_pool_unref(intan_dc_priv.current_block);
+    }
+
+    memset(&intan_dc_priv, 0, sizeof(intan_dc_priv_t));
+    intan_dc_priv.decimation = 1;
+}
+
+// Stream the DC values of the channels in channel_mask once every decimation frames, or stop with an empty mask
+int intan_dc_configure(uint16_t channel_mask, uint8_t decimation) {
+
+    if (decimation == 0) {
+        return -EINVAL;
+    }
+
+    intan_dc_flush();
+
+    intan_dc_priv.channel_mask = channel_mask;
+    intan_dc_priv.decimation = decimation;
+    intan_dc_priv.phase = 0;
+
+    return 0;
+}
+
+// Hand the DC packet being filled to hostcomm
+void intan_dc_flush(void) {
+
+    sample_block_t * block = intan_dc_priv.current_block;
+
+    if (block == NULL) {
+        return;
+    }
+
+    intan_dc_priv.current_block = NULL;
+    block->sample_count = (intan_dc_priv.bit_pos + 7) / 8;
+
+    if (sample_ring_put(block)) {
+        intan_dc_priv.stats.packets++;
+    }
+    else {
+        intan_dc_priv.stats.dropped += block->dc_msg.num_ticks;
+        sample_pool_unref(block);
+    }
+}
+
+static void intan_dc_put_bits(uint8_t * out, uint16_t bit_pos, uint16_t value, uint8_t num_bits) {
+
+    for (int i = num_bits - 1; i >= 0; i--, bit_pos++) {
+        if ((bit_pos & 7) == 0) {
+            out[bit_pos >> 3] = 0;
+        }
+        out[bit_pos >> 3] |= ((value >> i) & 1) << (7 - (bit_pos & 7));
+    }
+}
+
+// Pack the latest DC values of the channels in channel_mask as one tick
+static void intan_dc_add_tick(uint32_t frame_index, uint16_t channel_mask) {
+
+    uint16_t tick_bits = __builtin_popcount(channel_mask) * INTAN_DC_BITS;
+
+    if (intan_dc_priv.current_block &&
+        (intan_dc_priv.current_channel_mask != channel_mask ||
+         intan_dc_priv.bit_pos + tick_bits > 8 * sizeof(intan_dc_priv.current_block->dc_msg.data))) {
+        intan_dc_flush();
+    }
+
+    if (intan_dc_priv.current_block == NULL) {
+        intan_dc_priv.current_block = sample_pool_alloc();
+
+        if (intan_dc_priv.current_block == NULL) {
+            intan_dc_priv.stats.dropped++;
+            return;
+        }
+
+        sample_block_t * block = intan_dc_priv.current_block;
+        block->type = SAMPLE_BLOCK_DC;
+        block->dc_msg.header.first_index = frame_index;
+        block->dc_msg.header.channel_mask = channel_mask;
+        block->dc_msg.decimation = intan_dc_priv.decimation;
+        block->dc_msg.num_ticks = 0;
+        intan_dc_priv.current_channel_mask = channel_mask;
+        intan_dc_priv.bit_pos = 0;
+    }
+
+    sample_block_t * block = intan_dc_priv.current_block;
+
+    for (uint16_t channels = channel_mask; channels; channels &= channels - 1) {
+        uint8_t channel = __builtin_ctz(channels);
+        intan_dc_put_bits(block->dc_msg.data, intan_dc_priv.bit_pos, intan_dc_priv.latest[channel], INTAN_DC_BITS);
+        intan_dc_priv.bit_pos += INTAN_DC_BITS;
+    }
+
+    block->dc_msg.num_ticks++;
+    intan_dc_priv.stats.ticks++;
+}
+
+// Keep the DC values of frame, every decimation frames they go out as a tick
+void intan_dc_process_frame(const intan_frame_t * frame) {
+
+    // With a large decimation a packet takes long to fill, do not let its first tick wait for long
+    if (intan_dc_priv.current_block &&
+        frame->frame_index - intan_dc_priv.current_block->dc_msg.header.first_index >= INTAN_DC_FLUSH_FRAMES) {
+        intan_dc_flush();
+    }
+
+    // Channels that are not recorded have no DC value
+    uint16_t channel_mask = intan_dc_priv.channel_mask & frame->channel_mask;
+
+    if (channel_mask == 0) {
+        return;
+    }
+
+    for (int i = 0; i < frame->num_samples; i++) {
+        intan_dc_priv.latest[HOSTCOMM_SAMPLE_TAG_CHANNEL(frame->tags[i])] = frame->samples[i].dc_amp_data;
+    }
+
+    if (++intan_dc_priv.phase < intan_dc_priv.decimation) {
+        return;
+    }
+
+    intan_dc_priv.phase = 0;
+    intan_dc_add_tick(frame->frame_index, channel_mask);
+}
+
+// DC statistics, they restart after every log
+void intan_dc_log_stats(void) {
+
+    if (intan_dc_priv.stats.ticks == 0 && intan_dc_priv.stats.dropped == 0) {
+        return;
+    }
+
+    LOG_INF("DC: %d ticks in %d packets, %d dropped", intan_dc_priv.stats.ticks, intan_dc_priv.stats.packets,
+            intan_dc_priv.stats.dropped);
+
+    memset(&intan_dc_priv.stats, 0, sizeof(intan_dc_stats_t));
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdint.h>
+#include "config.h"
+#include "intan_helper.h"
+
+/*
+DC amplifier stream, for watching the electrode voltages during stimulation next to the AC samples.
+
+Every CONVERT also returns the 10 bit DC amplifier result. Every decimation frames (a tick), the latest DC value of
+every channel in the DC mask goes out. A channel of a slower rate class that was not converted since the last tick
+repeats its value. The values of a tick are in channel order, so they need no tags, and are bit-packed back to back
+over all ticks of the packet, 10 bits each, most significant bit first like the codec bit stream. 16 channels take
+20 bytes per tick, where their AC samples take 48 bytes per frame. A packet goes out when it is full, or at the latest
+INTAN_DC_FLUSH_FRAMES frames after its first tick, so slow decimations still reach the host in time.
+*/
+
+#define INTAN_DC_BITS  10
+
+typedef struct intan_dc_stats_t {
+    uint32_t ticks;
+    uint32_t packets;
+    uint32_t dropped;   // ticks lost because no sample block was free
+} intan_dc_stats_t;
+
+typedef struct intan_dc_priv_t {
+    uint16_t channel_mask;      // channels in the DC stream, 0 = off
+    uint8_t decimation;         // frames per tick
+    uint8_t phase;              // frames since the last tick
+
+    uint16_t latest[NUM_CHANNELS];
+
+    // DC packet being filled, NULL until the next tick
+    struct sample_block_t * current_block;
+    uint16_t current_channel_mask;
+    uint16_t bit_pos;
+
+    intan_dc_stats_t stats;
+} intan_dc_priv_t;
+
+void intan_dc_init(void);
+int intan_dc_configure(uint16_t channel_mask, uint8_t decimation);
+void intan_dc_process_frame(const intan_frame_t * frame);
+void intan_dc_flush(void);
+void intan_dc_log_stats(void);
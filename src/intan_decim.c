@@ -0,0 +1,190 @@
+/*
+This file contains the LFP decimator. Configuration and decimation both run in the Intan thread.
+*/
+
+#include <kernel.h>
+#include <logging/log.h>
+
+#if defined(__ARM_FEATURE_DSP)
+#include <arch/arm/aarch32/cortex_m/cmsis.h>
+#endif
+
+#include "intan_decim.h"
+#include "sample_pool.h"
+#include "sample_ring.h"
+
+#define LOG_MODULE_NAME       intan_decim_c
+LOG_MODULE_REGISTER(LOG_MODULE_NAME, LOG_LEVEL_INF);
+
+
+BUILD_ASSERT(INTAN_DECIM_MAX_TAPS % 2 == 0 && INTAN_DECIM_MAX_TAPS <= 128, "Taps are taken in pairs, counted in a byte");
+
+intan_decim_priv_t intan_decim_priv;
+
+void intan_decim_init(void) {
+
+    if (intan_decim_priv.current_block) {
+        sample_pool_unref(intan_decim_priv.current_block);
+    }
+
+    memset(&intan_decim_priv, 0, sizeof(intan_decim_priv_t));
+}
+
+// Load count taps starting at tap offset, the filter is uploaded in pieces. Takes effect with intan_decim_configure().
+int intan_decim_set_taps(uint8_t offset, const int16_t * taps, uint8_t count) {
+
+    if (offset + count > INTAN_DECIM_MAX_TAPS) {
+        return -EINVAL;
+    }
+
+    memcpy(&intan_decim_priv.uploaded_taps[offset], taps, count * sizeof(int16_t));
+
+    return 0;
+}
+
+// Start the LFP stream with one output every factor samples from the first num_taps taps, or stop it with factor 0
+int intan_decim_configure(uint8_t factor, uint8_t num_taps) {
+
+    // An odd filter gets a zero tap in front, so the taps can be taken in pairs
+    uint8_t padding = num_taps % 2;
+
+    if (factor && (num_taps == 0 || num_taps + padding > INTAN_DECIM_MAX_TAPS)) {
+        return -EINVAL;
+    }
+
+    intan_decim_flush();
+
+    intan_decim_priv.taps[0] = 0;
+    memcpy(&intan_decim_priv.taps[padding], intan_decim_priv.uploaded_taps, num_taps * sizeof(int16_t));
+    num_taps += padding;
+
+    intan_decim_priv.factor = factor;
+    intan_decim_priv.num_taps = num_taps;
+
+    memset(intan_decim_priv.history, 0, sizeof(intan_decim_priv.history));
+    memset(intan_decim_priv.history_pos, 0, sizeof(intan_decim_priv.history_pos));
+    memset(intan_decim_priv.phase, 0, sizeof(intan_decim_priv.phase));
+
+    return 0;
+}
+
+// Hand the LFP packet being filled to hostcomm
+void intan_decim_flush(void) {
+
+    sample_block_t * block = intan_decim_priv.current_block;
+
+    if (block == NULL) {
+        return;
+    }
+
+    intan_decim_priv.current_block = NULL;
+
+    if (sample_ring_put(block)) {
+        intan_decim_priv.stats.packets++;
+    }
+    else {
+        intan_decim_priv.stats.dropped += block->sample_count;
+        sample_pool_unref(block);
+    }
+}
+
+static void intan_decim_add_sample(uint8_t tag, int16_t y, uint16_t channel_mask) {
+
+    // Lost LFP samples keep their index too, like the raw ones
+    uint32_t sample_index = intan_decim_priv.sample_index++;
+
+    if (intan_decim_priv.current_block && intan_decim_priv.current_channel_mask != channel_mask) {
+        intan_decim_flush();
+    }
+
+    if (intan_decim_priv.current_block == NULL) {
+        intan_decim_priv.current_block = sample_pool_alloc();
+
+        if (intan_decim_priv.current_block == NULL) {
+            intan_decim_priv.stats.dropped++;
+            return;
+        }
+
+        sample_block_t * block = intan_decim_priv.current_block;
+        block->type = SAMPLE_BLOCK_LFP;
+        block->lfp_msg.header.first_index = sample_index;
+        block->lfp_msg.header.channel_mask = channel_mask;
+        block->lfp_msg.decimation = intan_decim_priv.factor;
+        intan_decim_priv.current_channel_mask = channel_mask;
+    }
+
+    sample_block_t * block = intan_decim_priv.current_block;
+    hostcomm_sample_t * sample = &block->lfp_msg.samples[block->sample_count++];
+    sample->tag = tag;
+    sample->ac_data = (int32_t) y + INTAN_AC_MID_SCALE;
+    intan_decim_priv.stats.samples++;
+
+    if (block->sample_count == HOSTCOMM_MAX_LFP_PER_TRANSMISSION) {
+        intan_decim_flush();
+    }
+}
+
+// Dot product of the taps with the window of the latest num_taps samples, oldest first
+static int16_t intan_decim_output(const int16_t * window) {
+
+    int64_t acc = 0;
+
+#if defined(__ARM_FEATURE_DSP)
+    const uint32_t * tap_pairs = (const uint32_t *) intan_decim_priv.taps;
+
+    for (int i = 0; i < intan_decim_priv.num_taps / 2; i++) {
+        // The window starts at any sample, so it may not be word aligned
+        uint32_t pair;
+        memcpy(&pair, &window[2 * i], sizeof(pair));
+        acc = __SMLALD(pair, tap_pairs[i], acc);
+    }
+#else
+    for (int i = 0; i < intan_decim_priv.num_taps; i++) {
+        acc += (int32_t) window[i] * intan_decim_priv.taps[i];
+    }
+#endif
+
+    return CLAMP(acc >> 15, INT16_MIN, INT16_MAX);
+}
+
+// Feed the samples of frame to the decimator, the LFP samples go into their own packets
+void intan_decim_process_frame(const intan_frame_t * frame) {
+
+    uint8_t num_taps = intan_decim_priv.num_taps;
+
+    if (intan_decim_priv.factor == 0) {
+        return;
+    }
+
+    for (int i = 0; i < frame->num_samples; i++) {
+        uint8_t channel = HOSTCOMM_SAMPLE_TAG_CHANNEL(frame->tags[i]);
+        int16_t * history = intan_decim_priv.history[channel];
+        uint8_t pos = intan_decim_priv.history_pos[channel];
+        int16_t x = (int32_t) frame->samples[i].ac_amp_data - INTAN_AC_MID_SCALE;
+
+        // Both copies, so history[pos + 1 .. pos + num_taps] are the latest num_taps samples in order
+        history[pos] = x;
+        history[pos + num_taps] = x;
+        intan_decim_priv.history_pos[channel] = (pos + 1) % num_taps;
+
+        if (++intan_decim_priv.phase[channel] < intan_decim_priv.factor) {
+            continue;
+        }
+        intan_decim_priv.phase[channel] = 0;
+
+        intan_decim_add_sample(frame->tags[i], intan_decim_output(&history[pos + 1]), frame->channel_mask);
+    }
+}
+
+// LFP statistics, they restart after every log
+void intan_decim_log_stats(void) {
+
+    if (intan_decim_priv.stats.samples == 0 && intan_decim_priv.stats.dropped == 0) {
+        return;
+    }
+
+    LOG_INF("LFP: %d samples in %d packets, %d dropped", intan_decim_priv.stats.samples,
+            intan_decim_priv.stats.packets, intan_decim_priv.stats.dropped);
+
+    memset(&intan_decim_priv.stats, 0, sizeof(intan_decim_stats_t));
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdint.h>
+#include "config.h"
+#include "intan_helper.h"
+
+/*
+Decimation of every recorded channel into an LFP stream, next to the raw stream of selected channels.
+
+Every channel runs its samples through a low-pass FIR (Q15 taps from the host) and keeps one output out of every
+factor inputs. Only the outputs that are kept are computed, which is what a polyphase decimator costs: per output one
+pass over the taps, instead of one per input. The delay line of a channel is stored twice in a row, so the window of
+the latest num_taps samples is always contiguous and the dot product takes the taps in pairs (__SMLALD on the M33).
+
+LFP samples are batched into their own packets (hostcomm_lfp_message_t), raw samples keep going out in the sample
+packets, but only for the channels in the raw mask (intan_priv.raw_channel_mask).
+*/
+
+typedef struct intan_decim_stats_t {
+    uint32_t samples;  // LFP samples produced
+    uint32_t packets;
+    uint32_t dropped;  // LFP samples lost because no sample block was free
+} intan_decim_stats_t;
+
+typedef struct intan_decim_priv_t {
+    uint8_t factor;    // 0 = LFP stream off
+    uint8_t num_taps;
+    int16_t taps[INTAN_DECIM_MAX_TAPS] __aligned(4); // oldest sample first, so the impulse response reversed
+    int16_t uploaded_taps[INTAN_DECIM_MAX_TAPS];     // from the host, in use after intan_decim_configure()
+
+    int16_t history[NUM_CHANNELS][2 * INTAN_DECIM_MAX_TAPS] __aligned(4);
+    uint8_t history_pos[NUM_CHANNELS];  // where the next sample goes, the window starts there
+    uint8_t phase[NUM_CHANNELS];        // samples since the last output
+
+    // LFP packet being filled, NULL until the next LFP sample
+    struct sample_block_t * current_block;
+    uint16_t current_channel_mask;
+    uint32_t sample_index;  // LFP samples so far, the index of the next one
+
+    intan_decim_stats_t stats;
+} intan_decim_priv_t;
+
+void intan_decim_init(void);
+int intan_decim_set_taps(uint8_t offset, const int16_t * taps, uint8_t count);
+int intan_decim_configure(uint8_t factor, uint8_t num_taps);
+void intan_decim_process_frame(const intan_frame_t * frame);
+void intan_decim_flush(void);
+void intan_decim_log_stats(void);
@@ -0,0 +1,181 @@
+/*
+This file contains the on-device decoder. Configuration and updates both run in the Intan thread.
+*/
+
+#include <kernel.h>
+#include <logging/log.h>
+
+#if defined(__ARM_FEATURE_DSP)
+#include <arch/arm/aarch32/cortex_m/cmsis.h>
+#endif
+
+#include "cpu_cycles.h"
+#include "intan_decoder.h"
+#include "sample_pool.h"
+#include "sample_ring.h"
+
+#define LOG_MODULE_NAME       intan_decoder_c
+LOG_MODULE_REGISTER(LOG_MODULE_NAME, LOG_LEVEL_INF);
+
+#define INTAN_DECODER_COEFF_SHIFT  14  // Q2.14 matrices
+
+intan_decoder_priv_t intan_decoder_priv;
+
+void intan_decoder_init(void) {
+    memset(&intan_decoder_priv, 0, sizeof(intan_decoder_priv_t));
+}
+
+// Load count values of a matrix row starting at column first_col, the matrices are uploaded in pieces
+int intan_decoder_set_matrix(uint8_t matrix, uint8_t row, uint8_t first_col, const int16_t * values, uint8_t count) {
+
+    int16_t * dest;
+    size_t num_cols;
+
+    if (row >= INTAN_DECODER_MAX_STATES) {
+        return -EINVAL;
+    }
+
+    switch (matrix) {
+        case INTAN_DECODER_MATRIX_GAIN:
+            dest = intan_decoder_priv.gain[row];
+            num_cols = INTAN_DECODER_MAX_INPUTS;
+            break;
+        case INTAN_DECODER_MATRIX_TRANSITION:
+            dest = intan_decoder_priv.transition[row];
+            num_cols = INTAN_DECODER_MAX_STATES;
+            break;
+        case INTAN_DECODER_MATRIX_BIAS:
+            if (row != 0) {
+                return -EINVAL;
+            }
+            dest = intan_decoder_priv.bias;
+            num_cols = INTAN_DECODER_MAX_STATES;
+            break;
+        default:
+            return -EINVAL;
+    }
+
+    if (first_col + count > num_cols) {
+        return -EINVAL;
+    }
+
+    memcpy(&dest[first_col], values, count * sizeof(int16_t));
+
+    return 0;
+}
+
+// Switch the decoder mode and size, the state starts over from 0
+int intan_decoder_configure(uint8_t mode, uint8_t num_states, uint8_t num_outputs) {
+
+    if (mode > INTAN_DECODER_KALMAN || num_states > INTAN_DECODER_MAX_STATES || num_outputs > num_states ||
+        (mode != INTAN_DECODER_OFF && num_states == 0)) {
+        return -EINVAL;
+    }
+
+    intan_decoder_priv.mode = mode;
+    intan_decoder_priv.num_states = num_states;
+    intan_decoder_priv.num_outputs = num_outputs;
+    memset(intan_decoder_priv.state, 0, sizeof(intan_decoder_priv.state));
+
+    return 0;
+}
+
+bool intan_decoder_enabled(void) {
+    return intan_decoder_priv.mode != INTAN_DECODER_OFF;
+}
+
+// a[0..n) . b[0..n) with 16 bit values, n even and both 4 byte aligned
+static int64_t intan_decoder_dot(const int16_t * a, const int16_t * b, size_t n) {
+
+    int64_t acc = 0;
+
+#if defined(__ARM_FEATURE_DSP)
+    const uint32_t * a_pairs = (const uint32_t *) a;
+    const uint32_t * b_pairs = (const uint32_t *) b;
+
+    for (size_t i = 0; i < n / 2; i++) {
+        acc = __SMLALD(a_pairs[i], b_pairs[i], acc);
+    }
+#else
+    for (size_t i = 0; i < n; i++) {
+        acc += (int32_t) a[i] * b[i];
+    }
+#endif
+
+    return acc;
+}
+
+static void intan_decoder_send(const intan_frame_t * frame, uint16_t latency_us) {
+
+    sample_block_t * block = sample_pool_alloc();
+
+    if (block == NULL) {
+        intan_decoder_priv.stats.dropped++;
+        return;
+    }
+
+    block->type = SAMPLE_BLOCK_CONTROL;
+    block->sample_count = intan_decoder_priv.num_outputs;
+    block->control_msg.header.first_index = frame->frame_index;
+    block->control_msg.latency_us = latency_us;
+    memcpy(block->control_msg.outputs, intan_decoder_priv.state, intan_decoder_priv.num_outputs * sizeof(int16_t));
+
+    if (!sample_ring_put_urgent(block)) {
+        intan_decoder_priv.stats.dropped++;
+        sample_pool_unref(block);
+    }
+}
+
+// Update the state with the latest features (intan_feature_latest()), frame is the one that completed them
+void intan_decoder_update(const int16_t * features, const intan_frame_t * frame) {
+
+    if (intan_decoder_priv.mode == INTAN_DECODER_OFF) {
+        return;
+    }
+
+    uint32_t start_cycles = cpu_cycles_get();
+    int16_t next[INTAN_DECODER_MAX_STATES];
+
+    for (int row = 0; row < intan_decoder_priv.num_states; row++) {
+        int64_t acc = intan_decoder_dot(intan_decoder_priv.gain[row], features, INTAN_DECODER_MAX_INPUTS);
+
+        if (intan_decoder_priv.mode == INTAN_DECODER_KALMAN) {
+            acc += intan_decoder_dot(intan_decoder_priv.transition[row], intan_decoder_priv.state,
+                                     INTAN_DECODER_MAX_STATES);
+        }
+
+        next[row] = CLAMP((acc >> INTAN_DECODER_COEFF_SHIFT) + intan_decoder_priv.bias[row], INT16_MIN, INT16_MAX);
+    }
+
+    // States past num_states stay 0, so their columns of the transition matrix never count
+    memcpy(intan_decoder_priv.state, next, intan_decoder_priv.num_states * sizeof(int16_t));
+
+    uint32_t end_cycles = cpu_cycles_get();
+    uint32_t decode_cycles = end_cycles - start_cycles;
+    uint32_t latency_us = cpu_cycles_to_us(end_cycles - frame->done_cycles);
+
+    intan_decoder_send(frame, MIN(latency_us, UINT16_MAX));
+
+    intan_decoder_priv.stats.updates++;
+    intan_decoder_priv.stats.decode_cycles += decode_cycles;
+    intan_decoder_priv.stats.decode_cycles_max = MAX(intan_decoder_priv.stats.decode_cycles_max, decode_cycles);
+    intan_decoder_priv.stats.latency_us_sum += latency_us;
+    intan_decoder_priv.stats.latency_us_max = MAX(intan_decoder_priv.stats.latency_us_max, latency_us);
+}
+
+// Decoder statistics, they restart after every log. The latency from the first sample adds up to one frame period.
+void intan_decoder_log_stats(uint32_t frame_period_ns) {
+
+    intan_decoder_stats_t * stats = &intan_decoder_priv.stats;
+
+    if (stats->updates == 0) {
+        return;
+    }
+
+    LOG_INF("Decoder: %d updates, %d dropped, decode avg %d max %d cycles", stats->updates, stats->dropped,
+            stats->decode_cycles / stats->updates, stats->decode_cycles_max);
+    LOG_INF("Decoder latency from sample to output: avg %d max %d us", stats->latency_us_sum / stats->updates +
+            frame_period_ns / 1000, stats->latency_us_max + frame_period_ns / 1000);
+
+    memset(stats, 0, sizeof(intan_decoder_stats_t));
+}
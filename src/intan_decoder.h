@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "config.h"
+#include "intan_helper.h"
+
+/*
+On-device decoder from band power features (intan_feature.h) to a small control vector, so an actuator does not have
+to wait for the features to make a round trip through the host.
+
+The decoder keeps a state vector s of num_states values and updates it whenever a channel has new features z:
+
+    s = (F * s + G * z) >> 14 + bias
+
+F and G are Q2.14 matrices from the host, z is the latest log2 power of every channel and band (Q8.8, index
+channel * INTAN_FEATURE_MAX_BANDS + band) and s is in whatever scale the host trained for. In LINEAR mode F is
+skipped, which is a plain linear decoder. In KALMAN mode this is a steady-state Kalman filter: with state transition
+A, observation matrix H and steady-state gain K, the host uploads F = (I - K * H) * A and G = K, and folds the feature
+means into bias.
+
+The first num_outputs values of the state go out after every update, in a control packet that goes ahead of the
+queued sample blocks.
+*/
+
+#define INTAN_DECODER_MAX_INPUTS  (NUM_CHANNELS * INTAN_FEATURE_MAX_BANDS)
+
+typedef enum intan_decoder_mode_t {
+    INTAN_DECODER_OFF = 0,
+    INTAN_DECODER_LINEAR,
+    INTAN_DECODER_KALMAN,
+} intan_decoder_mode_t;
+
+typedef enum intan_decoder_matrix_t {
+    INTAN_DECODER_MATRIX_GAIN = 0,    // G, [state][input]
+    INTAN_DECODER_MATRIX_TRANSITION,  // F, [state][state]
+    INTAN_DECODER_MATRIX_BIAS,        // bias, a single row of num_states
+} intan_decoder_matrix_t;
+
+typedef struct intan_decoder_stats_t {
+    uint32_t updates;
+    uint32_t dropped;             // control packets lost because no sample block or urgent ring slot was free
+    uint32_t decode_cycles;       // summed over updates
+    uint32_t decode_cycles_max;
+    uint32_t latency_us_sum;      // end of the frame that completed the features to the control packet being queued
+    uint32_t latency_us_max;
+} intan_decoder_stats_t;
+
+typedef struct intan_decoder_priv_t {
+    uint8_t mode;                 // intan_decoder_mode_t
+    uint8_t num_states;
+    uint8_t num_outputs;
+
+    int16_t gain[INTAN_DECODER_MAX_STATES][INTAN_DECODER_MAX_INPUTS] __aligned(4);
+    int16_t transition[INTAN_DECODER_MAX_STATES][INTAN_DECODER_MAX_STATES] __aligned(4);
+    int16_t bias[INTAN_DECODER_MAX_STATES];
+
+    int16_t state[INTAN_DECODER_MAX_STATES] __aligned(4);
+
+    intan_decoder_stats_t stats;
+} intan_decoder_priv_t;
+
+BUILD_ASSERT(INTAN_DECODER_MAX_STATES % 2 == 0, "Decoder state is read in pairs");
+
+void intan_decoder_init(void);
+int intan_decoder_set_matrix(uint8_t matrix, uint8_t row, uint8_t first_col, const int16_t * values, uint8_t count);
+int intan_decoder_configure(uint8_t mode, uint8_t num_states, uint8_t num_outputs);
+bool intan_decoder_enabled(void);
+void intan_decoder_update(const int16_t * features, const intan_frame_t * frame);
+void intan_decoder_log_stats(uint32_t frame_period_ns);
@@ -0,0 +1,284 @@
+/*
+This file contains the band power features. Configuration and processing both run in the Intan thread.
+*/
+
+#include <kernel.h>
+#include <logging/log.h>
+
+#include "intan_feature.h"
+#include "sample_pool.h"
+#include "sample_ring.h"
+
+#define LOG_MODULE_NAME       intan_feature_c
+LOG_MODULE_REGISTER(LOG_MODULE_NAME, LOG_LEVEL_INF);
+
+#define INTAN_FEATURE_COEFF_SHIFT   14  // Q2.14 coefficients
+
+// A squared sample is at most 2^30 before the shift, so a hop of up to 2^(1 + shift) samples sums to at most 2^31
+#define INTAN_FEATURE_MAX_HOP_SAMPLES  (1 << (1 + INTAN_FEATURE_POWER_SHIFT))
+
+BUILD_ASSERT(INTAN_FEATURE_MAX_BANDS <= 8, "Bands in use are kept in an 8 bit mask");
+
+intan_feature_priv_t intan_feature_priv;
+
+// Clear filter state and power sums, the next window starts from scratch
+static void intan_feature_reset(void) {
+
+    memset(intan_feature_priv.x1, 0, sizeof(intan_feature_priv.x1));
+    memset(intan_feature_priv.x2, 0, sizeof(intan_feature_priv.x2));
+    memset(intan_feature_priv.y1, 0, sizeof(intan_feature_priv.y1));
+    memset(intan_feature_priv.y2, 0, sizeof(intan_feature_priv.y2));
+    memset(intan_feature_priv.hop_power, 0, sizeof(intan_feature_priv.hop_power));
+    memset(intan_feature_priv.window_power, 0, sizeof(intan_feature_priv.window_power));
+    memset(intan_feature_priv.hop_count, 0, sizeof(intan_feature_priv.hop_count));
+    memset(intan_feature_priv.hop_index, 0, sizeof(intan_feature_priv.hop_index));
+    memset(intan_feature_priv.hops_seen, 0, sizeof(intan_feature_priv.hops_seen));
+    memset(intan_feature_priv.latest, 0, sizeof(intan_feature_priv.latest));
+}
+
+void intan_feature_init(void) {
+
+    if (intan_feature_priv.current_block) {
+        sample_pool_unref(intan_feature_priv.current_block);
+    }
+
+    memset(&intan_feature_priv, 0, sizeof(intan_feature_priv_t));
+}
+
+// Load the band-pass section of band, coeffs are b0, b1, b2, a1, a2 in Q2.14, or take the band out of use
+int intan_feature_set_band(uint8_t band, bool enable, const int16_t * coeffs) {
+
+    if (band >= INTAN_FEATURE_MAX_BANDS) {
+        return -EINVAL;
+    }
+
+    intan_feature_flush();
+
+    if (enable) {
+        intan_feature_priv.b0[band] = coeffs[0];
+        intan_feature_priv.b1[band] = coeffs[1];
+        intan_feature_priv.b2[band] = coeffs[2];
+        intan_feature_priv.a1[band] = coeffs[3];
+        intan_feature_priv.a2[band] = coeffs[4];
+        intan_feature_priv.band_mask |= (1 << band);
+    }
+    else {
+        intan_feature_priv.band_mask &= ~(1 << band);
+    }
+
+    // Records always hold the bands up to the highest one in use, the host knows which ones it enabled
+    intan_feature_priv.num_bands = intan_feature_priv.band_mask ? 32 - __builtin_clz(intan_feature_priv.band_mask) : 0;
+
+    intan_feature_reset();
+
+    return 0;
+}
+
+// Windows of hops_per_window hops of hop_samples samples each, a feature record goes out after every hop
+int intan_feature_set_window(uint16_t hop_samples, uint8_t hops_per_window) {
+
+    if (hop_samples == 0 || hop_samples > INTAN_FEATURE_MAX_HOP_SAMPLES || hops_per_window == 0 ||
+        hops_per_window > INTAN_FEATURE_MAX_HOPS) {
+        return -EINVAL;
+    }
+
+    intan_feature_flush();
+
+    intan_feature_priv.hop_samples = hop_samples;
+    intan_feature_priv.hops_per_window = hops_per_window;
+
+    intan_feature_reset();
+
+    return 0;
+}
+
+// Hand the feature packet being filled to hostcomm
+void intan_feature_flush(void) {
+
+    sample_block_t * block = intan_feature_priv.current_block;
+
+    if (block == NULL) {
+        return;
+    }
+
+    intan_feature_priv.current_block = NULL;
+
+    if (sample_ring_put(block)) {
+        intan_feature_priv.stats.packets++;
+    }
+    else {
+        intan_feature_priv.stats.dropped += block->feature_msg.num_records;
+        sample_pool_unref(block);
+    }
+}
+
+// log2(power) in Q8.8, 0 for no power
+static uint16_t intan_feature_log2(uint64_t power) {
+
+    if (power == 0) {
+        return 0;
+    }
+
+    uint8_t integer = 63 - __builtin_clzll(power);
+
+    // The 8 bits below the leading one, as the fraction
+    uint8_t fraction = (integer >= 8) ? (power >> (integer - 8)) & 0xFF : (power << (8 - integer)) & 0xFF;
+
+    return (integer << 8) | fraction;
+}
+
+// Mean power over the window of every band of channel, into latest
+static void intan_feature_update_latest(uint8_t channel) {
+
+    uint32_t window_samples = intan_feature_priv.hop_samples * intan_feature_priv.hops_per_window;
+    int16_t * latest = &intan_feature_priv.latest[channel * INTAN_FEATURE_MAX_BANDS];
+
+    for (int band = 0; band < intan_feature_priv.num_bands; band++) {
+        latest[band] = intan_feature_log2(intan_feature_priv.window_power[band][channel] / window_samples);
+    }
+}
+
+static void intan_feature_add_record(uint8_t tag, uint32_t frame_index) {
+
+    uint8_t channel = HOSTCOMM_SAMPLE_TAG_CHANNEL(tag);
+    size_t record_size = 1 + intan_feature_priv.num_bands * sizeof(uint16_t);
+
+    if (intan_feature_priv.current_block &&
+        intan_feature_priv.current_block->sample_count + record_size > sizeof(intan_feature_priv.current_block->feature_msg.data)) {
+        intan_feature_flush();
+    }
+
+    if (intan_feature_priv.current_block == NULL) {
+        intan_feature_priv.current_block = sample_pool_alloc();
+
+        if (intan_feature_priv.current_block == NULL) {
+            intan_feature_priv.stats.dropped++;
+            return;
+        }
+
+        sample_block_t * block = intan_feature_priv.current_block;
+        block->type = SAMPLE_BLOCK_FEATURES;
+        block->feature_msg.header.first_index = frame_index;
+        block->feature_msg.num_bands = intan_feature_priv.num_bands;
+        block->feature_msg.num_records = 0;
+    }
+
+    sample_block_t * block = intan_feature_priv.current_block;
+    uint8_t * record = &block->feature_msg.data[block->sample_count];
+    const int16_t * latest = &intan_feature_priv.latest[channel * INTAN_FEATURE_MAX_BANDS];
+
+    record[0] = tag;
+    for (int band = 0; band < intan_feature_priv.num_bands; band++) {
+        // Little endian, like everything else that goes to the host
+        record[1 + band * 2] = latest[band] & 0xFF;
+        record[2 + band * 2] = latest[band] >> 8;
+    }
+
+    block->sample_count += record_size;
+    block->feature_msg.num_records++;
+    intan_feature_priv.stats.records++;
+}
+
+// Band-pass section of band for one sample of channel
+static int16_t intan_feature_band_pass(uint8_t band, uint8_t channel, int16_t x) {
+
+    // Every product fits in 32 bits, their sum does not
+    int64_t acc = (int32_t) intan_feature_priv.b0[band] * x;
+    acc += (int32_t) intan_feature_priv.b1[band] * intan_feature_priv.x1[band][channel];
+    acc += (int32_t) intan_feature_priv.b2[band] * intan_feature_priv.x2[band][channel];
+    acc -= (int32_t) intan_feature_priv.a1[band] * intan_feature_priv.y1[band][channel];
+    acc -= (int32_t) intan_feature_priv.a2[band] * intan_feature_priv.y2[band][channel];
+
+    int16_t y = CLAMP(acc >> INTAN_FEATURE_COEFF_SHIFT, INT16_MIN, INT16_MAX);
+
+    intan_feature_priv.x2[band][channel] = intan_feature_priv.x1[band][channel];
+    intan_feature_priv.x1[band][channel] = x;
+    intan_feature_priv.y2[band][channel] = intan_feature_priv.y1[band][channel];
+    intan_feature_priv.y1[band][channel] = y;
+
+    return y;
+}
+
+/*
+Run the samples of frame through the bands. Channels whose hop ends update their latest features, and with stream set
+their feature records go to the host. Returns how many channels have new features.
+*/
+int intan_feature_process_frame(const intan_frame_t * frame, bool stream) {
+
+    int updated = 0;
+
+    if (intan_feature_priv.band_mask == 0 || intan_feature_priv.hop_samples == 0) {
+        return 0;
+    }
+
+    for (int i = 0; i < frame->num_samples; i++) {
+        uint8_t channel = HOSTCOMM_SAMPLE_TAG_CHANNEL(frame->tags[i]);
+        uint8_t hop = intan_feature_priv.hop_index[channel];
+        int16_t x = (int32_t) frame->samples[i].ac_amp_data - INTAN_AC_MID_SCALE;
+
+        for (uint8_t bands = intan_feature_priv.band_mask; bands; bands &= bands - 1) {
+            uint8_t band = __builtin_ctz(bands);
+            int32_t y = intan_feature_band_pass(band, channel, x);
+
+            intan_feature_priv.hop_power[band][channel][hop] += (uint32_t) (y * y) >> INTAN_FEATURE_POWER_SHIFT;
+        }
+
+        if (++intan_feature_priv.hop_count[channel] < intan_feature_priv.hop_samples) {
+            continue;
+        }
+
+        // End of the hop, it joins the window
+        uint8_t next = (hop + 1) % intan_feature_priv.hops_per_window;
+
+        for (uint8_t bands = intan_feature_priv.band_mask; bands; bands &= bands - 1) {
+            uint8_t band = __builtin_ctz(bands);
+            intan_feature_priv.window_power[band][channel] += intan_feature_priv.hop_power[band][channel][hop];
+        }
+
+        intan_feature_priv.hop_count[channel] = 0;
+        intan_feature_priv.hop_index[channel] = next;
+
+        if (intan_feature_priv.hops_seen[channel] < intan_feature_priv.hops_per_window) {
+            intan_feature_priv.hops_seen[channel]++;
+        }
+
+        if (intan_feature_priv.hops_seen[channel] == intan_feature_priv.hops_per_window) {
+            intan_feature_update_latest(channel);
+            updated++;
+
+            if (stream) {
+                intan_feature_add_record(frame->tags[i], frame->frame_index);
+            }
+        }
+
+        // The next hop takes the slot of the oldest hop, which leaves the window (slots not used yet hold 0)
+        for (uint8_t bands = intan_feature_priv.band_mask; bands; bands &= bands - 1) {
+            uint8_t band = __builtin_ctz(bands);
+            intan_feature_priv.window_power[band][channel] -= intan_feature_priv.hop_power[band][channel][next];
+            intan_feature_priv.hop_power[band][channel][next] = 0;
+        }
+    }
+
+    // Decoders want the features right away, whatever ended in this frame goes out now
+    intan_feature_flush();
+
+    return updated;
+}
+
+// Latest features of every channel, see intan_feature_priv_t.latest
+const int16_t * intan_feature_latest(void) {
+    return intan_feature_priv.latest;
+}
+
+// Feature statistics, they restart after every log
+void intan_feature_log_stats(void) {
+
+    if (intan_feature_priv.stats.records == 0 && intan_feature_priv.stats.dropped == 0) {
+        return;
+    }
+
+    LOG_INF("Features: %d records in %d packets, %d dropped", intan_feature_priv.stats.records,
+            intan_feature_priv.stats.packets, intan_feature_priv.stats.dropped);
+
+    memset(&intan_feature_priv.stats, 0, sizeof(intan_feature_stats_t));
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "config.h"
+#include "intan_helper.h"
+
+/*
+Band power features, for decoders that only need the power of a few bands (theta, beta, gamma, ...) and not the
+samples.
+
+Every band is a band-pass biquad (Q2.14 coefficients from the host, direct form I like the filter bank) run on every
+channel. The squared output is summed per hop of hop_samples samples, and the window is the last hops_per_window hops,
+so the window slides by one hop at a time for the cost of one addition and one subtraction. At the end of every hop a
+channel's feature record goes out: the mean power of each band over the window, as log2 in Q8.8 (fraction linearly
+interpolated), which keeps the whole dynamic range of the power in 16 bits.
+
+The latest record of every channel is also kept for the on-device decoder (intan_decoder.h), which runs on the
+features whether they are streamed or not.
+*/
+
+typedef struct intan_feature_stats_t {
+    uint32_t records;
+    uint32_t packets;
+    uint32_t dropped;  // records lost because no sample block was free
+} intan_feature_stats_t;
+
+typedef struct intan_feature_priv_t {
+    uint8_t band_mask;            // bands in use
+    uint8_t num_bands;            // highest band in use + 1, bands in a record
+    uint16_t hop_samples;
+    uint8_t hops_per_window;
+
+    // Band-pass sections, coefficients shared by all channels, state per channel
+    int16_t b0[INTAN_FEATURE_MAX_BANDS];
+    int16_t b1[INTAN_FEATURE_MAX_BANDS];
+    int16_t b2[INTAN_FEATURE_MAX_BANDS];
+    int16_t a1[INTAN_FEATURE_MAX_BANDS];
+    int16_t a2[INTAN_FEATURE_MAX_BANDS];
+    int16_t x1[INTAN_FEATURE_MAX_BANDS][NUM_CHANNELS];
+    int16_t x2[INTAN_FEATURE_MAX_BANDS][NUM_CHANNELS];
+    int16_t y1[INTAN_FEATURE_MAX_BANDS][NUM_CHANNELS];
+    int16_t y2[INTAN_FEATURE_MAX_BANDS][NUM_CHANNELS];
+
+    // Power, (y * y) >> INTAN_FEATURE_POWER_SHIFT summed per hop, and over the window
+    uint32_t hop_power[INTAN_FEATURE_MAX_BANDS][NUM_CHANNELS][INTAN_FEATURE_MAX_HOPS];
+    uint64_t window_power[INTAN_FEATURE_MAX_BANDS][NUM_CHANNELS];
+    uint16_t hop_count[NUM_CHANNELS];   // samples of the current hop
+    uint8_t hop_index[NUM_CHANNELS];    // hop_power slot of the current hop
+    uint8_t hops_seen[NUM_CHANNELS];    // until the first window is full
+
+    // Latest log2 power of every channel and band, [channel * INTAN_FEATURE_MAX_BANDS + band]
+    int16_t latest[NUM_CHANNELS * INTAN_FEATURE_MAX_BANDS] __aligned(4);
+
+    // Feature packet being filled, NULL until the next record
+    struct sample_block_t * current_block;
+
+    intan_feature_stats_t stats;
+} intan_feature_priv_t;
+
+void intan_feature_init(void);
+int intan_feature_set_band(uint8_t band, bool enable, const int16_t * coeffs);
+int intan_feature_set_window(uint16_t hop_samples, uint8_t hops_per_window);
+int intan_feature_process_frame(const intan_frame_t * frame, bool stream);
+const int16_t * intan_feature_latest(void);
+void intan_feature_flush(void);
+void intan_feature_log_stats(void);
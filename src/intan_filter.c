@@ -0,0 +1,151 @@
+/*
+This file contains the per-channel IIR filter bank. Configuration and filtering both run in the Intan thread.
+*/
+
+#include <kernel.h>
+#include <logging/log.h>
+
+#if defined(__ARM_FEATURE_DSP)
+#include <arch/arm/aarch32/cortex_m/cmsis.h>
+#endif
+
+#include "cpu_cycles.h"
+#include "hostcomm.h"
+#include "intan_filter.h"
+
+#define LOG_MODULE_NAME       intan_filter_c
+LOG_MODULE_REGISTER(LOG_MODULE_NAME, LOG_LEVEL_INF);
+
+#define INTAN_FILTER_COEFF_SHIFT  14  // Q2.14 coefficients
+
+BUILD_ASSERT(INTAN_FILTER_NUM_STAGES <= 8, "Filter stages are numbered in a byte");
+
+intan_filter_priv_t intan_filter_priv;
+
+static uint32_t intan_filter_pack(int16_t low, int16_t high) {
+    return (uint16_t) low | ((uint32_t) (uint16_t) high << 16);
+}
+
+void intan_filter_init(void) {
+    memset(&intan_filter_priv, 0, sizeof(intan_filter_priv_t));
+}
+
+// Load coeffs into stage of the channels in channel_mask and clear their delay lines, or take the stage out of use
+int intan_filter_set_stage(uint16_t channel_mask, uint8_t stage, bool enable, const intan_filter_coeffs_t * coeffs) {
+
+    if (stage >= INTAN_FILTER_NUM_STAGES) {
+        return -EINVAL;
+    }
+
+    // The feedback coefficients are stored negated, -2.0 would not fit (and is not stable anyway)
+    if (enable && (coeffs->a1 == INT16_MIN || coeffs->a2 == INT16_MIN)) {
+        return -EINVAL;
+    }
+
+    for (int channel = 0; channel < NUM_CHANNELS; channel++) {
+        if (!(channel_mask & (1 << channel))) {
+            continue;
+        }
+
+        if (enable) {
+            intan_filter_priv.b0[stage][channel] = coeffs->b0;
+            intan_filter_priv.b12[stage][channel] = intan_filter_pack(coeffs->b1, coeffs->b2);
+            intan_filter_priv.a12[stage][channel] = intan_filter_pack(-coeffs->a1, -coeffs->a2);
+        }
+        intan_filter_priv.x12[stage][channel] = 0;
+        intan_filter_priv.y12[stage][channel] = 0;
+    }
+
+    if (enable) {
+        intan_filter_priv.stage_mask[stage] |= channel_mask;
+    }
+    else {
+        intan_filter_priv.stage_mask[stage] &= ~channel_mask;
+    }
+
+    intan_filter_priv.channel_mask = 0;
+    for (int i = 0; i < INTAN_FILTER_NUM_STAGES; i++) {
+        intan_filter_priv.channel_mask |= intan_filter_priv.stage_mask[i];
+    }
+
+    return 0;
+}
+
+// One biquad section of one channel
+static inline int16_t intan_filter_biquad(uint8_t stage, uint8_t channel, int16_t x) {
+
+    uint32_t * x12 = &intan_filter_priv.x12[stage][channel];
+    uint32_t * y12 = &intan_filter_priv.y12[stage][channel];
+
+#if defined(__ARM_FEATURE_DSP)
+    int64_t acc = (int32_t) x * intan_filter_priv.b0[stage][channel];
+    acc = __SMLALD(*x12, intan_filter_priv.b12[stage][channel], acc);
+    acc = __SMLALD(*y12, intan_filter_priv.a12[stage][channel], acc);
+
+    int16_t y = __SSAT((int32_t) (acc >> INTAN_FILTER_COEFF_SHIFT), 16);
+
+    // New x[n-1] in the low half, the old one moves up to x[n-2]
+    *x12 = __PKHBT((uint16_t) x, *x12, 16);
+    *y12 = __PKHBT((uint16_t) y, *y12, 16);
+#else
+    uint32_t b12 = intan_filter_priv.b12[stage][channel];
+    uint32_t a12 = intan_filter_priv.a12[stage][channel];
+
+    int64_t acc = (int32_t) x * intan_filter_priv.b0[stage][channel];
+    acc += (int32_t) (int16_t) *x12 * (int16_t) b12 + (int32_t) (int16_t) (*x12 >> 16) * (int16_t) (b12 >> 16);
+    acc += (int32_t) (int16_t) *y12 * (int16_t) a12 + (int32_t) (int16_t) (*y12 >> 16) * (int16_t) (a12 >> 16);
+
+    int16_t y = CLAMP(acc >> INTAN_FILTER_COEFF_SHIFT, INT16_MIN, INT16_MAX);
+
+    *x12 = intan_filter_pack(x, *x12);
+    *y12 = intan_filter_pack(y, *y12);
+#endif
+
+    return y;
+}
+
+// Filter the samples of frame in place, channels without stages pass through unchanged
+void intan_filter_process_frame(intan_frame_t * frame) {
+
+    if (intan_filter_priv.channel_mask == 0) {
+        return;
+    }
+
+    uint32_t start_cycles = cpu_cycles_get();
+
+    for (int i = 0; i < frame->num_samples; i++) {
+        uint8_t channel = HOSTCOMM_SAMPLE_TAG_CHANNEL(frame->tags[i]);
+        uint16_t bit = 1 << channel;
+
+        if (!(intan_filter_priv.channel_mask & bit)) {
+            continue;
+        }
+
+        int16_t x = (int32_t) frame->samples[i].ac_amp_data - INTAN_AC_MID_SCALE;
+
+        for (int stage = 0; stage < INTAN_FILTER_NUM_STAGES; stage++) {
+            if (intan_filter_priv.stage_mask[stage] & bit) {
+                x = intan_filter_biquad(stage, channel, x);
+            }
+        }
+
+        frame->samples[i].ac_amp_data = (int32_t) x + INTAN_AC_MID_SCALE;
+        intan_filter_priv.stats.samples++;
+    }
+
+    intan_filter_priv.stats.frames++;
+    intan_filter_priv.stats.cycles += cpu_cycles_get() - start_cycles;
+}
+
+// Cost of the filter bank, statistics restart after every log
+void intan_filter_log_stats(void) {
+
+    if (intan_filter_priv.stats.frames == 0) {
+        return;
+    }
+
+    LOG_INF("Filter bank: %d samples in %d frames, %d cycles per frame", intan_filter_priv.stats.samples,
+            intan_filter_priv.stats.frames, intan_filter_priv.stats.cycles / intan_filter_priv.stats.frames);
+
+    memset(&intan_filter_priv.stats, 0, sizeof(intan_filter_stats_t));
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "config.h"
+#include "intan_helper.h"
+
+/*
+Per-channel IIR filter bank, a cascade of up to INTAN_FILTER_NUM_STAGES biquads run on every sample between decode
+and batching, e.g. a 50 or 60 Hz notch plus a band-pass made of a high-pass and a low-pass section. The host computes
+the coefficients, since the sample rate of a channel depends on its rate class.
+
+Samples are Q15 (AC data relative to mid scale). Coefficients are Q2.14, so the feedback coefficient of a narrow notch
+(close to -2) fits. Every section is direct form I:
+    y[n] = b0 x[n] + b1 x[n-1] + b2 x[n-2] - a1 y[n-1] - a2 y[n-2]
+summed in 64 bits and saturated back to 16 bits.
+
+Coefficients and state are kept as structures of arrays, [stage][channel], with pairs of taps packed into one word
+(low half the newer one). On the Cortex-M33 each pair then takes one dual multiply accumulate (__SMLALD), and the
+delay line moves on with one halfword pack (__PKHBT).
+*/
+
+typedef struct intan_filter_coeffs_t {
+    int16_t b0, b1, b2;
+    int16_t a1, a2;
+} intan_filter_coeffs_t;
+
+typedef struct intan_filter_stats_t {
+    uint32_t frames;
+    uint32_t samples;
+    uint32_t cycles;
+} intan_filter_stats_t;
+
+typedef struct intan_filter_priv_t {
+    uint16_t stage_mask[INTAN_FILTER_NUM_STAGES];   // channels that run each stage
+    uint16_t channel_mask;                          // channels that run any stage
+
+    int16_t b0[INTAN_FILTER_NUM_STAGES][NUM_CHANNELS];
+    uint32_t b12[INTAN_FILTER_NUM_STAGES][NUM_CHANNELS];  // b1 | b2 << 16
+    uint32_t a12[INTAN_FILTER_NUM_STAGES][NUM_CHANNELS];  // -a1 | -a2 << 16
+
+    uint32_t x12[INTAN_FILTER_NUM_STAGES][NUM_CHANNELS];  // x[n-1] | x[n-2] << 16
+    uint32_t y12[INTAN_FILTER_NUM_STAGES][NUM_CHANNELS];  // y[n-1] | y[n-2] << 16
+
+    intan_filter_stats_t stats;
+} intan_filter_priv_t;
+
+void intan_filter_init(void);
+int intan_filter_set_stage(uint16_t channel_mask, uint8_t stage, bool enable, const intan_filter_coeffs_t * coeffs);
+void intan_filter_process_frame(intan_frame_t * frame);
+void intan_filter_log_stats(void);
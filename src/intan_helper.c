@@ -17,16 +17,25 @@ LOG_MODULE_REGISTER(LOG_MODULE_NAME, LOG_LEVEL_INF);
 
 extern intan_priv_t intan_priv;
 
+// Convert the 32bit command into a 4 byte array as required by SPI driver
+// Note that nrf5340 is little endian, but we need to send most sig. byte 1st in SPI protocol for Intan
+void intan_encode_command(uint32_t command, uint8_t * buf) {
+    buf[0] = command >> 24;
+    buf[1] = command >> 16;
+    buf[2] = command >> 8;
+    buf[3] = command;
+}
+
+// Intan transmission gives most significant byte first.
+uint32_t intan_decode_response(const uint8_t * buf) {
+    return (uint32_t) (buf[0] << 24 | buf[1] << 16 | buf[2] << 8 | buf[3]);
+}
+
 int intan_send_spi_command(uint32_t command) {
 
     int err = 0;
 
-    // First we convert the 32bit command into a 4 byte array as required by SPI driver
-    // Note that nrf5340 is little endian, but we need to send most sig. byte 1st in SPI protocol for Intan
-    intan_priv.tx_buf[0] = command >> 24;
-    intan_priv.tx_buf[1] = command >> 16;
-    intan_priv.tx_buf[2] = command >> 8;
-    intan_priv.tx_buf[3] = command;
+    intan_encode_command(command, intan_priv.tx_buf);
 
     err = spi_send_receive(intan_priv.tx_buf, sizeof(intan_priv.tx_buf), intan_priv.rx_buf, sizeof(intan_priv.rx_buf));
 
@@ -38,12 +47,21 @@ int intan_send(uint32_t command) {
     return intan_send_spi_command(command);
 }
 
+// Place a command into a slot of the frame, already encoded in SPI byte order
+void intan_set_frame_command(size_t slot, uint32_t command) {
+    intan_priv.frame_commands[slot] = command;
+    intan_encode_command(command, &intan_priv.frame_tx_buf[slot * INTAN_SPI_WORD_SIZE]);
+}
 
-void intan_add_host_command(uint32_t command) {
-    intan_priv.host_commands[0] = command;
+// Arm the first num_commands commands of the frame for the next sample clock tick and return right away.
+// cb is called from interrupt context when the frame has finished, responses are then in frame_rx_buf.
+int intan_send_spi_frame_async(size_t num_commands, spi_frame_done_cb_t cb, void * user_data) {
+    return spi_frame_arm_async(intan_priv.frame_tx_buf, intan_priv.frame_rx_buf, INTAN_SPI_WORD_SIZE, num_commands,
+                               cb, user_data);
 }
 
 
+
 bool intan_check_write_response(uint32_t write_command, uint32_t resp) {
 
     // In the intan protocol, the write command as the write value in the bottom 2 bytes
@@ -1,12 +1,28 @@
 #pragma once
 #include <stdio.h>
 #include <stdint.h>
+#include <kernel.h>
+#include <sys/atomic.h>
+#include "config.h"
+#include "spi.h"
 
 /* High Level Spec */
 #define NUM_CHANNELS  16
 #define CHIP_ID       0x20
 
+/* SPI Frame Related */
+#define INTAN_SPI_WORD_SIZE       4  // Every Intan command and response is 32 bits
+#define INTAN_NUM_AUX_COMMANDS    4  // Most auxiliary command slots appended after the CONVERTs of each frame
+#define INTAN_FRAME_NUM_COMMANDS  (NUM_CHANNELS + INTAN_NUM_AUX_COMMANDS)
+
+// A result comes back 2 commands later. With a single aux slot the last CONVERT of a frame is answered in the next one.
+#define INTAN_FRAME_MAX_SAMPLES   (NUM_CHANNELS + 1)
+
+#include "intan_sequence.h"
+
 /* Data Formatting Related */
+#define INTAN_AC_MID_SCALE  0x8000  // AC amplifier result of a 0 V input, samples are offset binary around it
+
 typedef struct __attribute__ ((__packed__)) {
     unsigned dc_amp_data : 10;
     unsigned zeros : 6;
@@ -14,6 +30,59 @@ typedef struct __attribute__ ((__packed__)) {
 } intan_convert_channel_data_t;
 
 
+// Result of one frame, handed from completion context to the Intan thread
+typedef struct intan_frame_t {
+    uint32_t frame_index;
+    uint32_t done_cycles;  // cpu_cycles_get() when the frame had finished
+    uint16_t channel_mask; // channels converted in this frame
+    uint8_t num_samples;
+    intan_convert_channel_data_t samples[INTAN_FRAME_MAX_SAMPLES]; // in the order they were converted
+    uint8_t tags[INTAN_FRAME_MAX_SAMPLES]; // channel and rate class of each sample, see HOSTCOMM_SAMPLE_TAG
+    uint16_t history_pos[INTAN_FRAME_MAX_SAMPLES]; // sample number of each sample in intan_history.h, low 16 bits
+} intan_frame_t;
+
+// CPU cycles spent on acquisition, summed over frames until logged
+typedef struct intan_cpu_stats_t {
+    uint32_t frames;
+    uint32_t isr_cycles;
+    uint32_t thread_cycles;
+} intan_cpu_stats_t;
+
+// Sample blocks through the codec, summed until logged
+typedef struct intan_codec_stats_t {
+    uint32_t blocks;
+    uint32_t raw_bytes;
+    uint32_t coded_bytes;   // what actually went out, raw for blocks that did not get smaller
+    uint32_t uncompressed;  // blocks sent as they were
+} intan_codec_stats_t;
+
+// Called from completion context with the register value once the response to the READ has arrived.
+// err is -ECANCELED if acquisition stopped before that, value is then invalid.
+typedef void (*intan_read_cb_t)(int err, uint8_t reg, uint16_t value, void * ctx);
+
+typedef struct intan_read_request_t {
+    uint8_t reg;
+    intan_read_cb_t cb;
+    void * ctx;
+} intan_read_request_t;
+
+// Answer to a register read of the host, on its way from completion context to the Intan thread
+typedef struct intan_register_read_t {
+    uint32_t frame_index;
+    uint8_t reg;
+    int8_t err;
+    uint16_t value;
+} intan_register_read_t;
+
+// What goes to the host
+typedef enum intan_stream_mode_t {
+    INTAN_STREAM_SAMPLES = 0,  // every sample
+    INTAN_STREAM_SPIKES,       // detected spikes only
+    INTAN_STREAM_BOTH,         // every sample and detected spikes
+    INTAN_STREAM_FEATURES,     // band power features only
+    INTAN_STREAM_SAMPLES_DC,   // every sample, and the DC amplifier values of the DC channels (intan_dc.h)
+} intan_stream_mode_t;
+
 typedef struct intan_msg_t {
     uint32_t msg_id;
     uint8_t data[32]; // TODO: don't hardcode
@@ -23,7 +92,9 @@ typedef struct intan_msg_t {
 
 // Struct for storing Intan related private information
 typedef struct intan_priv_t {
-    uint32_t sample_delay_us; // This is configured by host application
+    // Time between two SPI commands. The frame period is this times the number of commands in the frame, so the
+    // SPI bandwidth stays the same and fewer recorded channels means a higher per-channel sample rate.
+    uint32_t word_period_ns;
 
     bool initialized;
 
@@ -33,6 +104,7 @@ typedef struct intan_priv_t {
     uint8_t rx_buf[4]; // rx_buf will store data coming from Intan Chip
     
     // Buffers to store sample data. These buffers are separate from rx_buf above, because not all SPI commands return INTAN chip samples
+    // Only the latest result of every channel, windows of recent samples are in intan_history.h
     intan_convert_channel_data_t  channel_data[NUM_CHANNELS];
 
     // Due to the nature of Intan chip responding 2 SPI transaction cycles later, we need to store our previous 2 commands
@@ -40,20 +112,63 @@ typedef struct intan_priv_t {
     uint32_t n_minus_one_command;
     uint32_t n_minus_two_command;
 
-    // Allocate room for commands from host
-    uint32_t host_commands[4]; // only support up to 4 host commands
+    // Sample tags and read requests travel through the same pipeline as their command. The tag is
+    // INTAN_SEQUENCE_NO_SAMPLE for anything but a recorded CONVERT, cb is NULL for anything but a requested READ.
+    uint8_t nth_tag;
+    uint8_t n_minus_one_tag;
+    uint8_t n_minus_two_tag;
+    intan_read_request_t nth_read;
+    intan_read_request_t n_minus_one_read;
+    intan_read_request_t n_minus_two_read;
+
+    // Commands for the aux slots wait in the aux scheduler (intan_aux.h). Only the slots of the armed frame live here.
+    uint8_t num_aux_slots;
+    intan_read_request_t frame_reads[INTAN_NUM_AUX_COMMANDS]; // reads in the aux slots of the armed frame
+
+    // Asynchronous acquisition state, owned by completion context while running
+    volatile bool acquisition_running;
+    uint32_t frame_index;
+    uint32_t dropped_frames; // frames lost because the Intan thread did not keep up
+    intan_cpu_stats_t cpu_stats;
 
-    int64_t last_stim_toggle_time_ms;
+    // Command sequence of the frames being sent. The thread compiles a new one into pending_sequence when the
+    // recording mask or the rate classes change, completion context switches over to it between two frames.
+    intan_rate_config_t rate_config;
+    intan_sequence_t sequence;
+    intan_sequence_t pending_sequence;
+    atomic_t sequence_pending;
+    uint8_t sequence_frame; // frame of the superframe that is armed or being sent
+
+    // A whole frame (CONVERTs + aux commands) goes out in a single SPI transaction. The CONVERT words only change
+    // with the sequence, so they are encoded once and only the aux slots are re-encoded every frame.
+    uint32_t frame_commands[INTAN_FRAME_NUM_COMMANDS];
+    uint8_t frame_tags[INTAN_FRAME_NUM_COMMANDS];
+    uint8_t frame_tx_buf[INTAN_FRAME_NUM_COMMANDS * INTAN_SPI_WORD_SIZE];
+    uint8_t frame_rx_buf[INTAN_FRAME_NUM_COMMANDS * INTAN_SPI_WORD_SIZE];
+
+    int64_t last_stats_log_time_ms;
+    int64_t last_chip_id_check_ms;
 
     uint16_t current_channel_mask;
-    uint16_t current_batch_count;
-    uint16_t channel_data_buffer[64];
+
+    // Sample ring block currently being filled, NULL until the next sample arrives
+    struct sample_block_t * current_block;
+    uint32_t sample_index; // raw samples so far, the index of the next one
+
+    uint8_t stream_mode; // intan_stream_mode_t
+    uint16_t raw_channel_mask; // channels whose raw samples go to the host, the LFP stream (intan_decim.h) has all of them
+    uint8_t codec;       // intan_codec_t, for sample blocks
+    intan_codec_stats_t codec_stats;
 
 } intan_priv_t;
 
 
 int intan_send(uint32_t command);
-void intan_add_host_command(uint32_t command);
+void intan_encode_command(uint32_t command, uint8_t * buf);
+uint32_t intan_decode_response(const uint8_t * buf);
+void intan_set_frame_command(size_t slot, uint32_t command);
+int intan_send_spi_frame_async(size_t num_commands, spi_frame_done_cb_t cb, void * user_data);
+int intan_read_register_async(uint8_t reg, intan_read_cb_t cb, void * ctx);
 bool intan_check_write_response(uint32_t write_command, uint32_t resp);
 void intan_dump_channel_data(void);
 intan_convert_channel_data_t intan_get_channel_data(uint8_t channel_num);
@@ -0,0 +1,142 @@
+/*
+This file contains the per-channel sample history. Completion context writes it, any thread may read it.
+*/
+
+#include <kernel.h>
+#include <logging/log.h>
+#include <sys/atomic.h>
+
+#include "intan_history.h"
+
+#define LOG_MODULE_NAME       intan_history_c
+LOG_MODULE_REGISTER(LOG_MODULE_NAME, LOG_LEVEL_INF);
+
+intan_history_priv_t intan_history_priv;
+
+void intan_history_init(void) {
+
+    memset(&intan_history_priv, 0, sizeof(intan_history_priv_t));
+
+    LOG_INF("Sample history: %d samples per channel, %d bytes", INTAN_HISTORY_DEPTH,
+            sizeof(intan_history_priv.samples));
+}
+
+// Completion context: append a sample of channel, readers see it after the next intan_history_commit().
+// Returns the sample number of sample within its channel.
+uint32_t intan_history_put(uint8_t channel, int16_t sample, uint32_t frame_index) {
+
+    uint32_t head = intan_history_priv.head[channel];
+
+    intan_history_priv.samples[channel][head % INTAN_HISTORY_DEPTH] = sample;
+    intan_history_priv.head[channel] = head + 1;
+    intan_history_priv.head_frame[channel] = frame_index;
+
+    return head;
+}
+
+// Completion context: publish the samples appended during frame_index
+void intan_history_commit(uint32_t frame_index) {
+
+    // atomic_inc is a full barrier, the samples are in place before the new heads can be seen
+    atomic_inc(&intan_history_priv.seq);
+
+    memcpy(intan_history_priv.committed, intan_history_priv.head, sizeof(intan_history_priv.committed));
+    memcpy(intan_history_priv.committed_frame, intan_history_priv.head_frame, sizeof(intan_history_priv.committed_frame));
+    intan_history_priv.frame_index = frame_index;
+
+    atomic_inc(&intan_history_priv.seq);
+}
+
+// Published head of channel and the frame of its newest sample
+static uint32_t intan_history_committed(uint8_t channel, uint32_t * end_frame) {
+
+    uint32_t head;
+    atomic_val_t seq;
+
+    // Completion context can only interrupt us, never the other way around, so this retries at most once per frame
+    do {
+        seq = atomic_get(&intan_history_priv.seq);
+        head = intan_history_priv.committed[channel];
+        *end_frame = intan_history_priv.committed_frame[channel];
+    } while ((seq & 1) || seq != atomic_get(&intan_history_priv.seq));
+
+    return head;
+}
+
+static void intan_history_fill_window(uint8_t channel, uint32_t start, uint16_t len, intan_history_window_t * window) {
+
+    uint16_t slot = start % INTAN_HISTORY_DEPTH;
+
+    window->start = start;
+    window->first = &intan_history_priv.samples[channel][slot];
+    window->first_len = MIN(len, INTAN_HISTORY_DEPTH - slot);
+    window->second = intan_history_priv.samples[channel];
+    window->second_len = len - window->first_len;
+}
+
+// The last len published samples of channel. -EAGAIN if the channel does not have that many yet.
+int intan_history_window(uint8_t channel, uint16_t len, intan_history_window_t * window) {
+
+    uint32_t end_frame;
+
+    if (channel >= NUM_CHANNELS || len == 0 || len > INTAN_HISTORY_DEPTH) {
+        return -EINVAL;
+    }
+
+    uint32_t head = intan_history_committed(channel, &end_frame);
+
+    if (head < len) {
+        return -EAGAIN;
+    }
+
+    intan_history_fill_window(channel, head - len, len, window);
+    window->end_frame = end_frame;
+
+    return 0;
+}
+
+/*
+The len samples of channel up to and including sample number pos, which only needs to be right in its low 16 bits
+(intan_frame_t.history_pos). -EAGAIN if that sample is not published yet or the channel does not have len samples up
+to it, -ENOENT if newer samples have already overwritten the start of the window. The frame of the newest sample is
+not looked up, window->end_frame is left as it is.
+*/
+int intan_history_window_ending(uint8_t channel, uint16_t pos, uint16_t len, intan_history_window_t * window) {
+
+    uint32_t end_frame;
+
+    if (channel >= NUM_CHANNELS || len == 0 || len > INTAN_HISTORY_DEPTH) {
+        return -EINVAL;
+    }
+
+    uint32_t head = intan_history_committed(channel, &end_frame);
+
+    // Samples published after pos, a wrapped around difference means pos is not published yet
+    uint16_t newer = (uint16_t) (head - 1 - pos);
+
+    if (head == 0 || newer >= 0x8000 || head - newer < len) {
+        return -EAGAIN;
+    }
+    if (newer + len > INTAN_HISTORY_DEPTH) {
+        return -ENOENT;
+    }
+
+    intan_history_fill_window(channel, head - newer - len, len, window);
+
+    return 0;
+}
+
+// False if completion context has overwritten samples of window since it was looked up, check after reading it
+bool intan_history_window_intact(uint8_t channel, const intan_history_window_t * window) {
+    return intan_history_priv.head[channel] - window->start <= INTAN_HISTORY_DEPTH;
+}
+
+// Sample i of window, 0 is the oldest
+int16_t intan_history_sample(const intan_history_window_t * window, uint16_t i) {
+    return (i < window->first_len) ? window->first[i] : window->second[i - window->first_len];
+}
+
+// Last frame whose samples are published
+uint32_t intan_history_frame_index(void) {
+    return intan_history_priv.frame_index;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <kernel.h>
+#include <sys/atomic.h>
+#include "config.h"
+#include "intan_helper.h"
+
+/*
+Recent samples of every channel, for anything that needs a window of a channel and not just its latest sample.
+
+Every channel has its own contiguous ring of INTAN_HISTORY_DEPTH AC samples (relative to mid scale, with the channel
+calibration applied but before re-referencing and filtering), so a window of one channel is one or two runs of consecutive int16_t.
+Completion context appends the samples while it decodes a frame and publishes them all together with the frame
+index at the end of the frame. The Intan thread and anything else reads windows through intan_history_window(),
+which only looks up where the window starts and never copies. Every sample of a frame also carries its sample number
+(intan_frame_t.history_pos), so the Intan thread can look up the window ending at a sample it is processing with
+intan_history_window_ending() even when completion context has published newer frames since.
+
+The writer does not wait for readers. A window stays intact until its channel has received INTAN_HISTORY_DEPTH more
+samples, which is at least INTAN_HISTORY_DEPTH - len frames, and intan_history_window_intact() tells afterwards
+whether that happened while the window was being read.
+
+RAM: NUM_CHANNELS * INTAN_HISTORY_DEPTH * 2 bytes, 8 KB with 16 channels and the default depth of 256.
+*/
+
+BUILD_ASSERT((INTAN_HISTORY_DEPTH & (INTAN_HISTORY_DEPTH - 1)) == 0, "INTAN_HISTORY_DEPTH must be a power of 2");
+
+// Window of a channel, oldest sample first: first[0..first_len) and then second[0..second_len) if the ring wrapped
+typedef struct intan_history_window_t {
+    const int16_t * first;
+    const int16_t * second;
+    uint16_t first_len;
+    uint16_t second_len;
+    uint32_t start;        // samples of the channel before the window, for intan_history_window_intact()
+    uint32_t end_frame;    // frame the newest sample of the window was taken in
+} intan_history_window_t;
+
+typedef struct intan_history_priv_t {
+    int16_t samples[NUM_CHANNELS][INTAN_HISTORY_DEPTH] __aligned(4);
+
+    // Written by completion context only
+    uint32_t head[NUM_CHANNELS];            // samples appended per channel, slot = head % INTAN_HISTORY_DEPTH
+    uint32_t head_frame[NUM_CHANNELS];      // frame of the newest sample of every channel
+
+    // Published at the end of every frame, odd while completion context updates it
+    atomic_t seq;
+    uint32_t committed[NUM_CHANNELS];       // head as of the end of the last frame
+    uint32_t committed_frame[NUM_CHANNELS];
+    uint32_t frame_index;                   // last frame published
+} intan_history_priv_t;
+
+void intan_history_init(void);
+uint32_t intan_history_put(uint8_t channel, int16_t sample, uint32_t frame_index);
+void intan_history_commit(uint32_t frame_index);
+int intan_history_window(uint8_t channel, uint16_t len, intan_history_window_t * window);
+int intan_history_window_ending(uint8_t channel, uint16_t pos, uint16_t len, intan_history_window_t * window);
+bool intan_history_window_intact(uint8_t channel, const intan_history_window_t * window);
+int16_t intan_history_sample(const intan_history_window_t * window, uint16_t i);
+uint32_t intan_history_frame_index(void);
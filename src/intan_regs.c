@@ -0,0 +1,192 @@
+/*
+This file contains the shadow register file of the Intan RHS2116.
+
+intan_regs_write_needed() runs in the thread that queues a write, the response and idle slot functions run wherever
+the frame is decoded (completion context while acquiring). A write clears the verified bit before it changes the
+value, so a response can never verify a value that has not been sent.
+*/
+
+#include <kernel.h>
+#include <logging/log.h>
+#include <sys/atomic.h>
+
+#include "intan.h"
+#include "intan_helper.h"
+#include "intan_regs.h"
+
+#define LOG_MODULE_NAME       intan_regs_c
+LOG_MODULE_REGISTER(LOG_MODULE_NAME, LOG_LEVEL_INF);
+
+#define INTAN_READ_DATA_MASK  0xFFFF
+
+intan_regs_priv_t intan_regs_priv;
+
+/*
+Registers read back in the idle aux slots. Triggered registers are left out, they only take a written value on the
+next U flag so they can legitimately differ from the shadow.
+*/
+static const uint8_t intan_regs_scrub_list[] = {
+    REG_SUPPLY_SENSOR_ADC_BUFF_BIAS_CURRENT,
+    REG_ADC_OUT_FORMAT_DSP_OFFSET_RM_AUX_DIG_OUT,
+    REG_IMPEDENCE_CHECK_CONTROL,
+    REG_IMPEDENCE_CHECK_DAC,
+    REG_ONCHIP_AMP_BW_SEL_ONE,
+    REG_ONCHIP_AMP_BW_SEL_TWO,
+    REG_ONCHIP_AMP_BW_SEL_THREE,
+    REG_ONCHIP_AMP_BW_SEL_FOUR,
+    REG_IND_AC_AMP_POWER,
+    REG_STIM_ENABLE_A,
+    REG_STIM_ENABLE_B,
+    REG_STIM_CURRENT_STEP_SIZE,
+    REG_STIM_BIAS_VOL,
+    REG_CHARGE_RECOVERY_TARGET,
+    REG_CHARGE_RECOVERY_LIM,
+    REG_IND_DC_AMP_POWER,
+};
+
+static inline bool intan_regs_is_write(uint32_t command) {
+    return (command & INTAN_RWC_COMMAND_HEADER_MASK) == INTAN_WRITE_HEADER;
+}
+
+static inline uint8_t intan_regs_command_reg(uint32_t command) {
+    return (command >> INTAN_WRITE_REG_OFFSET) & INTAN_WRITE_REG_MASK;
+}
+
+void intan_regs_init(void) {
+    memset(&intan_regs_priv, 0, sizeof(intan_regs_priv_t));
+}
+
+// Returns false if command is a write the chip already has, it can be dropped. Otherwise the write is recorded.
+bool intan_regs_write_needed(uint32_t command) {
+
+    if (!intan_regs_is_write(command)) {
+        return true;
+    }
+
+    uint8_t reg = intan_regs_command_reg(command);
+    uint16_t value = command & INTAN_WRITE_DATA_MASK;
+    bool has_flags = command & ((1 << INTAN_WRITE_U_FLAG_OFFSET) | (1 << INTAN_WRITE_M_FLAG_OFFSET));
+
+    if (!has_flags && atomic_test_bit(intan_regs_priv.verified, reg) && intan_regs_priv.value[reg] == value) {
+        intan_regs_priv.stats.skipped_writes++;
+        return false;
+    }
+
+    atomic_clear_bit(intan_regs_priv.verified, reg);
+    atomic_clear_bit(intan_regs_priv.restore, reg);
+    intan_regs_priv.value[reg] = value;
+    atomic_set_bit(intan_regs_priv.written, reg);
+
+    return true;
+}
+
+// Response to a write, ok is the result of intan_check_write_response()
+void intan_regs_write_response(uint32_t command, bool ok) {
+
+    uint8_t reg = intan_regs_command_reg(command);
+
+    // Only the latest write to the register may verify it, an older one still in the pipeline must not
+    if (ok && intan_regs_priv.value[reg] == (command & INTAN_WRITE_DATA_MASK)) {
+        atomic_set_bit(intan_regs_priv.verified, reg);
+    }
+}
+
+/*
+The chip lost registers, one read back wrong is enough to distrust the rest. Every register goes unverified, so no
+write is skipped anymore, and every register written since init is written back. Each one is verified again by the
+response of its write.
+*/
+static void intan_regs_recover(void) {
+
+    intan_regs_priv.stats.recoveries++;
+
+    for (int i = 0; i < ARRAY_SIZE(intan_regs_priv.verified); i++) {
+        atomic_set(&intan_regs_priv.verified[i], 0);
+        atomic_or(&intan_regs_priv.restore[i], atomic_get(&intan_regs_priv.written[i]));
+    }
+}
+
+// Response to a read, compared against the shadow if the register is verified
+void intan_regs_read_response(uint32_t command, uint32_t resp) {
+
+    uint8_t reg = (command >> INTAN_READ_REG_OFFSET) & INTAN_READ_REG_MASK;
+    uint16_t value = resp & INTAN_READ_DATA_MASK;
+
+    if (!atomic_test_bit(intan_regs_priv.verified, reg) || intan_regs_priv.value[reg] == value) {
+        return;
+    }
+
+    intan_regs_priv.stats.scrub_mismatches++;
+    intan_regs_recover();
+}
+
+// Completion context: answer to the periodic chip ID read, a wrong ID means the chip was reset or stopped answering
+void intan_regs_chip_id_read(int err, uint8_t reg, uint16_t value, void * ctx) {
+
+    if (!err && value != CHIP_ID) {
+        intan_regs_priv.stats.chip_id_errors++;
+        intan_regs_recover();
+    }
+}
+
+// True while registers the chip lost are still waiting to be written back
+bool intan_regs_recovering(void) {
+
+    for (int i = 0; i < ARRAY_SIZE(intan_regs_priv.restore); i++) {
+        if (atomic_get(&intan_regs_priv.restore[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Next write back from the shadow, false if there is none. These go ahead of everything else in the aux slots.
+bool intan_regs_restore_command(uint32_t * command) {
+
+    for (int i = 0; i < ARRAY_SIZE(intan_regs_priv.restore); i++) {
+        atomic_val_t pending = atomic_get(&intan_regs_priv.restore[i]);
+
+        while (pending) {
+            uint8_t reg = i * ATOMIC_BITS + __builtin_ctz(pending);
+
+            // A newer write may have taken the register over in the meantime, it restores it as well
+            if (atomic_test_and_clear_bit(intan_regs_priv.restore, reg)) {
+                intan_regs_priv.stats.restores++;
+                *command = INTAN_WRITE(reg, intan_regs_priv.value[reg], 0, 0);
+                return true;
+            }
+            pending &= pending - 1;
+        }
+    }
+    return false;
+}
+
+// Command for an aux slot with nothing else to do: the next scrub read
+uint32_t intan_regs_idle_command(void) {
+
+    uint8_t reg = intan_regs_scrub_list[intan_regs_priv.scrub_index];
+
+    intan_regs_priv.scrub_index = (intan_regs_priv.scrub_index + 1) % ARRAY_SIZE(intan_regs_scrub_list);
+    intan_regs_priv.stats.scrub_reads++;
+
+    return INTAN_READ(reg, 0, 0);
+}
+
+void intan_regs_get_stats(intan_regs_stats_t * stats) {
+    *stats = intan_regs_priv.stats;
+}
+
+void intan_regs_log_stats(void) {
+
+    intan_regs_stats_t stats;
+    intan_regs_get_stats(&stats);
+
+    LOG_INF("Registers: %d writes skipped, %d scrub reads, %d mismatches, %d chip ID errors, %d recoveries, "
+            "%d restored", stats.skipped_writes, stats.scrub_reads, stats.scrub_mismatches, stats.chip_id_errors,
+            stats.recoveries, stats.restores);
+
+    if (stats.scrub_mismatches + stats.chip_id_errors != intan_regs_priv.reported_faults) {
+        LOG_WRN("Intan chip was reset or lost register contents");
+        intan_regs_priv.reported_faults = stats.scrub_mismatches + stats.chip_id_errors;
+    }
+}
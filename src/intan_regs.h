@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/atomic.h>
+
+/*
+Shadow copy of the RHS2116 registers.
+
+Every write that goes to the chip first records its value here. Once the write response confirms it
+(intan_check_write_response()) the register is verified, and a later write of the same value without U or M flag is
+dropped instead of costing an SPI word. U and M flags have side effects on other registers, so those writes always go.
+
+Aux slots with nothing to do read the non-triggered registers one after the other instead of a dummy command.
+The chip ID is read through intan_read_register_async() every INTAN_CHIP_ID_CHECK_INTERVAL_MS, so it is checked even
+when no aux slot is idle. A verified register that reads back a different value, or a wrong chip ID, means the chip was reset or lost its
+registers. Then nothing the shadow holds can be trusted, triggered registers (stim magnitudes, stim on, polarity,
+charge recovery) included, which the scrub cannot read back. Every register is unverified and every register written
+since init is written back from the shadow, ahead of the aux queue. Until all of them are out, intan_regs_recovering()
+is true and the stimulation sequencer holds off, so no U flag can latch a triggered register the chip lost.
+Acquisition keeps running.
+*/
+
+#define INTAN_NUM_REGS  256
+
+typedef struct intan_regs_stats_t {
+    uint32_t skipped_writes;   // writes dropped because the register already holds the value
+    uint32_t scrub_reads;
+    uint32_t scrub_mismatches; // verified registers that read back a different value
+    uint32_t restores;         // registers written back from the shadow after a fault
+    uint32_t chip_id_errors;   // chip ID read back wrong, the chip is not responding
+    uint32_t recoveries;       // faults that made every written register go back to the chip
+} intan_regs_stats_t;
+
+typedef struct intan_regs_priv_t {
+    uint16_t value[INTAN_NUM_REGS];             // last value written to each register
+    ATOMIC_DEFINE(verified, INTAN_NUM_REGS);    // chip confirmed value[], cleared while a new write is in flight
+    ATOMIC_DEFINE(restore, INTAN_NUM_REGS);     // registers to write back from the shadow
+    ATOMIC_DEFINE(written, INTAN_NUM_REGS);     // registers written since init, value[] means something
+
+    uint8_t scrub_index;  // next entry of the scrub list
+    uint32_t reported_faults; // mismatches + chip ID errors at the last log, to warn only about new ones
+
+    intan_regs_stats_t stats;
+} intan_regs_priv_t;
+
+void intan_regs_init(void);
+bool intan_regs_write_needed(uint32_t command);
+void intan_regs_write_response(uint32_t command, bool ok);
+void intan_regs_read_response(uint32_t command, uint32_t resp);
+void intan_regs_chip_id_read(int err, uint8_t reg, uint16_t value, void * ctx);
+bool intan_regs_recovering(void);
+bool intan_regs_restore_command(uint32_t * command);
+uint32_t intan_regs_idle_command(void);
+void intan_regs_get_stats(intan_regs_stats_t * stats);
+void intan_regs_log_stats(void);
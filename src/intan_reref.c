@@ -0,0 +1,205 @@
+/*
+This file contains the re-referencing stage. Configuration and processing both run in the Intan thread.
+*/
+
+#include <kernel.h>
+#include <logging/log.h>
+
+#if defined(__ARM_FEATURE_DSP)
+#include <arch/arm/aarch32/cortex_m/cmsis.h>
+#endif
+
+#include "cpu_cycles.h"
+#include "hostcomm.h"
+#include "intan_reref.h"
+
+#define LOG_MODULE_NAME       intan_reref_c
+LOG_MODULE_REGISTER(LOG_MODULE_NAME, LOG_LEVEL_INF);
+
+#define INTAN_REREF_WEIGHT_SHIFT  14  // Q2.14 weights
+
+BUILD_ASSERT(NUM_CHANNELS % 2 == 0, "Dense rows take the channels in pairs");
+
+intan_reref_priv_t intan_reref_priv;
+
+void intan_reref_init(void) {
+
+    memset(&intan_reref_priv, 0, sizeof(intan_reref_priv_t));
+
+    // Identity montage until the host loads one
+    for (int channel = 0; channel < NUM_CHANNELS; channel++) {
+        intan_reref_priv.weights[channel][channel] = 1 << INTAN_REREF_WEIGHT_SHIFT;
+        intan_reref_priv.uploaded_weights[channel][channel] = 1 << INTAN_REREF_WEIGHT_SHIFT;
+    }
+}
+
+// Load count weights of montage row starting at column first_col, rows are uploaded in pieces. Takes effect with
+// intan_reref_set_mode().
+int intan_reref_set_weights(uint8_t row, uint8_t first_col, const int16_t * weights, uint8_t count) {
+
+    if (row >= NUM_CHANNELS || first_col + count > NUM_CHANNELS) {
+        return -EINVAL;
+    }
+
+    memcpy(&intan_reref_priv.uploaded_weights[row][first_col], weights, count * sizeof(int16_t));
+
+    return 0;
+}
+
+// Take over the uploaded montage and find the non-zero weights of every row, for the sparse path
+static void intan_reref_compile_montage(void) {
+
+    memcpy(intan_reref_priv.weights, intan_reref_priv.uploaded_weights, sizeof(intan_reref_priv.weights));
+
+    for (int row = 0; row < NUM_CHANNELS; row++) {
+        uint8_t nnz = 0;
+
+        for (int col = 0; col < NUM_CHANNELS; col++) {
+            if (intan_reref_priv.weights[row][col] == 0) {
+                continue;
+            }
+            if (nnz < INTAN_REREF_SPARSE_MAX) {
+                intan_reref_priv.sparse_col[row][nnz] = col;
+                intan_reref_priv.sparse_weight[row][nnz] = intan_reref_priv.weights[row][col];
+            }
+            nnz++;
+        }
+
+        intan_reref_priv.row_nnz[row] = nnz;
+    }
+}
+
+int intan_reref_set_mode(uint8_t mode, uint16_t ref_mask) {
+
+    if (mode > INTAN_REREF_MONTAGE) {
+        return -EINVAL;
+    }
+    if ((mode == INTAN_REREF_COMMON_AVERAGE || mode == INTAN_REREF_COMMON_MEDIAN) && ref_mask == 0) {
+        return -EINVAL;
+    }
+
+    if (mode == INTAN_REREF_MONTAGE) {
+        intan_reref_compile_montage();
+    }
+
+    intan_reref_priv.mode = mode;
+    intan_reref_priv.ref_mask = ref_mask;
+
+    return 0;
+}
+
+static int16_t intan_reref_common_average(void) {
+
+    int32_t sum = 0;
+    uint8_t count = 0;
+
+    for (uint16_t mask = intan_reref_priv.ref_mask; mask; mask &= mask - 1) {
+        sum += intan_reref_priv.x[__builtin_ctz(mask)];
+        count++;
+    }
+
+    return sum / count;
+}
+
+static int16_t intan_reref_common_median(void) {
+
+    int16_t values[NUM_CHANNELS];
+    uint8_t count = 0;
+
+    // Insertion sort, there are at most 16 of them
+    for (uint16_t mask = intan_reref_priv.ref_mask; mask; mask &= mask - 1) {
+        int16_t v = intan_reref_priv.x[__builtin_ctz(mask)];
+        int i = count++;
+
+        while (i > 0 && values[i - 1] > v) {
+            values[i] = values[i - 1];
+            i--;
+        }
+        values[i] = v;
+    }
+
+    return (count % 2) ? values[count / 2] : ((int32_t) values[count / 2 - 1] + values[count / 2]) / 2;
+}
+
+static int16_t intan_reref_montage_row(uint8_t row) {
+
+    int64_t acc = 0;
+
+    if (intan_reref_priv.row_nnz[row] <= INTAN_REREF_SPARSE_MAX) {
+        for (int i = 0; i < intan_reref_priv.row_nnz[row]; i++) {
+            acc += (int32_t) intan_reref_priv.sparse_weight[row][i] * intan_reref_priv.x[intan_reref_priv.sparse_col[row][i]];
+        }
+    }
+    else {
+#if defined(__ARM_FEATURE_DSP)
+        const uint32_t * weight_pairs = (const uint32_t *) intan_reref_priv.weights[row];
+        const uint32_t * x_pairs = (const uint32_t *) intan_reref_priv.x;
+
+        for (int i = 0; i < NUM_CHANNELS / 2; i++) {
+            acc = __SMLALD(weight_pairs[i], x_pairs[i], acc);
+        }
+#else
+        for (int i = 0; i < NUM_CHANNELS; i++) {
+            acc += (int32_t) intan_reref_priv.weights[row][i] * intan_reref_priv.x[i];
+        }
+#endif
+    }
+
+    return CLAMP(acc >> INTAN_REREF_WEIGHT_SHIFT, INT16_MIN, INT16_MAX);
+}
+
+// Re-reference the samples of frame in place
+void intan_reref_process_frame(intan_frame_t * frame) {
+
+    if (intan_reref_priv.mode == INTAN_REREF_NONE) {
+        return;
+    }
+
+    uint32_t start_cycles = cpu_cycles_get();
+    int16_t ref = 0;
+
+    for (int i = 0; i < frame->num_samples; i++) {
+        uint8_t channel = HOSTCOMM_SAMPLE_TAG_CHANNEL(frame->tags[i]);
+        intan_reref_priv.x[channel] = (int32_t) frame->samples[i].ac_amp_data - INTAN_AC_MID_SCALE;
+    }
+
+    if (intan_reref_priv.mode == INTAN_REREF_COMMON_AVERAGE) {
+        ref = intan_reref_common_average();
+    }
+    else if (intan_reref_priv.mode == INTAN_REREF_COMMON_MEDIAN) {
+        ref = intan_reref_common_median();
+    }
+
+    for (int i = 0; i < frame->num_samples; i++) {
+        uint8_t channel = HOSTCOMM_SAMPLE_TAG_CHANNEL(frame->tags[i]);
+        int32_t y;
+
+        if (intan_reref_priv.mode == INTAN_REREF_MONTAGE) {
+            y = intan_reref_montage_row(channel);
+        }
+        else {
+            y = CLAMP((int32_t) intan_reref_priv.x[channel] - ref, INT16_MIN, INT16_MAX);
+        }
+
+        frame->samples[i].ac_amp_data = y + INTAN_AC_MID_SCALE;
+    }
+
+    intan_reref_priv.stats.frames++;
+    intan_reref_priv.stats.cycles += cpu_cycles_get() - start_cycles;
+}
+
+// Cost of re-referencing against the frame period, statistics restart after every log
+void intan_reref_log_stats(uint32_t frame_period_ns) {
+
+    if (intan_reref_priv.stats.frames == 0) {
+        return;
+    }
+
+    uint32_t cycles_per_frame = intan_reref_priv.stats.cycles / intan_reref_priv.stats.frames;
+    uint32_t frame_cycles = MAX(cpu_cycles_from_ns(frame_period_ns), 1);
+
+    LOG_INF("Re-referencing: mode %d, %d cycles per frame, %d permille of the frame", intan_reref_priv.mode,
+            cycles_per_frame, (uint32_t) (((uint64_t) cycles_per_frame * 1000) / frame_cycles));
+
+    memset(&intan_reref_priv.stats, 0, sizeof(intan_reref_stats_t));
+}
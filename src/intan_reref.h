@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdint.h>
+#include "config.h"
+#include "intan_helper.h"
+
+/*
+Re-referencing, the first stage of the Intan thread's processing, before filtering, decimation, detection and coding.
+
+Every frame first updates the latest value of each channel with the samples it holds (channels of a slower rate class
+keep their last value in between), then replaces every sample of the frame with its re-referenced value:
+    common average    x[c] - mean of x over the reference channels
+    common median     x[c] - median of x over the reference channels
+    montage           sum over j of W[c][j] x[j], W in Q2.14 from the host, e.g. W[c][c] = 1, W[c][c+1] = -1 for
+                      a bipolar montage. W[c][c] = 1 and nothing else leaves a channel as it is.
+Montage rows with at most INTAN_REREF_SPARSE_MAX weights run through a list of their non-zero weights, fuller rows
+through a dense dot product that takes the channels in pairs (__SMLALD on the M33).
+*/
+
+typedef enum intan_reref_mode_t {
+    INTAN_REREF_NONE = 0,
+    INTAN_REREF_COMMON_AVERAGE,
+    INTAN_REREF_COMMON_MEDIAN,
+    INTAN_REREF_MONTAGE,
+} intan_reref_mode_t;
+
+typedef struct intan_reref_stats_t {
+    uint32_t frames;
+    uint32_t cycles;
+} intan_reref_stats_t;
+
+typedef struct intan_reref_priv_t {
+    uint8_t mode;                 // intan_reref_mode_t
+    uint16_t ref_mask;            // channels averaged for the common average or median
+
+    int16_t x[NUM_CHANNELS] __aligned(4);  // latest sample of every channel, relative to mid scale
+
+    int16_t weights[NUM_CHANNELS][NUM_CHANNELS] __aligned(4);  // montage, [output][input]
+    int16_t uploaded_weights[NUM_CHANNELS][NUM_CHANNELS];     // from the host, in use after intan_reref_set_mode()
+    uint8_t row_nnz[NUM_CHANNELS];  // non-zero weights per row, rows above INTAN_REREF_SPARSE_MAX use the dense path
+    uint8_t sparse_col[NUM_CHANNELS][INTAN_REREF_SPARSE_MAX];
+    int16_t sparse_weight[NUM_CHANNELS][INTAN_REREF_SPARSE_MAX];
+
+    intan_reref_stats_t stats;
+} intan_reref_priv_t;
+
+void intan_reref_init(void);
+int intan_reref_set_weights(uint8_t row, uint8_t first_col, const int16_t * weights, uint8_t count);
+int intan_reref_set_mode(uint8_t mode, uint16_t ref_mask);
+void intan_reref_process_frame(intan_frame_t * frame);
+void intan_reref_log_stats(uint32_t frame_period_ns);
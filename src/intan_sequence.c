@@ -0,0 +1,118 @@
+/*
+This file contains the compiler for Intan frame command sequences.
+
+Channels are placed one at a time, fastest rate class first. A channel of divider D is converted in the frames
+p, p+D, p+2D, ... of the superframe. The phase p is picked so that the fullest of those frames is as empty as
+possible, which spreads the slow channels evenly and keeps the frames (and the SPI bandwidth) as short as possible.
+The channel then takes the slot right above everything already placed in those frames.
+*/
+
+#include <errno.h>
+#include <string.h>
+
+#include "intan.h"
+#include "intan_helper.h"
+
+static uint32_t intan_sequence_gcd(uint32_t a, uint32_t b) {
+
+    while (b) {
+        uint32_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+// Every channel in every class is sampled on every frame by default
+void intan_rate_config_init(intan_rate_config_t * config) {
+
+    memset(config, 0, sizeof(intan_rate_config_t));
+
+    for (int i = 0; i < INTAN_NUM_RATE_CLASSES; i++) {
+        config->class_div[i] = 1;
+    }
+}
+
+// Build the sequence for the given recording mask. seq is left untouched if the rate classes cannot be combined.
+int intan_sequence_compile(uint16_t channel_mask, const intan_rate_config_t * config, uint8_t num_aux,
+                           intan_sequence_t * seq) {
+
+    uint32_t num_frames = 1;
+    uint8_t load[INTAN_SEQUENCE_MAX_FRAMES];
+
+    if (num_aux == 0 || num_aux > INTAN_NUM_AUX_COMMANDS) {
+        return -EINVAL;
+    }
+
+    for (int channel = 0; channel < NUM_CHANNELS; channel++) {
+        if (!(channel_mask & (1 << channel))) {
+            continue;
+        }
+
+        uint8_t rate_class = config->channel_class[channel];
+        if (rate_class >= INTAN_NUM_RATE_CLASSES || config->class_div[rate_class] == 0) {
+            return -EINVAL;
+        }
+
+        uint32_t div = config->class_div[rate_class];
+        num_frames = (num_frames / intan_sequence_gcd(num_frames, div)) * div;
+        if (num_frames > INTAN_SEQUENCE_MAX_FRAMES) {
+            return -EINVAL;
+        }
+    }
+
+    memset(seq, 0, sizeof(intan_sequence_t));
+    memset(seq->slot_channel, INTAN_SEQUENCE_NO_SAMPLE, sizeof(seq->slot_channel));
+    memset(load, 0, sizeof(load));
+
+    seq->channel_mask = channel_mask;
+    seq->num_frames = num_frames;
+    memcpy(seq->channel_class, config->channel_class, sizeof(seq->channel_class));
+
+    // Place the fastest channels first, they get the low slots and the slow ones are spread over the frames after them
+    for (uint32_t div = 1; div <= num_frames; div++) {
+
+        if (num_frames % div) {
+            continue;
+        }
+
+        for (int channel = 0; channel < NUM_CHANNELS; channel++) {
+
+            if (!(channel_mask & (1 << channel)) || config->class_div[config->channel_class[channel]] != div) {
+                continue;
+            }
+
+            uint32_t best_phase = 0;
+            uint8_t best_slot = 0xFF;
+
+            for (uint32_t phase = 0; phase < div; phase++) {
+                uint8_t slot = 0;
+
+                for (uint32_t frame = phase; frame < num_frames; frame += div) {
+                    if (load[frame] > slot) {
+                        slot = load[frame];
+                    }
+                }
+
+                if (slot < best_slot) {
+                    best_slot = slot;
+                    best_phase = phase;
+                }
+            }
+
+            for (uint32_t frame = best_phase; frame < num_frames; frame += div) {
+                seq->slot_channel[frame][best_slot] = channel;
+                load[frame] = best_slot + 1;
+            }
+
+            if (best_slot + 1 > seq->num_converts) {
+                seq->num_converts = best_slot + 1;
+            }
+        }
+    }
+
+    seq->num_aux = num_aux;
+    seq->num_commands = seq->num_converts + num_aux;
+
+    return 0;
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdint.h>
+#include <toolchain.h>
+
+/*
+Precompiled command sequence of the Intan frames. It is rebuilt whenever the recording mask or the rate classes
+change, together with the decode lookup table that tells which channel every CONVERT slot holds, so nothing has to
+test the mask per sample.
+
+Every channel belongs to a rate class, and a rate class is sampled once every div frames. The sequence is a
+superframe of num_frames frames (the least common multiple of the dividers in use). Every frame has the same length
+and a channel always sits in the same slot of the frames it is converted in, so the spacing between its samples is
+constant. Slots that are free in one frame but used in another are padded with a dummy command.
+The aux slots (1 to INTAN_NUM_AUX_COMMANDS) follow the CONVERTs of every frame.
+Included from intan_helper.h, which provides NUM_CHANNELS and INTAN_NUM_AUX_COMMANDS.
+*/
+
+#define INTAN_SEQUENCE_NO_SAMPLE      0xFF
+#define INTAN_SEQUENCE_MAX_FRAMES     32  // Longest superframe, bounds the dividers that can be combined
+#define INTAN_NUM_RATE_CLASSES        4   // Rate class fits in 2 bits of the sample tag
+
+// Per-channel sample rates, as dividers of the frame rate
+typedef struct intan_rate_config_t {
+    uint8_t class_div[INTAN_NUM_RATE_CLASSES];  // class c is sampled every class_div[c] frames
+    uint8_t channel_class[NUM_CHANNELS];
+} intan_rate_config_t;
+
+typedef struct intan_sequence_t {
+    uint16_t channel_mask;
+    uint8_t num_frames;    // superframe length
+    uint8_t num_converts;  // CONVERT slots per frame, padding included
+    uint8_t num_aux;
+    uint8_t num_commands;  // num_converts + num_aux, aux slots start at num_converts
+
+    // Channel converted in each slot of each frame, INTAN_SEQUENCE_NO_SAMPLE for padding. Aux slots are filled in per
+    // frame. Together with channel_class this is the decode lookup table, it gives the tag of every CONVERT result.
+    uint8_t slot_channel[INTAN_SEQUENCE_MAX_FRAMES][NUM_CHANNELS];
+    uint8_t channel_class[NUM_CHANNELS];
+} intan_sequence_t;
+
+void intan_rate_config_init(intan_rate_config_t * config);
+int intan_sequence_compile(uint16_t channel_mask, const intan_rate_config_t * config, uint8_t num_aux,
+                           intan_sequence_t * seq);
@@ -0,0 +1,34 @@
+/*
+This file contains the simulated signal source. It is called from completion context, so it only does integer math.
+*/
+
+#include <kernel.h>
+
+#include "config.h"
+#include "intan_helper.h"
+#include "intan_sim.h"
+
+#define INTAN_SIM_NOISE_MASK  0x7F    // noise of +-64 counts
+
+// Extracellular spike, one sample per frame, in ADC counts relative to mid scale
+static const int16_t intan_sim_spike[] = {
+    -300, -1800, -3000, -2200, -600, 700, 1100, 900, 500, 200,
+};
+
+static uint32_t intan_sim_noise_state = 1;
+
+uint16_t intan_sim_sample(uint8_t channel, uint32_t frame) {
+
+    uint32_t phase = (frame + channel * (INTAN_SIM_EVENT_PERIOD_FRAMES / NUM_CHANNELS)) % INTAN_SIM_EVENT_PERIOD_FRAMES;
+    int32_t sample = 0;
+
+    // Linear congruential generator, plenty for noise
+    intan_sim_noise_state = intan_sim_noise_state * 1664525 + 1013904223;
+    sample += (int32_t) ((intan_sim_noise_state >> 16) & INTAN_SIM_NOISE_MASK) - (INTAN_SIM_NOISE_MASK + 1) / 2;
+
+    if (phase < ARRAY_SIZE(intan_sim_spike)) {
+        sample += intan_sim_spike[phase];
+    }
+
+    return INTAN_AC_MID_SCALE + sample;
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+Simulated signal source for testing without electrodes. With INTAN_SIMULATED_SIGNAL set in config.h, every CONVERT
+result is replaced by a synthetic sample: low level noise around mid scale and, once every
+INTAN_SIM_EVENT_PERIOD_FRAMES frames, a spike shaped deflection. The spikes of the channels are staggered over the
+period, so a channel's spikes start at frames where (frame + channel * period / NUM_CHANNELS) % period == 0 and
+detection can be checked against known onsets.
+*/
+
+uint16_t intan_sim_sample(uint8_t channel, uint32_t frame);
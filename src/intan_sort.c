@@ -0,0 +1,174 @@
+/*
+This file contains the template matching spike sorter. Everything here runs in the Intan thread.
+*/
+
+#include <kernel.h>
+#include <logging/log.h>
+
+#if defined(__ARM_FEATURE_DSP)
+#include <arch/arm/aarch32/cortex_m/cmsis.h>
+#endif
+
+#include "cpu_cycles.h"
+#include "hostcomm.h"
+#include "intan_sort.h"
+
+#define LOG_MODULE_NAME       intan_sort_c
+LOG_MODULE_REGISTER(LOG_MODULE_NAME, LOG_LEVEL_INF);
+
+BUILD_ASSERT(INTAN_SPIKE_SNIPPET_LEN % 2 == 0, "Distance kernel takes samples in pairs");
+BUILD_ASSERT(INTAN_SORT_MAX_UNITS <= 8, "Units of a channel are kept in an 8 bit mask");
+
+intan_sort_priv_t intan_sort_priv;
+
+void intan_sort_init(void) {
+    memset(&intan_sort_priv, 0, sizeof(intan_sort_priv_t));
+}
+
+// Load count samples of a template starting at sample offset, templates are uploaded in pieces
+int intan_sort_set_template(uint8_t channel, uint8_t unit, uint8_t offset, const int16_t * samples, uint8_t count) {
+
+    if (channel >= NUM_CHANNELS || unit >= INTAN_SORT_MAX_UNITS || offset + count > INTAN_SPIKE_SNIPPET_LEN) {
+        return -EINVAL;
+    }
+
+    memcpy(&intan_sort_priv.units[channel][unit].template[offset], samples, count * sizeof(int16_t));
+
+    return 0;
+}
+
+// Put the template of unit in use or take it out of use
+int intan_sort_set_unit(uint8_t channel, uint8_t unit, bool enable, uint32_t max_distance) {
+
+    if (channel >= NUM_CHANNELS || unit >= INTAN_SORT_MAX_UNITS) {
+        return -EINVAL;
+    }
+
+    intan_sort_priv.units[channel][unit].max_distance = max_distance;
+
+    if (enable) {
+        intan_sort_priv.unit_mask[channel] |= (1 << unit);
+    }
+    else {
+        intan_sort_priv.unit_mask[channel] &= ~(1 << unit);
+    }
+
+    return 0;
+}
+
+bool intan_sort_channel_enabled(uint8_t channel) {
+    return intan_sort_priv.unit_mask[channel] != 0;
+}
+
+// Sum of squared differences of two snippets, both 4 byte aligned
+static uint64_t intan_sort_distance(const int16_t * a, const int16_t * b) {
+
+#if defined(__ARM_FEATURE_DSP)
+    const uint32_t * a_pairs = (const uint32_t *) a;
+    const uint32_t * b_pairs = (const uint32_t *) b;
+    uint64_t sum = 0;
+
+    for (int i = 0; i < INTAN_SPIKE_SNIPPET_LEN / 2; i++) {
+        // Differences saturate at 16 bits, a snippet that far off matches nothing anyway
+        uint32_t diff = __QSUB16(a_pairs[i], b_pairs[i]);
+        sum = __SMLALD(diff, diff, sum);
+    }
+
+    return sum;
+#else
+    uint64_t sum = 0;
+
+    for (int i = 0; i < INTAN_SPIKE_SNIPPET_LEN; i++) {
+        int32_t diff = CLAMP((int32_t) a[i] - b[i], INT16_MIN, INT16_MAX);
+        sum += (uint32_t) (diff * diff);
+    }
+
+    return sum;
+#endif
+}
+
+// Unit of the closest template of channel, HOSTCOMM_UNIT_UNSORTED if none is close enough. snippet must be 4 byte aligned.
+uint8_t intan_sort_classify(uint8_t channel, const int16_t * snippet) {
+
+    uint32_t start_cycles = cpu_cycles_get();
+    uint8_t best_unit = HOSTCOMM_UNIT_UNSORTED;
+    uint64_t best_distance = UINT64_MAX;
+
+    for (uint8_t units = intan_sort_priv.unit_mask[channel]; units; units &= units - 1) {
+
+        uint8_t unit = __builtin_ctz(units);
+        const intan_sort_unit_t * u = &intan_sort_priv.units[channel][unit];
+        uint64_t distance = intan_sort_distance(snippet, u->template);
+
+        if (distance <= u->max_distance && distance < best_distance) {
+            best_distance = distance;
+            best_unit = unit;
+        }
+    }
+
+    intan_sort_priv.stats.sorts++;
+    if (best_unit == HOSTCOMM_UNIT_UNSORTED) {
+        intan_sort_priv.stats.unsorted++;
+    }
+    intan_sort_priv.stats.cycles += cpu_cycles_get() - start_cycles;
+
+    return best_unit;
+}
+
+/*
+Time the sorter against a full set of templates and log how many snippets it sorts per second, and from that how
+many channels firing at INTAN_SORT_BENCHMARK_SPIKE_RATE_HZ it keeps up with. Leaves the templates and statistics as
+they were.
+*/
+void intan_sort_benchmark(void) {
+
+    // Channel 0 is borrowed for the benchmark
+    intan_sort_unit_t saved_units[INTAN_SORT_MAX_UNITS];
+    uint8_t saved_unit_mask = intan_sort_priv.unit_mask[0];
+    intan_sort_stats_t saved_stats = intan_sort_priv.stats;
+    int16_t snippet[INTAN_SPIKE_SNIPPET_LEN] __aligned(4);
+
+    memcpy(saved_units, intan_sort_priv.units[0], sizeof(saved_units));
+
+    for (int unit = 0; unit < INTAN_SORT_MAX_UNITS; unit++) {
+        for (int i = 0; i < INTAN_SPIKE_SNIPPET_LEN; i++) {
+            intan_sort_priv.units[0][unit].template[i] = (i - INTAN_SPIKE_SNIPPET_PRE) * (unit + 1) * 64;
+        }
+        intan_sort_priv.units[0][unit].max_distance = UINT32_MAX;
+    }
+    intan_sort_priv.unit_mask[0] = BIT_MASK(INTAN_SORT_MAX_UNITS);
+
+    for (int i = 0; i < INTAN_SPIKE_SNIPPET_LEN; i++) {
+        snippet[i] = (i - INTAN_SPIKE_SNIPPET_PRE) * 100;
+    }
+
+    uint32_t start_cycles = cpu_cycles_get();
+    for (int i = 0; i < INTAN_SORT_BENCHMARK_ITERATIONS; i++) {
+        intan_sort_classify(0, snippet);
+    }
+    uint32_t elapsed_cycles = MAX(cpu_cycles_get() - start_cycles, 1);
+
+    memcpy(intan_sort_priv.units[0], saved_units, sizeof(saved_units));
+    intan_sort_priv.unit_mask[0] = saved_unit_mask;
+    intan_sort_priv.stats = saved_stats;
+
+    // Averaged over many sorts, so the cold cache of the first ones hardly counts
+    uint32_t sorts_per_sec = ((uint64_t) INTAN_SORT_BENCHMARK_ITERATIONS * cpu_cycles_per_sec()) / elapsed_cycles;
+
+    LOG_INF("Sorter benchmark: %d sorts/s with %d units, real time for %d channels at %d spikes/s each", sorts_per_sec,
+            INTAN_SORT_MAX_UNITS, sorts_per_sec / INTAN_SORT_BENCHMARK_SPIKE_RATE_HZ,
+            INTAN_SORT_BENCHMARK_SPIKE_RATE_HZ);
+}
+
+// Sorter statistics, they restart after every log
+void intan_sort_log_stats(void) {
+
+    if (intan_sort_priv.stats.sorts == 0) {
+        return;
+    }
+
+    LOG_INF("Sorter: %d sorted, %d unsorted, %d cycles", intan_sort_priv.stats.sorts, intan_sort_priv.stats.unsorted,
+            intan_sort_priv.stats.cycles);
+
+    memset(&intan_sort_priv.stats, 0, sizeof(intan_sort_stats_t));
+}
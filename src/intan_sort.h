@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <kernel.h>
+#include "config.h"
+#include "intan_helper.h"
+
+/*
+Template matching spike sorter. The host uploads up to INTAN_SORT_MAX_UNITS templates per channel, each one a spike
+waveform of INTAN_SPIKE_SNIPPET_LEN samples aligned like the detected snippets (INTAN_SPIKE_SNIPPET_PRE samples
+before the threshold crossing), and a largest distance for a snippet to still count as that unit. A host message
+carries at most 13 template samples (5 bytes of header in 32 bytes), so a template takes several messages.
+
+A detected snippet is assigned the unit of the closest template, by sum of squared differences, or
+HOSTCOMM_UNIT_UNSORTED if it is too far from all of them. On the Cortex-M33 the distance takes two samples per
+instruction with the DSP extension (saturating halfword subtract, dual multiply accumulate into 64 bits).
+*/
+
+typedef struct intan_sort_unit_t {
+    int16_t template[INTAN_SPIKE_SNIPPET_LEN] __aligned(4); // samples are read in pairs
+    uint32_t max_distance;
+} intan_sort_unit_t;
+
+typedef struct intan_sort_stats_t {
+    uint32_t sorts;
+    uint32_t unsorted;  // snippets that matched no template
+    uint32_t cycles;    // spent in intan_sort_classify()
+} intan_sort_stats_t;
+
+typedef struct intan_sort_priv_t {
+    // Templates are only changed by the Intan thread, which also classifies, so no locking
+    intan_sort_unit_t units[NUM_CHANNELS][INTAN_SORT_MAX_UNITS];
+    uint8_t unit_mask[NUM_CHANNELS]; // units with a template in use
+
+    intan_sort_stats_t stats;
+} intan_sort_priv_t;
+
+void intan_sort_init(void);
+int intan_sort_set_template(uint8_t channel, uint8_t unit, uint8_t offset, const int16_t * samples, uint8_t count);
+int intan_sort_set_unit(uint8_t channel, uint8_t unit, bool enable, uint32_t max_distance);
+bool intan_sort_channel_enabled(uint8_t channel);
+uint8_t intan_sort_classify(uint8_t channel, const int16_t * snippet);
+void intan_sort_benchmark(void);
+void intan_sort_log_stats(void);
@@ -0,0 +1,205 @@
+/*
+This file contains spike detection. It runs in the Intan thread on the samples of every frame and fills event packets
+into sample blocks, which go to the host through the sample ring like the raw samples.
+*/
+
+#include <kernel.h>
+#include <logging/log.h>
+#include <stdlib.h>
+
+#include "intan_history.h"
+#include "intan_sort.h"
+#include "intan_spike.h"
+#include "sample_pool.h"
+#include "sample_ring.h"
+
+#define LOG_MODULE_NAME       intan_spike_c
+LOG_MODULE_REGISTER(LOG_MODULE_NAME, LOG_LEVEL_INF);
+
+
+BUILD_ASSERT(INTAN_SPIKE_SNIPPET_PRE < INTAN_SPIKE_SNIPPET_LEN, "Spike snippet must include the crossing");
+BUILD_ASSERT(INTAN_SPIKE_SNIPPET_LEN <= INTAN_HISTORY_DEPTH, "Spike snippet must fit the sample history");
+BUILD_ASSERT(INTAN_SPIKE_WARMUP_SAMPLES >= INTAN_SPIKE_SNIPPET_PRE, "Samples before the first crossing must be in the history");
+
+intan_spike_priv_t intan_spike_priv;
+
+void intan_spike_init(void) {
+
+    for (int type = 0; type < ARRAY_SIZE(intan_spike_priv.packets); type++) {
+        if (intan_spike_priv.packets[type].block) {
+            sample_pool_unref(intan_spike_priv.packets[type].block);
+        }
+    }
+
+    memset(&intan_spike_priv, 0, sizeof(intan_spike_priv_t));
+
+    intan_spike_priv.packets[INTAN_SPIKE_PACKET_SPIKES].capacity = HOSTCOMM_MAX_SPIKES_PER_TRANSMISSION;
+    intan_spike_priv.packets[INTAN_SPIKE_PACKET_UNITS].capacity = HOSTCOMM_MAX_UNITS_PER_TRANSMISSION;
+}
+
+// Hand the event packet being filled to hostcomm
+static void intan_spike_flush_packet(intan_spike_packet_t * packet) {
+
+    sample_block_t * block = packet->block;
+
+    if (block == NULL) {
+        return;
+    }
+
+    packet->block = NULL;
+
+    if (sample_ring_put(block)) {
+        intan_spike_priv.stats.packets++;
+    }
+    else {
+        intan_spike_priv.stats.dropped += block->sample_count;
+        sample_pool_unref(block);
+    }
+}
+
+void intan_spike_flush(void) {
+
+    for (int type = 0; type < ARRAY_SIZE(intan_spike_priv.packets); type++) {
+        intan_spike_flush_packet(&intan_spike_priv.packets[type]);
+    }
+}
+
+// Block with room for one more event of type, NULL if no block is free
+static sample_block_t * intan_spike_packet_block(intan_spike_packet_type_t type, uint32_t frame_index) {
+
+    intan_spike_packet_t * packet = &intan_spike_priv.packets[type];
+
+    if (packet->block == NULL) {
+        packet->block = sample_pool_alloc();
+
+        if (packet->block == NULL) {
+            intan_spike_priv.stats.dropped++;
+            return NULL;
+        }
+
+        packet->block->type = (type == INTAN_SPIKE_PACKET_SPIKES) ? SAMPLE_BLOCK_SPIKES : SAMPLE_BLOCK_UNITS;
+        packet->block->spike_msg.header.first_index = frame_index;
+        packet->first_frame = frame_index;
+    }
+
+    return packet->block;
+}
+
+// Event added to the block of type, send it once it is full
+static void intan_spike_packet_added(intan_spike_packet_type_t type) {
+
+    intan_spike_packet_t * packet = &intan_spike_priv.packets[type];
+
+    intan_spike_priv.stats.spikes++;
+
+    if (++packet->block->sample_count == packet->capacity) {
+        intan_spike_flush_packet(packet);
+    }
+}
+
+// Last sample of the snippet of channel has arrived as sample number history_pos, send it or the unit it belongs to
+static void intan_spike_send(uint8_t tag, intan_spike_channel_t * ch, uint16_t history_pos) {
+
+    uint8_t channel = HOSTCOMM_SAMPLE_TAG_CHANNEL(tag);
+    int16_t snippet[INTAN_SPIKE_SNIPPET_LEN] __aligned(4); // aligned for the sorter
+    intan_history_window_t window;
+
+    if (intan_history_window_ending(channel, history_pos, INTAN_SPIKE_SNIPPET_LEN, &window)) {
+        intan_spike_priv.stats.stale++;
+        return;
+    }
+
+    for (int i = 0; i < INTAN_SPIKE_SNIPPET_LEN; i++) {
+        snippet[i] = intan_history_sample(&window, i);
+    }
+
+    if (!intan_history_window_intact(channel, &window)) {
+        intan_spike_priv.stats.stale++;
+        return;
+    }
+
+    if (intan_sort_channel_enabled(channel)) {
+        uint8_t unit = intan_sort_classify(channel, snippet);
+        sample_block_t * block = intan_spike_packet_block(INTAN_SPIKE_PACKET_UNITS, ch->frame_index);
+
+        if (block) {
+            hostcomm_unit_event_t * event = &block->unit_msg.events[block->sample_count];
+            event->tag = tag;
+            event->frame_index = ch->frame_index;
+            event->unit = unit;
+            intan_spike_packet_added(INTAN_SPIKE_PACKET_UNITS);
+        }
+    }
+    else {
+        sample_block_t * block = intan_spike_packet_block(INTAN_SPIKE_PACKET_SPIKES, ch->frame_index);
+
+        if (block) {
+            hostcomm_spike_t * spike = &block->spike_msg.spikes[block->sample_count];
+            spike->tag = tag;
+            spike->frame_index = ch->frame_index;
+            memcpy(spike->snippet, snippet, sizeof(spike->snippet));
+            intan_spike_packet_added(INTAN_SPIKE_PACKET_SPIKES);
+        }
+    }
+}
+
+static void intan_spike_process_sample(uint8_t tag, uint16_t ac_amp_data, uint16_t history_pos, uint32_t frame_index) {
+
+    intan_spike_channel_t * ch = &intan_spike_priv.channels[HOSTCOMM_SAMPLE_TAG_CHANNEL(tag)];
+    int16_t x = (int32_t) ac_amp_data - INTAN_AC_MID_SCALE;
+    uint16_t magnitude = abs(x);
+
+    if (magnitude > ch->noise_median) {
+        ch->noise_median++;
+    }
+    else if (magnitude < ch->noise_median) {
+        ch->noise_median--;
+    }
+
+    if (ch->capture_count) {
+        if (++ch->capture_count == INTAN_SPIKE_SNIPPET_LEN) {
+            intan_spike_send(tag, ch, history_pos);
+            ch->capture_count = 0;
+        }
+    }
+    else if (ch->warmup < INTAN_SPIKE_WARMUP_SAMPLES) {
+        ch->warmup++;
+    }
+    else if (x < -(int32_t) ((ch->noise_median * INTAN_SPIKE_THRESHOLD_Q8) >> 8)) {
+        ch->frame_index = frame_index;
+
+        // The samples before the crossing are already in the history
+        ch->capture_count = INTAN_SPIKE_SNIPPET_PRE + 1;
+    }
+}
+
+// Run detection over the samples of frame, spikes are timestamped with its frame index
+void intan_spike_process_frame(const intan_frame_t * frame) {
+
+    for (int i = 0; i < frame->num_samples; i++) {
+        intan_spike_process_sample(frame->tags[i], frame->samples[i].ac_amp_data, frame->history_pos[i],
+                                   frame->frame_index);
+    }
+
+    // Spikes are rare, do not let one wait for a full packet for long
+    for (int type = 0; type < ARRAY_SIZE(intan_spike_priv.packets); type++) {
+        intan_spike_packet_t * packet = &intan_spike_priv.packets[type];
+
+        if (packet->block && frame->frame_index - packet->first_frame >= INTAN_SPIKE_FLUSH_FRAMES) {
+            intan_spike_flush_packet(packet);
+        }
+    }
+}
+
+// Spike statistics, they restart after every log
+void intan_spike_log_stats(void) {
+
+    if (intan_spike_priv.stats.spikes == 0 && intan_spike_priv.stats.dropped == 0 && intan_spike_priv.stats.stale == 0) {
+        return;
+    }
+
+    LOG_INF("Spikes: %d detected in %d packets, %d dropped, %d stale", intan_spike_priv.stats.spikes,
+            intan_spike_priv.stats.packets, intan_spike_priv.stats.dropped, intan_spike_priv.stats.stale);
+
+    memset(&intan_spike_priv.stats, 0, sizeof(intan_spike_stats_t));
+}
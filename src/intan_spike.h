@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stdint.h>
+#include "hostcomm.h"
+#include "intan_helper.h"
+
+/*
+Spike detection, so spike recording only has to send spike waveforms instead of every sample.
+
+Every channel tracks the median of its absolute AC signal and detects a spike when the signal falls below
+-INTAN_SPIKE_THRESHOLD_Q8 times that median (the median of |x| is a noise estimate that spikes hardly move). A detected
+spike is sent with its frame index and a snippet of INTAN_SPIKE_SNIPPET_LEN samples, INTAN_SPIKE_SNIPPET_PRE of them
+from before the crossing. The channel does not detect again until its snippet is complete. Channels with sorter
+templates (intan_sort.h) send the unit the snippet matched instead of the snippet.
+
+Detection runs on the re-referenced and filtered samples of the frame, the snippet is read from the sample history
+(intan_history.h) once its last sample has arrived, so it is the calibrated signal before re-referencing and filtering.
+
+The median is tracked with the frugal streaming estimate: it moves up one count for every |x| above it and down one
+for every |x| below it. No sample window to keep or sort, and it follows slow changes of the noise level.
+*/
+
+typedef struct intan_spike_channel_t {
+    uint16_t noise_median;                     // running median of |x|, ADC counts
+    uint16_t warmup;                           // samples seen until the estimate is settled
+    uint8_t capture_count;                     // samples of the snippet seen so far, 0 = not capturing
+    uint32_t frame_index;                      // of the crossing
+} intan_spike_channel_t;
+
+// Event packet being filled, one for spikes and one for sorted spikes
+typedef enum intan_spike_packet_type_t {
+    INTAN_SPIKE_PACKET_SPIKES = 0,
+    INTAN_SPIKE_PACKET_UNITS,
+    INTAN_SPIKE_NUM_PACKETS,
+} intan_spike_packet_type_t;
+
+typedef struct intan_spike_packet_t {
+    struct sample_block_t * block;             // NULL until the next event
+    uint32_t first_frame;                      // frame index of the oldest event in block
+    uint8_t capacity;
+} intan_spike_packet_t;
+
+typedef struct intan_spike_stats_t {
+    uint32_t spikes;
+    uint32_t packets;
+    uint32_t dropped;  // events lost because no sample block was free
+    uint32_t stale;    // snippets the sample history had already overwritten
+} intan_spike_stats_t;
+
+typedef struct intan_spike_priv_t {
+    intan_spike_channel_t channels[NUM_CHANNELS];
+
+    intan_spike_packet_t packets[INTAN_SPIKE_NUM_PACKETS];
+
+    intan_spike_stats_t stats;
+} intan_spike_priv_t;
+
+void intan_spike_init(void);
+void intan_spike_process_frame(const intan_frame_t * frame);
+void intan_spike_flush(void);
+void intan_spike_log_stats(void);
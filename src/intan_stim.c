@@ -0,0 +1,306 @@
+/*
+This file contains the stimulation sequencer.
+
+Programs are set and started from the Intan thread, intan_stim_tick() runs in completion context once per frame.
+The state of a channel is worked out from the frame index alone (offset from its start frame), so a late or missed
+frame never shifts the rest of the train.
+*/
+
+#include <kernel.h>
+#include <logging/log.h>
+
+#include "intan.h"
+#include "intan_regs.h"
+#include "intan_stim.h"
+
+#define LOG_MODULE_NAME       intan_stim_c
+LOG_MODULE_REGISTER(LOG_MODULE_NAME, LOG_LEVEL_INF);
+
+#define INTAN_STIM_MAG_TRIM_MID  0x8000 // current trim at mid scale, magnitude in the low byte
+
+intan_stim_priv_t intan_stim_priv;
+
+void intan_stim_init(void) {
+    memset(&intan_stim_priv, 0, sizeof(intan_stim_priv_t));
+}
+
+/*
+Load the program of a channel. A running train finishes its pulse, then starts over with the new program once the
+sequencer has written its magnitudes (see intan_stim.h).
+*/
+int intan_stim_set_program(uint8_t channel, const intan_stim_program_t * program) {
+
+    uint32_t pulse_ticks = program->first_phase_ticks + program->interphase_ticks + program->second_phase_ticks +
+                           program->recovery_ticks;
+
+    if (channel >= NUM_CHANNELS || program->first_phase_ticks == 0 || program->second_phase_ticks == 0 ||
+        program->period_ticks < pulse_ticks) {
+        return -EINVAL;
+    }
+
+    k_spinlock_key_t key = k_spin_lock(&intan_stim_priv.lock);
+    intan_stim_priv.pending[channel] = *program;
+    intan_stim_priv.magnitudes_left[channel] = INTAN_STIM_MAG_NEG | INTAN_STIM_MAG_POS;
+    intan_stim_priv.pending_mask |= (1 << channel);
+    k_spin_unlock(&intan_stim_priv.lock, key);
+
+    return 0;
+}
+
+// Start the programs of the channels in channel_mask, their first pulse begins with frame start_frame
+int intan_stim_start(uint16_t channel_mask, uint32_t start_frame) {
+
+    k_spinlock_key_t key = k_spin_lock(&intan_stim_priv.lock);
+
+    for (int channel = 0; channel < NUM_CHANNELS; channel++) {
+        uint16_t bit = 1 << channel;
+
+        bool loaded = intan_stim_priv.programs[channel].period_ticks || (intan_stim_priv.pending_mask & bit);
+
+        if ((channel_mask & bit) && loaded) {
+            intan_stim_priv.start_frame[channel] = start_frame;
+            intan_stim_priv.active_mask |= (1 << channel);
+        }
+    }
+
+    k_spin_unlock(&intan_stim_priv.lock, key);
+
+    return 0;
+}
+
+// Stop the channels in channel_mask, a pulse in progress is cut off with the next frame
+void intan_stim_stop(uint16_t channel_mask) {
+
+    k_spinlock_key_t key = k_spin_lock(&intan_stim_priv.lock);
+    intan_stim_priv.active_mask &= ~channel_mask;
+    k_spin_unlock(&intan_stim_priv.lock, key);
+}
+
+// Append a write of reg if the chip does not have the value yet
+static uint8_t intan_stim_add_write(uint32_t * commands, uint8_t num_commands, uint8_t reg, uint16_t value) {
+
+    uint32_t command = INTAN_WRITE(reg, value, 0, 0);
+
+    if (intan_regs_write_needed(command)) {
+        commands[num_commands++] = command;
+    }
+    return num_commands;
+}
+
+// Append the magnitude writes of a switching channel that still fit, and switch it once both are out
+static uint8_t intan_stim_add_magnitudes(uint32_t frame, uint8_t channel, uint32_t * commands, uint8_t num_commands,
+                                         uint8_t max_commands) {
+
+    uint16_t bit = 1 << channel;
+    uint16_t magnitude = INTAN_STIM_MAG_TRIM_MID | intan_stim_priv.pending[channel].amplitude;
+
+    while (intan_stim_priv.magnitudes_left[channel] && num_commands < max_commands) {
+        if (intan_stim_priv.magnitudes_left[channel] & INTAN_STIM_MAG_NEG) {
+            num_commands = intan_stim_add_write(commands, num_commands, REG_NEG_STIM_CURRENT_MAG_TRGD_BASE + channel,
+                                                magnitude);
+            intan_stim_priv.magnitudes_left[channel] &= ~INTAN_STIM_MAG_NEG;
+        }
+        else {
+            num_commands = intan_stim_add_write(commands, num_commands, REG_POS_STIM_CURRENT_MAG_TRGD_BASE + channel,
+                                                magnitude);
+            intan_stim_priv.magnitudes_left[channel] &= ~INTAN_STIM_MAG_POS;
+        }
+    }
+
+    if (intan_stim_priv.magnitudes_left[channel]) {
+        return num_commands;
+    }
+
+    // The U flag of this frame latches the magnitudes, the new program starts with the next frame
+    intan_stim_priv.programs[channel] = intan_stim_priv.pending[channel];
+    intan_stim_priv.pending_mask &= ~bit;
+    intan_stim_priv.switching_mask &= ~bit;
+
+    if ((intan_stim_priv.active_mask & bit) && (int32_t) (intan_stim_priv.start_frame[channel] - (frame + 1)) < 0) {
+        intan_stim_priv.start_frame[channel] = frame + 1;
+    }
+
+    return num_commands;
+}
+
+/*
+Not all writes fit the aux slots of this frame, the rest goes next frame. Switching channels off goes first, the
+recovery switch only closes on channels that are really off and stimulation only starts where it is open and the
+polarity is right, so a partial update never stimulates the wrong way.
+*/
+static uint8_t intan_stim_update_partial(uint32_t * commands, uint8_t max_commands, uint16_t stim_on, uint16_t polarity,
+                                         uint16_t recovery) {
+
+    uint8_t num_commands = 0;
+
+    uint16_t stim_off = stim_on & intan_stim_priv.stim_on_mask;
+    if (stim_off != intan_stim_priv.stim_on_mask && num_commands < max_commands) {
+        num_commands = intan_stim_add_write(commands, num_commands, REG_STIM_ON_TRGD, stim_off);
+        intan_stim_priv.stim_on_mask = stim_off;
+    }
+
+    if (polarity != intan_stim_priv.polarity_mask && num_commands < max_commands) {
+        num_commands = intan_stim_add_write(commands, num_commands, REG_STIM_POLARITY_TRGD, polarity);
+        intan_stim_priv.polarity_mask = polarity;
+    }
+
+    recovery &= ~intan_stim_priv.stim_on_mask;
+    if (recovery != intan_stim_priv.recovery_mask && num_commands < max_commands) {
+        num_commands = intan_stim_add_write(commands, num_commands, REG_CHARGE_RECOVERY_SWTICH_TRGD, recovery);
+        intan_stim_priv.recovery_mask = recovery;
+    }
+
+    stim_on &= ~intan_stim_priv.recovery_mask;
+    stim_on &= ~(polarity ^ intan_stim_priv.polarity_mask);
+    if (stim_on != intan_stim_priv.stim_on_mask && num_commands < max_commands) {
+        num_commands = intan_stim_add_write(commands, num_commands, REG_STIM_ON_TRGD, stim_on);
+        intan_stim_priv.stim_on_mask = stim_on;
+    }
+
+    return num_commands;
+}
+
+// Channels switched on by the last write of the stim on register
+uint16_t intan_stim_on_mask(void) {
+    return intan_stim_priv.stim_on_mask;
+}
+
+/*
+Register writes for frame, at most max_commands of them, returns how many. Called from completion context right
+before the frame is armed.
+*/
+uint8_t intan_stim_tick(uint32_t frame, uint32_t * commands, uint8_t max_commands) {
+
+    uint16_t stim_on = 0;
+    uint16_t polarity = 0;
+    uint16_t recovery = 0;
+    uint16_t in_pulse = 0;
+    uint8_t num_commands = 0;
+
+    k_spinlock_key_t key = k_spin_lock(&intan_stim_priv.lock);
+
+    // The chip lost registers, no U flag may latch a triggered register before they are all written back
+    if (intan_regs_recovering()) {
+        intan_stim_priv.stats.held_frames++;
+        intan_stim_priv.resync = true;
+        k_spin_unlock(&intan_stim_priv.lock, key);
+        return 0;
+    }
+
+    for (int channel = 0; channel < NUM_CHANNELS; channel++) {
+
+        uint16_t bit = 1 << channel;
+        const intan_stim_program_t * program = &intan_stim_priv.programs[channel];
+        int32_t offset = frame - intan_stim_priv.start_frame[channel];
+
+        // Switching channels stay off, a channel that only has a pending program has nothing to run yet
+        if (!(intan_stim_priv.active_mask & bit) || offset < 0 || (intan_stim_priv.switching_mask & bit) ||
+            program->period_ticks == 0) {
+            continue;
+        }
+
+        uint32_t pulse = offset / program->period_ticks;
+        uint32_t t = offset % program->period_ticks;
+
+        if (pulse >= program->num_pulses) {
+            intan_stim_priv.active_mask &= ~bit;
+            continue;
+        }
+
+        if (t == 0) {
+            intan_stim_priv.stats.pulses++;
+        }
+
+        if (t < program->first_phase_ticks + program->interphase_ticks + program->second_phase_ticks +
+                program->recovery_ticks) {
+            in_pulse |= bit;
+        }
+
+        if (t < program->first_phase_ticks) {
+            stim_on |= bit;
+            polarity |= program->anodic_first ? bit : 0;
+            continue;
+        }
+        t -= program->first_phase_ticks;
+
+        if (t < program->interphase_ticks) {
+            continue;
+        }
+        t -= program->interphase_ticks;
+
+        if (t < program->second_phase_ticks) {
+            stim_on |= bit;
+            polarity |= program->anodic_first ? 0 : bit;
+            continue;
+        }
+        t -= program->second_phase_ticks;
+
+        if (t < program->recovery_ticks) {
+            recovery |= bit;
+        }
+    }
+
+    // Channels that are not stimulating keep their polarity, no need to write it
+    polarity = (polarity & stim_on) | (intan_stim_priv.polarity_mask & ~stim_on);
+
+    uint8_t needed = (stim_on != intan_stim_priv.stim_on_mask) + (polarity != intan_stim_priv.polarity_mask) +
+                     (recovery != intan_stim_priv.recovery_mask);
+
+    // All writes of the frame take effect together, the order only matters when some of them have to wait
+    if (needed <= max_commands) {
+        if (recovery != intan_stim_priv.recovery_mask) {
+            num_commands = intan_stim_add_write(commands, num_commands, REG_CHARGE_RECOVERY_SWTICH_TRGD, recovery);
+            intan_stim_priv.recovery_mask = recovery;
+        }
+        if (polarity != intan_stim_priv.polarity_mask) {
+            num_commands = intan_stim_add_write(commands, num_commands, REG_STIM_POLARITY_TRGD, polarity);
+            intan_stim_priv.polarity_mask = polarity;
+        }
+        if (stim_on != intan_stim_priv.stim_on_mask) {
+            num_commands = intan_stim_add_write(commands, num_commands, REG_STIM_ON_TRGD, stim_on);
+            intan_stim_priv.stim_on_mask = stim_on;
+        }
+    }
+    else {
+        num_commands = intan_stim_update_partial(commands, max_commands, stim_on, polarity, recovery);
+        intan_stim_priv.stats.deferred_writes++;
+    }
+
+    // New programs take over between pulses, their magnitudes go in whatever slots the masks left
+    intan_stim_priv.switching_mask |= intan_stim_priv.pending_mask & ~in_pulse;
+
+    for (uint16_t channels = intan_stim_priv.switching_mask; channels && num_commands < max_commands;
+         channels &= channels - 1) {
+        num_commands = intan_stim_add_magnitudes(frame, __builtin_ctz(channels), commands, num_commands, max_commands);
+    }
+
+    // After a restore the chip holds the sequencer's values, but only a U flag latches them
+    if (intan_stim_priv.resync && num_commands == 0 && max_commands > 0) {
+        commands[num_commands++] = INTAN_WRITE(REG_STIM_ON_TRGD, intan_stim_priv.stim_on_mask, 0, 0);
+        intan_regs_write_needed(commands[0]);
+    }
+    if (num_commands) {
+        intan_stim_priv.resync = false;
+    }
+
+    k_spin_unlock(&intan_stim_priv.lock, key);
+
+    // All writes of the frame take effect together on the last one
+    if (num_commands) {
+        commands[num_commands - 1] |= (1 << INTAN_WRITE_U_FLAG_OFFSET);
+    }
+
+    return num_commands;
+}
+
+void intan_stim_log_stats(void) {
+
+    intan_stim_stats_t stats;
+
+    k_spinlock_key_t key = k_spin_lock(&intan_stim_priv.lock);
+    stats = intan_stim_priv.stats;
+    k_spin_unlock(&intan_stim_priv.lock, key);
+
+    LOG_INF("Stim sequencer: active 0x%x, %d pulses, %d deferred writes, %d frames held for a register restore",
+            intan_stim_priv.active_mask, stats.pulses, stats.deferred_writes, stats.held_frames);
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <kernel.h>
+#include "intan_helper.h"
+
+/*
+Stimulation sequencer. Every channel runs its own train of biphasic pulses, all times are in frames (sample clock
+ticks). One pulse:
+
+    | first phase | interphase gap | second phase | charge recovery | ... idle until the next pulse period
+      (stim on)      (stim off)       (stim on,      (recovery switch
+                                      polarity       closed)
+                                      reversed)
+
+Right before a frame is armed, the sequencer works out the stim on, polarity and charge recovery masks of all channels
+for that frame. Registers that change are written in the frame's first aux slots. Only the last of these writes
+carries the U flag, so all of them take effect together at the same point of the frame.
+
+A new program does not replace the one of its channel right away. The channel finishes the pulse it is in, then stays
+off while the sequencer writes the new magnitudes in aux slots the masks left free. The frame with the last of them
+also carries the U flag, and the channel starts over with the new program in the frame after. So a program never runs
+with the magnitudes of the one before it, however few aux slots there are.
+*/
+
+typedef struct intan_stim_program_t {
+    uint16_t first_phase_ticks;
+    uint16_t interphase_ticks;
+    uint16_t second_phase_ticks;
+    uint16_t recovery_ticks;    // charge recovery switch closed after the second phase, 0 = none
+    uint16_t period_ticks;      // pulse to pulse
+    uint16_t num_pulses;        // pulses in the train
+    uint8_t amplitude;          // current magnitude register value, both phases
+    bool anodic_first;          // first phase with positive current
+} intan_stim_program_t;
+
+#define INTAN_STIM_MAG_NEG  (1 << 0)
+#define INTAN_STIM_MAG_POS  (1 << 1)
+
+typedef struct intan_stim_stats_t {
+    uint32_t pulses;
+    uint32_t deferred_writes;   // writes that did not fit the aux slots of their frame and went one frame late
+    uint32_t held_frames;       // frames without stimulation writes while the chip registers were restored
+} intan_stim_stats_t;
+
+typedef struct intan_stim_priv_t {
+    struct k_spinlock lock;
+
+    intan_stim_program_t programs[NUM_CHANNELS];
+    uint32_t start_frame[NUM_CHANNELS];
+    uint16_t active_mask;
+
+    // Loaded programs waiting for their magnitudes, switching channels are held off until those are written
+    intan_stim_program_t pending[NUM_CHANNELS];
+    uint8_t magnitudes_left[NUM_CHANNELS];  // INTAN_STIM_MAG_NEG | INTAN_STIM_MAG_POS still to write
+    uint16_t pending_mask;
+    uint16_t switching_mask;
+
+    bool resync;    // registers were restored, the next frame must latch them with a U flag
+
+    // Register values as last written by the sequencer
+    uint16_t stim_on_mask;
+    uint16_t polarity_mask;
+    uint16_t recovery_mask;
+
+    intan_stim_stats_t stats;
+} intan_stim_priv_t;
+
+void intan_stim_init(void);
+int intan_stim_set_program(uint8_t channel, const intan_stim_program_t * program);
+int intan_stim_start(uint16_t channel_mask, uint32_t start_frame);
+void intan_stim_stop(uint16_t channel_mask);
+uint16_t intan_stim_on_mask(void);
+uint8_t intan_stim_tick(uint32_t frame, uint32_t * commands, uint8_t max_commands);
+void intan_stim_log_stats(void);
@@ -0,0 +1,171 @@
+/*
+This file contains the closed-loop stimulation trigger.
+
+intan_trigger_sample() and intan_trigger_frame_armed() run in completion context, configuration and event logging in
+the Intan thread. The configuration is only changed under the lock, which keeps completion context out, so the sample
+path reads it without locking.
+*/
+
+#include <kernel.h>
+#include <logging/log.h>
+
+#include "config.h"
+#include "intan_stim.h"
+#include "intan_trigger.h"
+
+#define LOG_MODULE_NAME       intan_trigger_c
+LOG_MODULE_REGISTER(LOG_MODULE_NAME, LOG_LEVEL_INF);
+
+
+K_MSGQ_DEFINE(intan_trigger_event_msgq, sizeof(intan_trigger_event_t), INTAN_TRIGGER_EVENT_QUEUE_DEPTH, 4);
+
+intan_trigger_priv_t intan_trigger_priv;
+
+void intan_trigger_init(void) {
+    memset(&intan_trigger_priv, 0, sizeof(intan_trigger_priv_t));
+    k_msgq_purge(&intan_trigger_event_msgq);
+}
+
+// Set or, with a stim_mask of 0, clear the trigger of channel
+int intan_trigger_configure(uint8_t channel, const intan_trigger_config_t * config) {
+
+    if (channel >= NUM_CHANNELS) {
+        return -EINVAL;
+    }
+
+    k_spinlock_key_t key = k_spin_lock(&intan_trigger_priv.lock);
+
+    intan_trigger_priv.config[channel] = *config;
+    intan_trigger_priv.pending_mask &= ~(1 << channel);
+    intan_trigger_priv.in_refractory_mask &= ~(1 << channel);
+
+    // The first sample after arming only primes last_sample, it never counts as a crossing
+    intan_trigger_priv.primed_mask &= ~(1 << channel);
+
+    if (config->stim_mask) {
+        intan_trigger_priv.enabled_mask |= (1 << channel);
+    }
+    else {
+        intan_trigger_priv.enabled_mask &= ~(1 << channel);
+    }
+
+    k_spin_unlock(&intan_trigger_priv.lock, key);
+
+    return 0;
+}
+
+// A CONVERT result of channel was decoded in frame. Fires the stimulation on a threshold crossing.
+void intan_trigger_sample(uint8_t channel, uint16_t ac_amp_data, uint32_t frame) {
+
+    uint16_t bit = 1 << channel;
+
+    if (!(intan_trigger_priv.enabled_mask & bit)) {
+        return;
+    }
+
+    const intan_trigger_config_t * config = &intan_trigger_priv.config[channel];
+    int16_t sample = (int32_t) ac_amp_data - INTAN_AC_MID_SCALE;
+    int16_t last_sample = intan_trigger_priv.last_sample[channel];
+    bool crossed;
+
+    intan_trigger_priv.last_sample[channel] = sample;
+
+    if (!(intan_trigger_priv.primed_mask & bit)) {
+        intan_trigger_priv.primed_mask |= bit;
+        return;
+    }
+
+    if (config->falling) {
+        crossed = last_sample >= config->threshold && sample < config->threshold;
+    }
+    else {
+        crossed = last_sample <= config->threshold && sample > config->threshold;
+    }
+
+    if (!crossed) {
+        return;
+    }
+
+    if ((intan_trigger_priv.in_refractory_mask & bit) &&
+        frame - intan_trigger_priv.last_event_frame[channel] < config->refractory_frames) {
+        intan_trigger_priv.stats.suppressed++;
+        return;
+    }
+
+    intan_trigger_priv.last_event_frame[channel] = frame;
+    intan_trigger_priv.in_refractory_mask |= bit;
+
+    intan_trigger_priv.pending[channel] = (intan_trigger_event_t) {
+        .channel = channel,
+        .sample = sample,
+        .detect_frame = frame,
+    };
+    intan_trigger_priv.pending_mask |= bit;
+    intan_trigger_priv.stats.events++;
+
+    // The next frame is armed right after this one is decoded, the sequencer puts the stimulation into its aux slots
+    intan_stim_start(config->stim_mask, frame + 1);
+}
+
+// Frame was armed with the stimulation channels in stim_on_mask switched on, completes the events that were waiting for it
+void intan_trigger_frame_armed(uint32_t frame, uint16_t stim_on_mask) {
+
+    for (uint16_t pending = intan_trigger_priv.pending_mask; pending; pending &= pending - 1) {
+
+        uint8_t channel = __builtin_ctz(pending);
+        intan_trigger_event_t * event = &intan_trigger_priv.pending[channel];
+        uint32_t latency = frame - event->detect_frame;
+
+        if (stim_on_mask & intan_trigger_priv.config[channel].stim_mask) {
+            event->stim_frame = frame;
+
+            intan_trigger_priv.stats.stimulated++;
+            intan_trigger_priv.stats.latency_sum += latency;
+            if (latency > intan_trigger_priv.stats.latency_max) {
+                intan_trigger_priv.stats.latency_max = latency;
+            }
+            if (k_msgq_put(&intan_trigger_event_msgq, event, K_NO_WAIT) != 0) {
+                intan_trigger_priv.stats.dropped++;
+            }
+        }
+        else if (latency < INTAN_TRIGGER_MAX_LATENCY_FRAMES) {
+            continue;
+        }
+        else {
+            intan_trigger_priv.stats.missed++;
+        }
+
+        intan_trigger_priv.pending_mask &= ~(1 << channel);
+    }
+}
+
+// Log the events completion context has recorded since the last call
+void intan_trigger_process_events(void) {
+
+    intan_trigger_event_t event;
+
+    while (k_msgq_get(&intan_trigger_event_msgq, &event, K_NO_WAIT) == 0) {
+        LOG_DBG("Trigger on channel %d (sample %d) in frame %u, stimulation in frame %u, latency %u frames",
+                event.channel, event.sample, event.detect_frame, event.stim_frame,
+                event.stim_frame - event.detect_frame);
+    }
+}
+
+// Trigger statistics, they restart after every log
+void intan_trigger_log_stats(void) {
+
+    intan_trigger_stats_t stats;
+
+    k_spinlock_key_t key = k_spin_lock(&intan_trigger_priv.lock);
+    stats = intan_trigger_priv.stats;
+    memset(&intan_trigger_priv.stats, 0, sizeof(intan_trigger_priv.stats));
+    k_spin_unlock(&intan_trigger_priv.lock, key);
+
+    if (stats.events == 0 && stats.suppressed == 0) {
+        return;
+    }
+
+    LOG_INF("Trigger: %d events, %d suppressed, %d missed, %d dropped, latency avg %d max %d frames", stats.events,
+            stats.suppressed, stats.missed, stats.dropped, stats.stimulated ? stats.latency_sum / stats.stimulated : 0,
+            stats.latency_max);
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <kernel.h>
+#include "intan_helper.h"
+
+/*
+Closed-loop stimulation trigger. A channel with a trigger watches its AC samples as they are decoded in completion
+context. When a sample crosses the threshold, the stimulation programs of the channels in stim_mask (loaded with
+intan_stim_set_program()) are started with the very next frame, no round trip to the host. The trigger then stays
+quiet for refractory_frames frames.
+
+Every event records the frame the crossing was decoded in and the frame the stimulation went out in, the difference is
+the detection to stimulation latency in frames. Events are handed to the Intan thread, which logs them.
+*/
+
+#define INTAN_TRIGGER_EVENT_QUEUE_DEPTH  8
+
+typedef struct intan_trigger_config_t {
+    int16_t threshold;           // AC sample relative to mid scale, in ADC counts
+    bool falling;                // trigger when the signal goes below threshold instead of above
+    uint16_t refractory_frames;  // frames after an event in which the trigger ignores crossings
+    uint16_t stim_mask;          // stimulation channels started by the trigger, 0 = trigger off
+} intan_trigger_config_t;
+
+typedef struct intan_trigger_event_t {
+    uint8_t channel;             // channel that crossed the threshold
+    int16_t sample;
+    uint32_t detect_frame;       // frame the crossing was decoded in
+    uint32_t stim_frame;         // frame the first stimulation write went out in
+} intan_trigger_event_t;
+
+typedef struct intan_trigger_stats_t {
+    uint32_t events;
+    uint32_t stimulated;         // events whose stimulation went out
+    uint32_t suppressed;         // crossings ignored in the refractory period
+    uint32_t missed;             // events whose stimulation did not go out within INTAN_TRIGGER_MAX_LATENCY_FRAMES
+    uint32_t dropped;            // events lost because the thread did not pick them up
+    uint32_t latency_sum;        // frames from detection to stimulation
+    uint32_t latency_max;
+} intan_trigger_stats_t;
+
+typedef struct intan_trigger_priv_t {
+    struct k_spinlock lock;
+
+    intan_trigger_config_t config[NUM_CHANNELS];
+    uint16_t enabled_mask;
+
+    int16_t last_sample[NUM_CHANNELS];
+    uint16_t primed_mask;        // channels with a last_sample since they were configured
+    uint32_t last_event_frame[NUM_CHANNELS];
+    uint16_t in_refractory_mask;
+
+    // Events waiting for their stimulation to go out
+    uint16_t pending_mask;
+    intan_trigger_event_t pending[NUM_CHANNELS];
+
+    intan_trigger_stats_t stats;
+} intan_trigger_priv_t;
+
+void intan_trigger_init(void);
+int intan_trigger_configure(uint8_t channel, const intan_trigger_config_t * config);
+void intan_trigger_sample(uint8_t channel, uint16_t ac_amp_data, uint32_t frame);
+void intan_trigger_frame_armed(uint32_t frame, uint16_t stim_on_mask);
+void intan_trigger_process_events(void);
+void intan_trigger_log_stats(void);
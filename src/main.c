@@ -30,6 +30,7 @@
 #include "intan.h"
 #include "intan_helper.h"
 #include "main.h"
+#include "sample_ring.h"
 #include "spi.h"
 #include "usb.h"
 
@@ -37,7 +38,6 @@
 LOG_MODULE_REGISTER(LOG_MODULE_NAME);
 
 main_priv_t main_priv;
-extern struct k_msgq hostcomm_msgq;
 
 void main(void)
 {
@@ -48,7 +48,10 @@ void main(void)
 
 	// TODO: create a new initialization function for this.
 	memset(&main_priv, 0, sizeof(main_priv_t));
-	main_priv.sample_delay_us = DEFAULT_SAMPLE_DELAY_US;
+	main_priv.sample_delay_us = DEFAULT_SAMPLE_PERIOD_US;
+
+	// Must be ready before the Intan and hostcomm threads start exchanging samples
+	sample_ring_init();
 
 	// Due to hardware bug, CPU needs to run at 128mhz for high speed SPI. TODO: Remove this because this is only needed on older revisions of hardware.
 	// nrfx_clock_divider_set(NRF_CLOCK_DOMAIN_HFCLK, NRF_CLOCK_HFCLK_DIV_1);
@@ -0,0 +1,237 @@
+/*
+This file contains the hardware sample clock that paces the Intan frames.
+
+The clock TIMER clears itself every frame period. Its COMPARE0 event is connected to the SPI frame trigger
+(see spi_frame_trigger_connect()), so an armed frame starts on the exact tick without any CPU involvement.
+The end of every frame is captured into CC1 of the same TIMER through DPPI. Because the SPI transfer itself always
+takes the same time, the variation of that capture from frame to frame is the jitter of the sample instants.
+A tick that finds no frame armed (or the previous frame still running) is counted as an overrun, that frame is missed.
+*/
+
+#include <devicetree.h>
+#include <kernel.h>
+#include <logging/log.h>
+#include <nrfx_dppi.h>
+#include <helpers/nrfx_gppi.h>
+
+#include "sample_clock.h"
+#include "spi.h"
+
+#define LOG_MODULE_NAME       sample_clock_c
+LOG_MODULE_REGISTER(LOG_MODULE_NAME, LOG_LEVEL_INF);
+
+#define SAMPLE_CLOCK_NODE     DT_NODELABEL(UTIL_CAT(timer, SAMPLE_CLOCK_TIMER))
+
+sample_clock_priv_t sample_clock_priv;
+
+static const nrfx_timer_t sample_timer = NRFX_TIMER_INSTANCE(SAMPLE_CLOCK_TIMER);
+
+
+// Called from interrupt context on every clock tick, the armed frame (if any) has already been started by hardware
+static void sample_clock_tick_handler(nrf_timer_event_t event_type, void * p_context) {
+
+    if (event_type != NRF_TIMER_EVENT_COMPARE0) {
+        return;
+    }
+
+    sample_clock_priv.stats.ticks++;
+
+    if (spi_frame_trigger_notify()) {
+        sample_clock_priv.stats.frames++;
+    }
+    else {
+        sample_clock_priv.stats.overruns++;
+    }
+}
+
+int sample_clock_init(void) {
+
+    nrfx_timer_config_t timer_cfg = NRFX_TIMER_DEFAULT_CONFIG;
+
+    if (sample_clock_priv.initialized) {
+        return 0;
+    }
+
+    memset(&sample_clock_priv, 0, sizeof(sample_clock_priv_t));
+
+    timer_cfg.frequency = NRF_TIMER_FREQ_16MHz;
+    timer_cfg.mode = NRF_TIMER_MODE_TIMER;
+    timer_cfg.bit_width = NRF_TIMER_BIT_WIDTH_32;
+
+    IRQ_CONNECT(DT_IRQN(SAMPLE_CLOCK_NODE), DT_IRQ(SAMPLE_CLOCK_NODE, priority), nrfx_isr,
+                NRFX_CONCAT_3(nrfx_timer_, SAMPLE_CLOCK_TIMER, _irq_handler), 0);
+
+    if (nrfx_timer_init(&sample_timer, &timer_cfg, sample_clock_tick_handler) != NRFX_SUCCESS) {
+        LOG_ERR("Could not initialize sample clock timer");
+        return -EIO;
+    }
+
+    if (nrfx_dppi_channel_alloc(&sample_clock_priv.end_capture_ppi_channel) != NRFX_SUCCESS) {
+        LOG_ERR("Could not allocate sample clock DPPI channel");
+        return -EBUSY;
+    }
+
+    // Tick starts the armed SPI frame, frame end is captured into CC1
+    spi_frame_trigger_connect(nrfx_timer_compare_event_address_get(&sample_timer, NRF_TIMER_CC_CHANNEL0));
+    nrfx_gppi_channel_endpoints_setup(sample_clock_priv.end_capture_ppi_channel, spi_frame_end_event_get(),
+                                      nrfx_timer_task_address_get(&sample_timer, NRF_TIMER_TASK_CAPTURE1));
+    nrfx_dppi_channel_enable(sample_clock_priv.end_capture_ppi_channel);
+
+    sample_clock_priv.initialized = true;
+
+    return 0;
+}
+
+// A period of at least one tick that the timer can count to
+static bool sample_clock_period_valid(uint32_t period_ns) {
+
+    uint64_t period_ticks = SAMPLE_CLOCK_NS_TO_TICKS(period_ns);
+
+    return period_ticks > 0 && period_ticks <= SAMPLE_CLOCK_MAX_TICKS;
+}
+
+// Start ticking once every period_ns. Statistics are reset on every start.
+int sample_clock_start(uint32_t period_ns) {
+
+    if (!sample_clock_priv.initialized || !sample_clock_period_valid(period_ns)) {
+        return -EINVAL;
+    }
+
+    sample_clock_stop();
+
+    memset(&sample_clock_priv.stats, 0, sizeof(sample_clock_stats_t));
+    sample_clock_priv.stats.period_ns = period_ns;
+    sample_clock_priv.has_reference = false;
+
+    nrfx_timer_clear(&sample_timer);
+    nrfx_timer_extended_compare(&sample_timer, NRF_TIMER_CC_CHANNEL0, SAMPLE_CLOCK_NS_TO_TICKS(period_ns),
+                                NRF_TIMER_SHORT_COMPARE0_CLEAR_MASK, true);
+    nrfx_timer_enable(&sample_timer);
+
+    sample_clock_priv.running = true;
+
+    LOG_INF("Sample clock started, frame period %d ns", period_ns);
+
+    return 0;
+}
+
+/*
+Change the period of the running clock without stopping it, meant to be called right after a frame has finished.
+If the timer is already past the new period it is cleared, so that one interval is irregular instead of the timer
+running all the way around. Jitter reference and statistics are restarted since the frame layout changed.
+*/
+int sample_clock_set_period(uint32_t period_ns) {
+
+    uint32_t period_ticks = SAMPLE_CLOCK_NS_TO_TICKS(period_ns);
+
+    if (!sample_clock_priv.running) {
+        return sample_clock_start(period_ns);
+    }
+
+    if (!sample_clock_period_valid(period_ns)) {
+        return -EINVAL;
+    }
+
+    if (period_ns == sample_clock_priv.stats.period_ns) {
+        return 0;
+    }
+
+    unsigned key = irq_lock();
+
+    nrfx_timer_extended_compare(&sample_timer, NRF_TIMER_CC_CHANNEL0, period_ticks,
+                                NRF_TIMER_SHORT_COMPARE0_CLEAR_MASK, true);
+    if (nrfx_timer_capture(&sample_timer, NRF_TIMER_CC_CHANNEL2) >= period_ticks) {
+        nrfx_timer_clear(&sample_timer);
+    }
+
+    memset(&sample_clock_priv.stats, 0, sizeof(sample_clock_stats_t));
+    sample_clock_priv.stats.period_ns = period_ns;
+    sample_clock_priv.has_reference = false;
+
+    irq_unlock(key);
+
+    return 0;
+}
+
+void sample_clock_stop(void) {
+
+    if (sample_clock_priv.running) {
+        nrfx_timer_disable(&sample_timer);
+        sample_clock_priv.running = false;
+    }
+}
+
+bool sample_clock_is_running(void) {
+    return sample_clock_priv.running;
+}
+
+static uint8_t sample_clock_jitter_bin(uint32_t jitter_ticks) {
+
+    uint8_t bin = 0;
+
+    while (jitter_ticks && bin < (SAMPLE_CLOCK_JITTER_HIST_BINS - 1)) {
+        jitter_ticks >>= 1;
+        bin++;
+    }
+    return bin;
+}
+
+// Call after each clocked frame has finished to add its timing to the jitter histogram
+void sample_clock_frame_done(void) {
+
+    uint32_t end_ticks = nrfx_timer_capture_get(&sample_timer, NRF_TIMER_CC_CHANNEL1);
+    uint32_t jitter_ticks;
+
+    if (!sample_clock_priv.has_reference) {
+        sample_clock_priv.reference_end_ticks = end_ticks;
+        sample_clock_priv.has_reference = true;
+    }
+
+    if (end_ticks > sample_clock_priv.reference_end_ticks) {
+        jitter_ticks = end_ticks - sample_clock_priv.reference_end_ticks;
+    }
+    else {
+        jitter_ticks = sample_clock_priv.reference_end_ticks - end_ticks;
+    }
+
+    if (jitter_ticks > sample_clock_priv.stats.max_jitter_ticks) {
+        sample_clock_priv.stats.max_jitter_ticks = jitter_ticks;
+    }
+    sample_clock_priv.stats.jitter_hist[sample_clock_jitter_bin(jitter_ticks)]++;
+}
+
+void sample_clock_get_stats(sample_clock_stats_t * stats) {
+
+    unsigned key = irq_lock();
+    *stats = sample_clock_priv.stats;
+    irq_unlock(key);
+}
+
+// Effective frame rate in milli-Hz. Ticks are exact, so this is the nominal rate minus the missed frames.
+uint32_t sample_clock_effective_rate_mhz(void) {
+
+    sample_clock_stats_t stats;
+    sample_clock_get_stats(&stats);
+
+    if (stats.ticks == 0) {
+        return 0;
+    }
+
+    // 1e12 / period_ns is the nominal rate in mHz, scaled by the fraction of ticks that actually started a frame
+    return (uint32_t) (((1000000000000ULL / stats.period_ns) * stats.frames) / stats.ticks);
+}
+
+void sample_clock_log_stats(void) {
+
+    sample_clock_stats_t stats;
+    sample_clock_get_stats(&stats);
+
+    LOG_INF("Sample clock: %d ticks, %d frames, %d overruns, effective rate %d mHz, max jitter %d ticks",
+            stats.ticks, stats.frames, stats.overruns, sample_clock_effective_rate_mhz(), stats.max_jitter_ticks);
+
+    for (int i = 0; i < SAMPLE_CLOCK_JITTER_HIST_BINS; i++) {
+        if (stats.jitter_hist[i]) {
+            LOG_INF("  jitter < %d ticks: %d", (1 << i), stats.jitter_hist[i]);
+        }
+    }
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <nrfx_timer.h>
+
+/*
+Hardware sample clock. A TIMER running at 16MHz fires every frame period and its COMPARE event starts the armed
+SPI frame directly through DPPI, so the Intan sample instants do not depend on thread scheduling.
+Requires CONFIG_NRFX_TIMER1=y.
+*/
+
+#define SAMPLE_CLOCK_TIMER              1
+#define SAMPLE_CLOCK_TICKS_PER_US       16  // NRF_TIMER_FREQ_16MHz
+#define SAMPLE_CLOCK_NS_TO_TICKS(ns)    (((uint64_t) (ns) * SAMPLE_CLOCK_TICKS_PER_US) / 1000)
+#define SAMPLE_CLOCK_MAX_TICKS          UINT32_MAX  // NRF_TIMER_BIT_WIDTH_32
+
+// Jitter histogram bins are powers of 2 of timer ticks (62.5ns): bin 0 = 0 ticks, bin k = [2^(k-1), 2^k) ticks.
+// The last bin collects everything bigger.
+#define SAMPLE_CLOCK_JITTER_HIST_BINS   12
+
+#define SAMPLE_CLOCK_STATS_LOG_INTERVAL_MS 10000
+
+typedef struct sample_clock_stats_t {
+    uint32_t period_ns;
+    uint32_t ticks;         // clock ticks since start
+    uint32_t frames;        // frames started by a clock tick
+    uint32_t overruns;      // ticks where no frame was armed or the previous one was still running (frame missed)
+    uint32_t max_jitter_ticks;
+    uint32_t jitter_hist[SAMPLE_CLOCK_JITTER_HIST_BINS];
+} sample_clock_stats_t;
+
+typedef struct sample_clock_priv_t {
+    bool initialized;
+    bool running;
+
+    // DPPI channel from the end of an SPI frame to a capture task of the clock timer
+    uint8_t end_capture_ppi_channel;
+
+    // Frame end time (relative to its tick) of the first frame, every other frame is compared against it
+    bool has_reference;
+    uint32_t reference_end_ticks;
+
+    sample_clock_stats_t stats;
+} sample_clock_priv_t;
+
+int sample_clock_init(void);
+int sample_clock_start(uint32_t period_ns);
+int sample_clock_set_period(uint32_t period_ns);
+void sample_clock_stop(void);
+bool sample_clock_is_running(void);
+void sample_clock_frame_done(void);
+void sample_clock_get_stats(sample_clock_stats_t * stats);
+uint32_t sample_clock_effective_rate_mhz(void);
+void sample_clock_log_stats(void);
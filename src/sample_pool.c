@@ -0,0 +1,97 @@
+/*
+This file contains the static pool of reference counted sample blocks.
+
+RAM used by sample data is SAMPLE_POOL_NUM_BLOCKS * sizeof(sample_block_t), all of it reserved at build time.
+Blocks are never copied between stages, only their pointer and a reference are handed on.
+*/
+
+#include <kernel.h>
+#include <logging/log.h>
+#include <sys/atomic.h>
+
+#include "sample_pool.h"
+
+#define LOG_MODULE_NAME       sample_pool_c
+LOG_MODULE_REGISTER(LOG_MODULE_NAME, LOG_LEVEL_INF);
+
+K_MEM_SLAB_DEFINE(sample_pool_slab, sizeof(sample_block_t), SAMPLE_POOL_NUM_BLOCKS, 4);
+
+sample_pool_stats_t sample_pool_stats;
+
+void sample_pool_init(void) {
+
+    memset(&sample_pool_stats, 0, sizeof(sample_pool_stats_t));
+    sample_pool_stats.min_free_blocks = SAMPLE_POOL_NUM_BLOCKS;
+}
+
+// Get an empty block holding one reference for the caller, NULL if all blocks are in use. Never blocks.
+sample_block_t * sample_pool_alloc(void) {
+
+    sample_block_t * block = NULL;
+
+    if (k_mem_slab_alloc(&sample_pool_slab, (void **) &block, K_NO_WAIT) != 0) {
+        sample_pool_stats.alloc_failures++;
+        return NULL;
+    }
+
+    uint32_t free_blocks = k_mem_slab_num_free_get(&sample_pool_slab);
+    if (free_blocks < sample_pool_stats.min_free_blocks) {
+        sample_pool_stats.min_free_blocks = free_blocks;
+    }
+
+    atomic_set(&block->ref_count, 1);
+    block->type = SAMPLE_BLOCK_SAMPLES;
+    block->sample_count = 0;
+    block->msg.header.first_index = 0;
+    block->msg.header.channel_mask = 0;
+
+    return block;
+}
+
+void sample_pool_ref(sample_block_t * block) {
+    atomic_inc(&block->ref_count);
+}
+
+// Drop one reference, the block is returned to the pool when it was the last one
+void sample_pool_unref(sample_block_t * block) {
+
+    // atomic_dec returns the value before decrementing
+    if (atomic_dec(&block->ref_count) == 1) {
+        k_mem_slab_free(&sample_pool_slab, (void **) &block);
+    }
+}
+
+// Bytes of the block that go to the host
+size_t sample_block_length(const sample_block_t * block) {
+
+    if (block->type == SAMPLE_BLOCK_SPIKES) {
+        return offsetof(hostcomm_spike_message_t, spikes) + block->sample_count * sizeof(hostcomm_spike_t);
+    }
+    if (block->type == SAMPLE_BLOCK_COMPRESSED) {
+        return offsetof(hostcomm_compressed_message_t, data) + block->sample_count;
+    }
+    if (block->type == SAMPLE_BLOCK_FEATURES) {
+        return offsetof(hostcomm_feature_message_t, data) + block->sample_count;
+    }
+    if (block->type == SAMPLE_BLOCK_DC) {
+        return offsetof(hostcomm_dc_message_t, data) + block->sample_count;
+    }
+    if (block->type == SAMPLE_BLOCK_CONTROL) {
+        return offsetof(hostcomm_control_message_t, outputs) + block->sample_count * sizeof(int16_t);
+    }
+    if (block->type == SAMPLE_BLOCK_LFP) {
+        return offsetof(hostcomm_lfp_message_t, samples) + block->sample_count * sizeof(hostcomm_sample_t);
+    }
+    if (block->type == SAMPLE_BLOCK_REGISTER) {
+        return sizeof(hostcomm_register_message_t);
+    }
+    if (block->type == SAMPLE_BLOCK_UNITS) {
+        return offsetof(hostcomm_unit_message_t, events) + block->sample_count * sizeof(hostcomm_unit_event_t);
+    }
+
+    return offsetof(outgoing_message_struct_t, channel_data) + block->sample_count * sizeof(hostcomm_sample_t);
+}
+
+void sample_pool_get_stats(sample_pool_stats_t * stats) {
+    *stats = sample_pool_stats;
+}
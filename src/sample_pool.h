@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stdint.h>
+#include <kernel.h>
+#include <sys/atomic.h>
+#include "config.h"
+#include "hostcomm.h"
+
+/*
+Fixed-size, reference counted sample blocks backed by a k_mem_slab sized at build time.
+A block is filled once by acquisition and then only passed around by pointer. Every holder (sample ring, hostcomm,
+each transport sending it) owns one reference, and the block goes back to the slab when the last one is dropped.
+*/
+
+// The type of a block is the payload type of its packet, hostcomm puts it into the header
+typedef enum sample_block_type_t {
+    SAMPLE_BLOCK_SAMPLES = HOSTCOMM_PAYLOAD_SAMPLES,                 // msg holds raw samples
+    SAMPLE_BLOCK_SPIKES = HOSTCOMM_PAYLOAD_SPIKES,                   // spike_msg holds detected spikes
+    SAMPLE_BLOCK_UNITS = HOSTCOMM_PAYLOAD_UNITS,                     // unit_msg holds sorted spikes
+    SAMPLE_BLOCK_COMPRESSED = HOSTCOMM_PAYLOAD_COMPRESSED_SAMPLES,   // compressed_msg holds the samples of msg, compressed
+    SAMPLE_BLOCK_LFP = HOSTCOMM_PAYLOAD_LFP_SAMPLES,                 // lfp_msg holds decimated samples
+    SAMPLE_BLOCK_FEATURES = HOSTCOMM_PAYLOAD_FEATURES,               // feature_msg holds band power records
+    SAMPLE_BLOCK_CONTROL = HOSTCOMM_PAYLOAD_CONTROL,                 // control_msg holds decoder outputs
+    SAMPLE_BLOCK_DC = HOSTCOMM_PAYLOAD_DC_SAMPLES,                   // dc_msg holds DC amplifier values
+    SAMPLE_BLOCK_REGISTER = HOSTCOMM_PAYLOAD_REGISTER,               // register_msg holds a register read
+} sample_block_type_t;
+
+typedef struct sample_block_t {
+    atomic_t ref_count;
+    uint8_t type;
+    // samples in msg or lfp_msg, spikes in spike_msg, events in unit_msg, bytes of compressed_msg.data or
+    // feature_msg.data or dc_msg.data, outputs in control_msg, 1 for register_msg
+    uint16_t sample_count;
+    // laid out exactly as it goes to the host, all of them start with hostcomm_packet_header_t. The producer fills in
+    // first_index and channel_mask of the header, hostcomm the rest.
+    union {
+        outgoing_message_struct_t msg;
+        hostcomm_spike_message_t spike_msg;
+        hostcomm_unit_message_t unit_msg;
+        hostcomm_compressed_message_t compressed_msg;
+        hostcomm_lfp_message_t lfp_msg;
+        hostcomm_feature_message_t feature_msg;
+        hostcomm_control_message_t control_msg;
+        hostcomm_dc_message_t dc_msg;
+        hostcomm_register_message_t register_msg;
+    };
+} sample_block_t;
+
+BUILD_ASSERT(sizeof(hostcomm_spike_message_t) <= sizeof(outgoing_message_struct_t),
+             "Spike packets must not make sample blocks bigger");
+BUILD_ASSERT(sizeof(hostcomm_unit_message_t) <= sizeof(outgoing_message_struct_t),
+             "Unit packets must not make sample blocks bigger");
+BUILD_ASSERT(sizeof(hostcomm_compressed_message_t) <= sizeof(outgoing_message_struct_t),
+             "Compressed packets must not make sample blocks bigger");
+BUILD_ASSERT(sizeof(hostcomm_lfp_message_t) <= sizeof(outgoing_message_struct_t),
+             "LFP packets must not make sample blocks bigger");
+BUILD_ASSERT(sizeof(hostcomm_feature_message_t) <= sizeof(outgoing_message_struct_t),
+             "Feature packets must not make sample blocks bigger");
+BUILD_ASSERT(sizeof(hostcomm_control_message_t) <= sizeof(outgoing_message_struct_t),
+             "Control packets must not make sample blocks bigger");
+BUILD_ASSERT(sizeof(hostcomm_dc_message_t) <= sizeof(outgoing_message_struct_t),
+             "DC packets must not make sample blocks bigger");
+BUILD_ASSERT(sizeof(hostcomm_register_message_t) <= sizeof(outgoing_message_struct_t),
+             "Register packets must not make sample blocks bigger");
+
+typedef struct sample_pool_stats_t {
+    uint32_t alloc_failures;
+    uint32_t min_free_blocks; // low water mark of free blocks
+} sample_pool_stats_t;
+
+void sample_pool_init(void);
+sample_block_t * sample_pool_alloc(void);
+void sample_pool_ref(sample_block_t * block);
+void sample_pool_unref(sample_block_t * block);
+size_t sample_block_length(const sample_block_t * block);
+void sample_pool_get_stats(sample_pool_stats_t * stats);
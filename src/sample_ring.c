@@ -0,0 +1,118 @@
+/*
+This file contains the lock-free sample ring between acquisition and hostcomm.
+
+Producer (Intan thread):  sample_pool_alloc() -> fill block -> sample_ring_put()
+Consumer (hostcomm):      sample_ring_get()   -> send block -> sample_pool_unref()
+
+The producer's reference travels through the ring to the consumer, so the block is never copied.
+When no block can be stored the producer reports the samples it lost with sample_ring_drop(),
+so every lost sample shows up in the statistics.
+*/
+
+#include <kernel.h>
+#include <logging/log.h>
+#include <sys/atomic.h>
+
+#include "sample_ring.h"
+
+#define LOG_MODULE_NAME       sample_ring_c
+LOG_MODULE_REGISTER(LOG_MODULE_NAME, LOG_LEVEL_INF);
+
+sample_ring_priv_t sample_ring_priv;
+
+void sample_ring_init(void) {
+
+    memset(&sample_ring_priv, 0, sizeof(sample_ring_priv_t));
+    k_sem_init(&sample_ring_priv.data_ready, 0, SAMPLE_RING_NUM_BLOCKS + SAMPLE_RING_NUM_URGENT);
+    sample_pool_init();
+}
+
+// Producer: hand a filled block (and the caller's reference to it) to the consumer. False if the ring is full.
+bool sample_ring_put(sample_block_t * block) {
+
+    uint32_t head = atomic_get(&sample_ring_priv.head);
+    uint32_t tail = atomic_get(&sample_ring_priv.tail);
+
+    if (head - tail >= SAMPLE_RING_NUM_BLOCKS) {
+        return false;
+    }
+
+    sample_ring_priv.blocks[head % SAMPLE_RING_NUM_BLOCKS] = block;
+
+    // atomic_set is a full barrier, so the slot is visible before the consumer sees the new head
+    atomic_set(&sample_ring_priv.head, head + 1);
+
+    if (head + 1 - tail > sample_ring_priv.stats.high_water_mark) {
+        sample_ring_priv.stats.high_water_mark = head + 1 - tail;
+    }
+    sample_ring_priv.stats.committed_blocks++;
+
+    k_sem_give(&sample_ring_priv.data_ready);
+
+    return true;
+}
+
+// Producer: hand a block to the consumer ahead of the ones already queued. False if the urgent ring is full.
+bool sample_ring_put_urgent(sample_block_t * block) {
+
+    uint32_t head = atomic_get(&sample_ring_priv.urgent_head);
+    uint32_t tail = atomic_get(&sample_ring_priv.urgent_tail);
+
+    if (head - tail >= SAMPLE_RING_NUM_URGENT) {
+        return false;
+    }
+
+    sample_ring_priv.urgent[head % SAMPLE_RING_NUM_URGENT] = block;
+    atomic_set(&sample_ring_priv.urgent_head, head + 1);
+    sample_ring_priv.stats.committed_blocks++;
+
+    k_sem_give(&sample_ring_priv.data_ready);
+
+    return true;
+}
+
+// Producer: account for samples that could not be stored
+void sample_ring_drop(uint32_t num_samples) {
+    sample_ring_priv.stats.dropped_samples += num_samples;
+}
+
+// Consumer: take the oldest urgent block, or else the oldest block, the caller now owns its reference. NULL on timeout.
+sample_block_t * sample_ring_get(k_timeout_t timeout) {
+
+    if (k_sem_take(&sample_ring_priv.data_ready, timeout)) {
+        return NULL;
+    }
+
+    uint32_t urgent_tail = atomic_get(&sample_ring_priv.urgent_tail);
+
+    if (atomic_get(&sample_ring_priv.urgent_head) != urgent_tail) {
+        sample_block_t * block = sample_ring_priv.urgent[urgent_tail % SAMPLE_RING_NUM_URGENT];
+        atomic_set(&sample_ring_priv.urgent_tail, urgent_tail + 1);
+        return block;
+    }
+
+    uint32_t tail = atomic_get(&sample_ring_priv.tail);
+    sample_block_t * block = sample_ring_priv.blocks[tail % SAMPLE_RING_NUM_BLOCKS];
+
+    atomic_set(&sample_ring_priv.tail, tail + 1);
+
+    return block;
+}
+
+void sample_ring_get_stats(sample_ring_stats_t * stats) {
+    *stats = sample_ring_priv.stats;
+}
+
+void sample_ring_log_stats(void) {
+
+    sample_ring_stats_t stats;
+    sample_pool_stats_t pool_stats;
+    sample_ring_get_stats(&stats);
+    sample_pool_get_stats(&pool_stats);
+
+    LOG_INF("Sample ring: %d blocks committed, %d samples dropped, high water mark %d/%d blocks",
+            stats.committed_blocks, stats.dropped_samples, stats.high_water_mark, SAMPLE_RING_NUM_BLOCKS);
+    LOG_INF("Sample pool: %d blocks of %d bytes, min free %d, %d alloc failures",
+            SAMPLE_POOL_NUM_BLOCKS, sizeof(sample_block_t),
+            pool_stats.min_free_blocks, pool_stats.alloc_failures);
+}
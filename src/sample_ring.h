@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdint.h>
+#include <kernel.h>
+#include "config.h"
+#include "sample_pool.h"
+
+/*
+Single-producer/single-consumer ring of sample block pointers between the Intan thread (producer) and hostcomm
+(consumer). The blocks themselves live in the sample pool, the ring only hands over the producer's reference.
+No locks: head is only written by the producer, tail only by the consumer.
+
+A second, short ring holds urgent blocks (decoder output). The consumer always empties it first, so an urgent block
+only waits for the block being sent and not for everything queued before it.
+*/
+
+BUILD_ASSERT((SAMPLE_RING_NUM_BLOCKS & (SAMPLE_RING_NUM_BLOCKS - 1)) == 0, "SAMPLE_RING_NUM_BLOCKS must be a power of 2");
+BUILD_ASSERT(SAMPLE_RING_NUM_BLOCKS >= SAMPLE_POOL_NUM_BLOCKS, "Sample ring must be able to hold every pool block");
+BUILD_ASSERT((SAMPLE_RING_NUM_URGENT & (SAMPLE_RING_NUM_URGENT - 1)) == 0, "SAMPLE_RING_NUM_URGENT must be a power of 2");
+
+typedef struct sample_ring_stats_t {
+    uint32_t committed_blocks;
+    uint32_t dropped_samples;   // samples thrown away because no block was free
+    uint32_t high_water_mark;   // most blocks ever waiting for the consumer at once
+} sample_ring_stats_t;
+
+typedef struct sample_ring_priv_t {
+    sample_block_t * blocks[SAMPLE_RING_NUM_BLOCKS];
+
+    // Free running indices, slot = index % SAMPLE_RING_NUM_BLOCKS
+    atomic_t head; // next slot the producer writes
+    atomic_t tail; // next slot the consumer reads
+
+    // Urgent blocks, same scheme
+    sample_block_t * urgent[SAMPLE_RING_NUM_URGENT];
+    atomic_t urgent_head;
+    atomic_t urgent_tail;
+
+    // Counts queued blocks of both rings so the consumer can sleep while they are empty
+    struct k_sem data_ready;
+
+    sample_ring_stats_t stats;
+} sample_ring_priv_t;
+
+void sample_ring_init(void);
+bool sample_ring_put(sample_block_t * block);
+bool sample_ring_put_urgent(sample_block_t * block);
+void sample_ring_drop(uint32_t num_samples);
+sample_block_t * sample_ring_get(k_timeout_t timeout);
+void sample_ring_get_stats(sample_ring_stats_t * stats);
+void sample_ring_log_stats(void);
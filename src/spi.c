@@ -1,55 +1,200 @@
-#include <drivers/gpio.h>
-#include <drivers/spi.h>
+#include <devicetree.h>
 #include <logging/log.h>
+#include <nrfx_dppi.h>
+#include <helpers/nrfx_gppi.h>
+#include <hal/nrf_gpio.h>
 
 #define LOG_MODULE_NAME         nordic_spi_c
 LOG_MODULE_REGISTER(LOG_MODULE_NAME, LOG_LEVEL_ERR);
 
 #include "spi.h"
 
+#define SPI_NODE                DT_NODELABEL(spi4)
+#define SPI_FRAME_COUNTER_NODE  DT_NODELABEL(UTIL_CAT(timer, CONFIG_SPI_FRAME_COUNTER_TIMER))
+
 ///Private///
 struct spi_priv_t spi_priv;
 
 ///SPI///
-struct device * spi_dev;
+static const nrfx_spim_t spim = NRFX_SPIM_INSTANCE(4);
+static const nrfx_timer_t frame_counter = NRFX_TIMER_INSTANCE(CONFIG_SPI_FRAME_COUNTER_TIMER);
+
+
+// SPIM only supports a few fixed frequencies, pick the fastest one that does not exceed the requested frequency
+static nrf_spim_frequency_t spi_get_nrf_frequency(uint32_t frequency) {
+
+	if (frequency >= MHZ(32)) {
+		return NRF_SPIM_FREQ_32M;
+	} else if (frequency >= MHZ(16)) {
+		return NRF_SPIM_FREQ_16M;
+	} else if (frequency >= MHZ(8)) {
+		return NRF_SPIM_FREQ_8M;
+	} else if (frequency >= MHZ(4)) {
+		return NRF_SPIM_FREQ_4M;
+	} else if (frequency >= MHZ(2)) {
+		return NRF_SPIM_FREQ_2M;
+	} else if (frequency >= MHZ(1)) {
+		return NRF_SPIM_FREQ_1M;
+	} else if (frequency >= KHZ(500)) {
+		return NRF_SPIM_FREQ_500K;
+	} else if (frequency >= KHZ(250)) {
+		return NRF_SPIM_FREQ_250K;
+	}
+	return NRF_SPIM_FREQ_125K;
+}
+
+// The SCK rate spi_get_nrf_frequency() ends up with
+static uint32_t spi_get_sck_hz(uint32_t frequency) {
+
+	static const uint32_t rates_hz[] = {
+		MHZ(32), MHZ(16), MHZ(8), MHZ(4), MHZ(2), MHZ(1), KHZ(500), KHZ(250),
+	};
+
+	for (int i = 0; i < ARRAY_SIZE(rates_hz); i++) {
+		if (frequency >= rates_hz[i]) {
+			return rates_hz[i];
+		}
+	}
+	return KHZ(125);
+}
+
+// Time num_words words of word_length bytes take on the wire, including the CS high time between words
+uint32_t spi_frame_time_ns(size_t word_length, size_t num_words) {
+
+	uint64_t word_ns = (uint64_t) word_length * 8 * NSEC_PER_SEC / spi_get_sck_hz(CONFIG_SPI_FREQ_HZ) +
+			   (uint64_t) CONFIG_SPI_CSN_DURATION_TICKS * NSEC_PER_SEC / MHZ(64);
+
+	return (uint32_t) MIN(word_ns * num_words, UINT32_MAX);
+}
+
+// How long to wait for a transfer before calling the hardware stuck
+uint32_t spi_frame_timeout_ms(size_t word_length, size_t num_words) {
+	return SPI_FRAME_TIMEOUT_FACTOR * (uint64_t) spi_frame_time_ns(word_length, num_words) / NSEC_PER_MSEC +
+	       SPI_FRAME_TIMEOUT_MARGIN_MS;
+}
+
+// Called from interrupt context when a single word transfer (spi_send_receive) is done
+static void spi_event_handler(nrfx_spim_evt_t const * p_event, void * p_context) {
+
+	if (p_event->type == NRFX_SPIM_EVENT_DONE) {
+		k_sem_give(&spi_priv.xfer_done);
+	}
+}
+
+// Called from interrupt context when the word counter reaches the end of a frame
+static void spi_frame_counter_handler(nrf_timer_event_t event_type, void * p_context) {
+
+	spi_frame_done_cb_t cb = spi_priv.frame_done_cb;
+
+	if (event_type != NRF_TIMER_EVENT_COMPARE1) {
+		return;
+	}
 
-struct spi_cs_control spi_cs = {
-	.gpio_dev = NULL,
-	.gpio_pin = CONFIG_SPI_CS_CTRL_GPIO_PIN,
-	.gpio_dt_flags = GPIO_ACTIVE_LOW,
-	.delay = 1,
-};
+	// The restart chain was already cut by hardware and the counter stopped itself, so the frame is fully done.
+	// The END of the last word follows its ENDRX within a peripheral clock, long before anything here can re-arm.
+	spi_priv.frame_state = SPI_FRAME_IDLE;
+
+	// NULL if the frame was aborted
+	if (cb) {
+		spi_priv.frame_done_cb = NULL;
+		cb(0, spi_priv.frame_done_user_data);
+	}
+}
+
+/*
+Connect the hardware so that a frame runs without any CPU involvement once the first word is started:
+  SPIM END + trigger event -> SPIM START      (restart channel, member of restart group)
+  SPIM STARTED + SPIM ENDRX -> COUNTER COUNT  (count channel, always enabled)
+  COUNTER COMPARE0 (last word started) -> disable restart group (stop channel)
+  COUNTER COMPARE1 (last word finished) -> interrupt
 
-static const struct spi_config spi_cfg = {
-	.operation = SPI_WORD_SET(8) | SPI_TRANSFER_MSB | SPI_MODE_CPHA,
-	.frequency = CONFIG_SPI_FREQ_HZ,
-	.slave = 0,
-    .cs = &spi_cs
-};
+With DPPI every event publishes to one channel only, so END cannot also drive the counter outside the restart group.
+The counter counts two events per word instead, which both keep counting after the restart group is disabled:
+word k has started at 2k - 1 and its last byte is in at 2k. The group is disabled a whole word before the last END.
 
+For the same reason SPIM START can only listen to one channel, so the trigger event publishes into the restart channel
+too. Arming a frame is enabling the restart group: the trigger starts the first word, END the others, and COMPARE0
+closes the group again once the last word has started, so one arm gives exactly one frame. A trigger that comes while
+a frame is still running would restart SPIM in the middle of a word, so the frame period must be longer than the
+frame takes on the wire (see spi_frame_time_ns()).
+*/
+static int spi_frame_ppi_init(void) {
+
+	nrfx_timer_config_t counter_cfg = NRFX_TIMER_DEFAULT_CONFIG;
+	counter_cfg.mode = NRF_TIMER_MODE_COUNTER;
+	counter_cfg.bit_width = NRF_TIMER_BIT_WIDTH_16;
+
+	if (nrfx_timer_init(&frame_counter, &counter_cfg, spi_frame_counter_handler) != NRFX_SUCCESS) {
+		return -EIO;
+	}
+
+	if (nrfx_dppi_channel_alloc(&spi_priv.restart_ppi_channel) != NRFX_SUCCESS ||
+	    nrfx_dppi_channel_alloc(&spi_priv.count_ppi_channel) != NRFX_SUCCESS ||
+	    nrfx_dppi_channel_alloc(&spi_priv.stop_ppi_channel) != NRFX_SUCCESS ||
+	    nrfx_dppi_group_alloc(&spi_priv.restart_ppi_group) != NRFX_SUCCESS) {
+		return -EBUSY;
+	}
+
+	nrfx_gppi_channel_endpoints_setup(spi_priv.restart_ppi_channel,
+					  nrfx_spim_end_event_get(&spim),
+					  nrfx_spim_start_task_get(&spim));
+	nrfx_dppi_channel_include_in_group(spi_priv.restart_ppi_channel, spi_priv.restart_ppi_group);
+
+	// The counter only counts while a frame is set up, single word transfers leave it alone
+	nrfx_gppi_channel_endpoints_setup(spi_priv.count_ppi_channel,
+					  nrf_spim_event_address_get(spim.p_reg, NRF_SPIM_EVENT_STARTED),
+					  nrfx_timer_task_address_get(&frame_counter, NRF_TIMER_TASK_COUNT));
+	nrfx_gppi_event_endpoint_setup(spi_priv.count_ppi_channel,
+				       nrf_spim_event_address_get(spim.p_reg, NRF_SPIM_EVENT_ENDRX));
+	nrfx_dppi_channel_enable(spi_priv.count_ppi_channel);
+
+	nrfx_gppi_channel_endpoints_setup(spi_priv.stop_ppi_channel,
+					  nrfx_timer_compare_event_address_get(&frame_counter, NRF_TIMER_CC_CHANNEL0),
+					  nrf_dppi_task_address_get(NRF_DPPIC,
+						nrf_dppi_group_disable_task_get((uint8_t) spi_priv.restart_ppi_group)));
+	nrfx_dppi_channel_enable(spi_priv.stop_ppi_channel);
+
+	// The trigger event itself is connected later by whoever paces the frames, see spi_frame_trigger_connect()
+
+	return 0;
+}
 
 void spi_init(void) {
 
-	const char* const spiName = CONFIG_SPI_NAME;
-	
+	nrfx_spim_config_t spim_cfg = NRFX_SPIM_DEFAULT_CONFIG(
+		DT_PROP(SPI_NODE, sck_pin),
+		DT_PROP(SPI_NODE, mosi_pin),
+		DT_PROP(SPI_NODE, miso_pin),
+		NRF_GPIO_PIN_MAP(CONFIG_SPI_CS_CTRL_GPIO_PORT, CONFIG_SPI_CS_CTRL_GPIO_PIN));
+
 	if (spi_priv.is_initialized) {
 		// skip init if this was previously initialized
 		return;
 	}
 
-	spi_dev = device_get_binding(spiName);
+	k_sem_init(&spi_priv.xfer_done, 0, 1);
+
+	spim_cfg.frequency = spi_get_nrf_frequency(CONFIG_SPI_FREQ_HZ);
+	spim_cfg.mode = NRF_SPIM_MODE_1;
+	spim_cfg.bit_order = NRF_SPIM_BIT_ORDER_MSB_FIRST;
+	// Let SPIM4 drive CS itself so it is toggled for each word of a frame without CPU involvement
+	spim_cfg.use_hw_ss = true;
+	spim_cfg.ss_active_high = false;
+	spim_cfg.ss_duration = CONFIG_SPI_CSN_DURATION_TICKS;
+
+	IRQ_CONNECT(DT_IRQN(SPI_NODE), DT_IRQ(SPI_NODE, priority), nrfx_isr, nrfx_spim_4_irq_handler, 0);
+	IRQ_CONNECT(DT_IRQN(SPI_FRAME_COUNTER_NODE), DT_IRQ(SPI_FRAME_COUNTER_NODE, priority), nrfx_isr,
+		    NRFX_CONCAT_3(nrfx_timer_, CONFIG_SPI_FRAME_COUNTER_TIMER, _irq_handler), 0);
 
-	if (spi_dev == NULL) {
-		printk("Could not get %s device\n", spiName);
+	if (nrfx_spim_init(&spim, &spim_cfg, spi_event_handler, NULL) != NRFX_SUCCESS) {
+		printk("Could not initialize %s\n", CONFIG_SPI_NAME);
 		spi_priv.is_initialized = false;
 		return;
 	}
 
-	// The chip select GPIO needs to be obtained separate from SPI initialization.
-	spi_cs.gpio_dev = device_get_binding(CONFIG_SPI_CS_CTRL_GPIO_DEV);
-
-	if (spi_cs.gpio_dev == NULL) {
-		printk("Could not get %s device\n", CONFIG_SPI_CS_CTRL_GPIO_DEV);
+	if (spi_frame_ppi_init()) {
+		printk("Could not allocate frame transfer resources for %s\n", CONFIG_SPI_NAME);
+		nrfx_spim_uninit(&spim);
 		spi_priv.is_initialized = false;
 		return;
 	}
@@ -67,40 +212,120 @@ Send to SPI and also read back data at the same time.
 int spi_send_receive(uint8_t * send_buf, size_t send_length, uint8_t * recv_buf, size_t recv_length) {
 	int err = 0;
 
-	// Nordic SPI driver requires things to be converted to their special structs before sending/receiving
-	struct spi_buf tx_buf = {
-		.buf = send_buf,
-		.len = send_length
-	};
-	struct spi_buf_set tx = {
-		.buffers = &tx_buf,
-		.count = 1
-	};
-
-	struct spi_buf rx_buf = {
-		.buf = recv_buf,
-		.len = recv_length,
-	};
-	struct spi_buf_set rx = {
-		.buffers = &rx_buf,
-		.count = 1
-	};
+	nrfx_spim_xfer_desc_t xfer = NRFX_SPIM_XFER_TRX(send_buf, send_length, recv_buf, recv_length);
 
-	err = spi_transceive(spi_dev, &spi_cfg, &tx, &rx);
+	if (nrfx_spim_xfer(&spim, &xfer, 0) != NRFX_SUCCESS) {
+		err = -EIO;
+	}
+	else if (k_sem_take(&spi_priv.xfer_done, K_MSEC(spi_frame_timeout_ms(send_length, 1)))) {
+		nrfx_spim_abort(&spim);
+		err = -ETIMEDOUT;
+	}
 
 	if (err) {
 		LOG_ERR("SPI error: %d\n", err);
 	}
 	else {
-		/* Connect MISO to MOSI for loopback */
 		LOG_DBG("TX sent: %x %x %x %x\n", send_buf[0], send_buf[1], send_buf[2], send_buf[3]);
 		LOG_DBG("RX recv: %x %x %x %x\n", recv_buf[0], recv_buf[1], recv_buf[2], recv_buf[3]);
-		//tx_buffer[0]++;
-	}	
+	}
 
 	return err;
 }
 
+// Set up the word counter, the restart chain and the DMA pointers of a frame, without starting it
+static int spi_frame_setup(uint8_t * send_buf, uint8_t * recv_buf, size_t word_length, size_t num_words) {
+
+	nrfx_spim_xfer_desc_t xfer = NRFX_SPIM_XFER_TRX(send_buf, word_length, recv_buf, word_length);
+
+	if (num_words == 0 || spi_priv.frame_state != SPI_FRAME_IDLE) {
+		return -EINVAL;
+	}
+
+	spi_priv.frame_done_cb = NULL;
+
+	// COMPARE0: last word has started, stop restarting. COMPARE1: last word done, stop counting and interrupt.
+	nrfx_timer_clear(&frame_counter);
+	nrfx_timer_compare(&frame_counter, NRF_TIMER_CC_CHANNEL0, 2 * num_words - 1, false);
+	nrfx_timer_extended_compare(&frame_counter, NRF_TIMER_CC_CHANNEL1, 2 * num_words,
+				    NRF_TIMER_SHORT_COMPARE1_STOP_MASK, true);
+	nrfx_timer_enable(&frame_counter);
+
+	// POSTINC turns TXD/RXD into an ArrayList, so every START automatically moves on to the next word
+	if (nrfx_spim_xfer(&spim, &xfer, NRFX_SPIM_FLAG_TX_POSTINC | NRFX_SPIM_FLAG_RX_POSTINC |
+					  NRFX_SPIM_FLAG_HOLD_XFER | NRFX_SPIM_FLAG_REPEATED_XFER |
+					  NRFX_SPIM_FLAG_NO_XFER_EVT_HANDLER) != NRFX_SUCCESS) {
+		nrfx_dppi_group_disable(spi_priv.restart_ppi_group);
+		nrfx_timer_disable(&frame_counter);
+		return -EIO;
+	}
+
+	return 0;
+}
+
+/*
+Arm a frame of num_words words of word_length bytes each, sent in a single DMA transaction with CS toggled between
+every word. send_buf and recv_buf hold all words back to back (EasyDMA ArrayList), so both must be
+num_words * word_length long. The first word is started by the trigger event connected with
+spi_frame_trigger_connect(), so the frame starts exactly on the trigger.
+Returns right away, cb is called from interrupt context once the frame has finished. Nothing blocks while the frame
+runs, and cb can arm the next frame right away.
+*/
+int spi_frame_arm_async(uint8_t * send_buf, uint8_t * recv_buf, size_t word_length, size_t num_words,
+			spi_frame_done_cb_t cb, void * user_data) {
+
+	int err = spi_frame_setup(send_buf, recv_buf, word_length, num_words);
+
+	if (err) {
+		LOG_ERR("SPI async frame arm error: %d, %d words\n", err, num_words);
+		return err;
+	}
+
+	spi_priv.frame_done_cb = cb;
+	spi_priv.frame_done_user_data = user_data;
+	spi_priv.frame_state = SPI_FRAME_ARMED;
+	nrfx_dppi_group_enable(spi_priv.restart_ppi_group);
+
+	return 0;
+}
+
+// Cancel any armed or running frame, its completion callback will not be called
+void spi_frame_abort(void) {
+
+	unsigned key = irq_lock();
+
+	spi_priv.frame_done_cb = NULL;
+	nrfx_dppi_group_disable(spi_priv.restart_ppi_group);
+	nrfx_spim_abort(&spim);
+	nrfx_timer_disable(&frame_counter);
+	spi_priv.frame_state = SPI_FRAME_IDLE;
+
+	irq_unlock(key);
+}
+
+/*
+Called from the interrupt of the trigger event, after the hardware has already acted on it.
+Returns true if an armed frame was started by this trigger, false if there was nothing armed (frame missed).
+*/
+bool spi_frame_trigger_notify(void) {
+
+	if (spi_priv.frame_state == SPI_FRAME_ARMED) {
+		spi_priv.frame_state = SPI_FRAME_RUNNING;
+		return true;
+	}
+	return false;
+}
+
+// Start armed frames on the given hardware event (e.g. a TIMER COMPARE event)
+void spi_frame_trigger_connect(uint32_t event_address) {
+	nrfx_gppi_event_endpoint_setup(spi_priv.restart_ppi_channel, event_address);
+}
+
+// Hardware event generated when the last word of a frame has finished
+uint32_t spi_frame_end_event_get(void) {
+	return nrfx_timer_compare_event_address_get(&frame_counter, NRF_TIMER_CC_CHANNEL1);
+}
+
 /*
 This function is only for testing SPI connection.
 */
@@ -110,25 +335,7 @@ void spi_test_send(void)
 	uint8_t tx_buffer[4] = {0xC0, 0xFF, 0x00, 0x00};
 	uint8_t rx_buffer[4] = {0x00};
 
-	const struct spi_buf tx_buf = {
-		.buf = tx_buffer,
-		.len = 4
-	};
-	const struct spi_buf_set tx = {
-		.buffers = &tx_buf,
-		.count = 1
-	};
-
-	const struct spi_buf rx_buf = {
-		.buf = rx_buffer,
-		.len = 4,
-	};
-	const struct spi_buf_set rx = {
-		.buffers = &rx_buf,
-		.count = 1
-	};
-
-	err = spi_transceive(spi_dev, &spi_cfg, &tx, &rx);
+	err = spi_send_receive(tx_buffer, sizeof(tx_buffer), rx_buffer, sizeof(rx_buffer));
 	if (err) {
 		printk("SPI error: %d\n", err);
 	} else {
@@ -136,5 +343,5 @@ void spi_test_send(void)
 		printk("TX sent: %x %x %x %x\n", tx_buffer[0], tx_buffer[1], tx_buffer[2], tx_buffer[3]);
 		printk("RX recv: %x %x %x %x\n", rx_buffer[0], rx_buffer[1], rx_buffer[2], rx_buffer[3]);
 		//tx_buffer[0]++;
-	}	
+	}
 }
\ No newline at end of file
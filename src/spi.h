@@ -2,20 +2,77 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <kernel.h>
+#include <nrfx_spim.h>
+#include <nrfx_timer.h>
+#include <hal/nrf_dppi.h>
+
+/*
+The Intan SPI runs directly on nrfx SPIM4 (not through the Zephyr SPI driver) so a whole Intan frame can be
+sent as one EasyDMA ArrayList transfer with the hardware CSN toggled for every 32-bit word.
+Requires CONFIG_NRFX_SPIM4=y, CONFIG_NRFX_TIMER2=y, CONFIG_NRFX_DPPI=y and the Zephyr SPI_4 driver disabled.
+*/
 
 /* Configurations SPI */
 #define CONFIG_SPI_NAME               "SPI_4"  // Using SPI 4, the only high speed spi
 #define CONFIG_SPI_CS_CTRL_GPIO_DEV   "GPIO_1"
+#define CONFIG_SPI_CS_CTRL_GPIO_PORT  1
 #define CONFIG_SPI_CS_CTRL_GPIO_PIN   12  // This has to match the dts overlay nrf5340dk_nrf5340_cpuapp.overlay
-#define CONFIG_SPI_FREQ_HZ          200000
-//#define CONFIG_SPI_FREQ_HZ           16000000
+#define CONFIG_SPI_FREQ_HZ           16000000  // A word takes 2us plus the CS high time, the Intan chip takes up to 24MHz
+
+// Minimum time CS stays high between 2 words, in 64MHz SPIM4 clock ticks. Intan needs >= 154ns.
+#define CONFIG_SPI_CSN_DURATION_TICKS 10
+
+// TIMER used in counter mode to count words of a frame transfer (counts SPIM END events)
+#define CONFIG_SPI_FRAME_COUNTER_TIMER 2
+
+// A transfer that takes SPI_FRAME_TIMEOUT_FACTOR times its time on the wire (spi_frame_time_ns()) plus the margin
+// means the hardware is stuck. The margin covers the kernel tick.
+#define SPI_FRAME_TIMEOUT_FACTOR      2
+#define SPI_FRAME_TIMEOUT_MARGIN_MS   2
+
 
+typedef enum {
+    SPI_FRAME_IDLE = 0,
+    SPI_FRAME_ARMED,    // frame is set up and waits for the hardware trigger
+    SPI_FRAME_RUNNING,  // frame was started by the trigger
+} spi_frame_state_t;
+
+// Called from interrupt context when an asynchronous frame has finished. It is safe to arm the next frame from here.
+typedef void (*spi_frame_done_cb_t)(int err, void * user_data);
 
 typedef struct spi_priv_t {
     bool is_initialized;
+
+    volatile spi_frame_state_t frame_state;
+
+    // Completion callback of the current frame
+    spi_frame_done_cb_t frame_done_cb;
+    void * frame_done_user_data;
+
+    // Given from interrupt context when a single word transfer has finished
+    struct k_sem xfer_done;
+
+    // DPPI channel that starts SPIM, on the trigger event for the first word and every time a word finishes after that.
+    // It is the only channel SPIM START listens to.
+    uint8_t restart_ppi_channel;
+    // DPPI channel that counts SPIM STARTED and ENDRX, two counts per word
+    uint8_t count_ppi_channel;
+    // DPPI channel that stops the restart chain once the last word of the frame has started
+    uint8_t stop_ppi_channel;
+    // Group holding restart_ppi_channel, enabled while a frame is armed or running and disabled from hardware
+    nrf_dppi_channel_group_t restart_ppi_group;
 } spi_priv_t;
 
 void spi_init(void);
 void spi_test_send(void);
 bool spi_is_initialized(void);
-int spi_send_receive(uint8_t * send_buf, size_t send_length, uint8_t * recv_buf, size_t recv_length);
\ No newline at end of file
+uint32_t spi_frame_time_ns(size_t word_length, size_t num_words);
+uint32_t spi_frame_timeout_ms(size_t word_length, size_t num_words);
+int spi_send_receive(uint8_t * send_buf, size_t send_length, uint8_t * recv_buf, size_t recv_length);
+int spi_frame_arm_async(uint8_t * send_buf, uint8_t * recv_buf, size_t word_length, size_t num_words,
+                        spi_frame_done_cb_t cb, void * user_data);
+void spi_frame_abort(void);
+bool spi_frame_trigger_notify(void);
+void spi_frame_trigger_connect(uint32_t event_address);
+uint32_t spi_frame_end_event_get(void);
@@ -0,0 +1,158 @@
+#!/usr/bin/env python3
+"""
+Reference decoder for compressed sample packets (HOSTCOMM_PAYLOAD_COMPRESSED_SAMPLES).
+
+The bit stream is described in src/intan_codec.h. Samples come back grouped by tag, in the order the tags first show
+up in the packet, and in their original order within a tag.
+
+    python3 intan_codec.py intan_codec_vectors.json
+
+decodes every test vector in the file and checks it against the samples it was encoded from.
+"""
+
+import json
+import sys
+
+CODEC_RESET = 32
+CODEC_ESCAPE = 24
+CODEC_ESCAPE_BITS = 20
+CODEC_MAX_K = 18
+
+PACKET_VERSION = 2
+PACKET_HEADER_LENGTH = 14
+PAYLOAD_COMPRESSED_SAMPLES = 3
+
+
+class BitReader:
+    def __init__(self, data):
+        self.data = data
+        self.pos = 0
+
+    def bits(self, n):
+        value = 0
+        for _ in range(n):
+            byte = self.data[self.pos >> 3]
+            value = (value << 1) | ((byte >> (7 - (self.pos & 7))) & 1)
+            self.pos += 1
+        return value
+
+
+def rice_k(a, n):
+    k = 0
+    while (n << k) < a and k < CODEC_MAX_K:
+        k += 1
+    return k
+
+
+def unzigzag(m):
+    return (m >> 1) ^ -(m & 1)
+
+
+def read_rice(reader, k):
+    q = 0
+    while q < CODEC_ESCAPE and reader.bits(1):
+        q += 1
+    if q == CODEC_ESCAPE:
+        return reader.bits(CODEC_ESCAPE_BITS)
+    return (q << k) | reader.bits(k)
+
+
+def decode_stream(data, num_samples):
+    """Decode the bit stream of one packet into a list of (tag, [samples])."""
+    reader = BitReader(data)
+    groups = []
+    decoded = 0
+
+    while decoded < num_samples:
+        tag = reader.bits(8)
+        count = reader.bits(7)
+        order = reader.bits(1)
+        k = reader.bits(5)
+        x = [reader.bits(16)]
+
+        a = 1 << k
+        n = 1
+        for i in range(1, count):
+            m = read_rice(reader, rice_k(a, n))
+            if order == 0 or i < 2:
+                prediction = x[i - 1]
+            else:
+                prediction = 2 * x[i - 1] - x[i - 2]
+            x.append(prediction + unzigzag(m))
+
+            a += m
+            n += 1
+            if n == CODEC_RESET:
+                a >>= 1
+                n >>= 1
+
+        groups.append((tag, x))
+        decoded += count
+
+    return groups
+
+
+def crc16(data, crc=0xFFFF):
+    """CRC-16/CCITT-FALSE, as in src/hostcomm_crc.c."""
+    for byte in data:
+        crc ^= byte << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) if crc & 0x8000 else (crc << 1)
+            crc &= 0xFFFF
+    return crc
+
+
+def decode_packet(packet):
+    """Decode a whole compressed sample packet as it arrives from the device.
+
+    Returns (seq, first_index, channel_mask, groups). The CRC covers everything after itself."""
+    if len(packet) < PACKET_HEADER_LENGTH + 1:
+        raise ValueError("packet too short")
+    if int.from_bytes(packet[0:2], "little") != crc16(packet[2:]):
+        raise ValueError("CRC mismatch")
+
+    version = packet[2]
+    payload_type = packet[3]
+    if version != PACKET_VERSION or payload_type != PAYLOAD_COMPRESSED_SAMPLES:
+        raise ValueError("not a compressed sample packet")
+
+    seq = int.from_bytes(packet[4:6], "little")
+    first_index = int.from_bytes(packet[6:10], "little")
+    channel_mask = int.from_bytes(packet[10:12], "little")
+    num_samples = packet[14]
+    return seq, first_index, channel_mask, decode_stream(packet[15:], num_samples)
+
+
+def group_samples(samples):
+    groups = {}
+    order = []
+    for tag, value in samples:
+        if tag not in groups:
+            groups[tag] = []
+            order.append(tag)
+        groups[tag].append(value)
+    return [(tag, groups[tag]) for tag in order]
+
+
+def check_vectors(path):
+    with open(path) as f:
+        vectors = json.load(f)
+
+    failures = 0
+    for i, vector in enumerate(vectors):
+        samples = [tuple(s) for s in vector["samples"]]
+        decoded = decode_stream(bytes.fromhex(vector["coded"]), len(samples))
+        if decoded != group_samples(samples):
+            print("vector %d (%s): MISMATCH" % (i, vector["name"]))
+            failures += 1
+        else:
+            print("vector %d (%s): ok, %d samples in %d bytes" % (i, vector["name"], len(samples),
+                                                                  len(vector["coded"]) // 2))
+    return failures
+
+
+if __name__ == "__main__":
+    if len(sys.argv) != 2:
+        print(__doc__)
+        sys.exit(2)
+    sys.exit(1 if check_vectors(sys.argv[1]) else 0)